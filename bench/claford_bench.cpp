@@ -0,0 +1,545 @@
+// Reproducible end-to-end benchmark of claford's pipeline on synthetic source trees, formatting
+// with the fake clang-format (see fake_clang_format.cpp) so the numbers measure claford and not
+// clang-format. For each tree size it measures:
+//
+// - Add All: scanning the tree and checking every file, until all of them have a status.
+// - Resident memory per tracked file, after Add All.
+// - Save-to-formatted latency: an unformatted file is written, claford is notified like by the file
+//   monitor and formats it as soon as it finds it unformatted (like `--auto-format`).
+// - ProcessMsgs drain rate: file change messages for unchanged files, the cheapest message and the
+//   most frequent one during branch switches and builds.
+//
+// Prints one JSON object per tree size, one per line.
+
+#include "app.h"
+#include "clang_format.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#    include <unistd.h>
+#elif defined(__APPLE__)
+#    include <mach/mach.h>
+#endif
+
+namespace fs = std::filesystem;
+namespace chr = std::chrono;
+
+namespace {
+constexpr size_t k_files_per_dir = 32;
+// Gives up if the app queue has been empty for this long without the measured phase finishing.
+constexpr auto k_stall_timeout = chr::seconds(120);
+constexpr std::string_view k_tree_stamp_filename = ".claford_bench_tree";
+
+struct BenchOptions {
+    std::vector<size_t> sizes = {1000, 100000, 1000000};
+    int depth = 4;
+    size_t file_size = 1000;
+    double unformatted_ratio = 0.1;
+    int latency_ms = 5;
+    int latency_us_per_file = 50;
+    int jobs = 0;
+    size_t saves = 100;
+    uint64_t seed = 1;
+    fs::path work_dir = fs::temp_directory_path() / "claford_bench";
+    fs::path clang_format_dir = CLAFORD_FAKE_CLANG_FORMAT_DIR;
+    std::optional<fs::path> output;
+};
+
+void DisplayHelp() {
+    fmt::print("claford_bench - benchmark claford on synthetic source trees\n");
+    fmt::print("Usage: claford_bench [options]\n\n");
+    fmt::print("   -h|--help: this help\n");
+    fmt::print("   --sizes N,N,...: number of files per tree (default: 1000,100000,1000000)\n");
+    fmt::print("   --depth N: directory levels above the files (default: 4)\n");
+    fmt::print("   --file-size BYTES: approximate size of each file (default: 1000)\n");
+    fmt::print("   --unformatted-ratio R: fraction of unformatted files (default: 0.1)\n");
+    fmt::print("   --latency-ms N: fake clang-format latency per invocation (default: 5)\n");
+    fmt::print("   --latency-us-per-file N: fake clang-format latency per file (default: 50)\n");
+    fmt::print("   -j|--jobs N: formatter threads (default: number of cores)\n");
+    fmt::print("   --saves N: save-to-formatted samples per tree (default: 100)\n");
+    fmt::print("   --seed N: seed of the tree generator (default: 1)\n");
+    fmt::print("   --work-dir DIR: where the trees are generated, reused if the parameters "
+               "match\n");
+    fmt::print("   --clang-format-dir DIR: directory of the clang-format to use instead of the "
+               "fake one\n");
+    fmt::print("   --output FILE: also append the results to FILE\n");
+}
+
+void SetEnv(const char* name, const std::string& value) {
+#if defined(_WIN32)
+    _putenv_s(name, value.c_str());
+#else
+    setenv(name, value.c_str(), 1);
+#endif
+}
+
+// Resident set size of the process, nullopt if not supported on the platform.
+std::optional<uint64_t> CurrentRssBytes() {
+#if defined(__linux__)
+    std::ifstream f("/proc/self/statm");
+    uint64_t total_pages = 0, resident_pages = 0;
+    if (!(f >> total_pages >> resident_pages)) {
+        return std::nullopt;
+    }
+    return resident_pages * uint64_t(sysconf(_SC_PAGESIZE));
+#elif defined(__APPLE__)
+    mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(
+            mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count)
+        != KERN_SUCCESS) {
+        return std::nullopt;
+    }
+    return info.resident_size;
+#else
+    return std::nullopt;
+#endif
+}
+
+// Deterministic layout and content of the files of a synthetic tree: `k_files_per_dir` files in
+// each leaf directory, `depth` levels of directories above them.
+class SyntheticTree {
+   public:
+    SyntheticTree(const BenchOptions& bo, size_t n)
+        : root(bo.work_dir / fmt::format("tree_{}", n))
+        , num_files(n)
+        , depth(std::max(1, bo.depth))
+        , file_size(bo.file_size)
+        , unformatted_ratio(bo.unformatted_ratio)
+        , seed(bo.seed) {
+        const auto num_dirs = (num_files + k_files_per_dir - 1) / k_files_per_dir;
+        branching = std::max<size_t>(
+            2, size_t(std::ceil(std::pow(double(num_dirs), 1.0 / double(depth)))));
+    }
+
+    fs::path path(size_t i) const {
+        std::vector<size_t> digits(static_cast<size_t>(depth));
+        for (auto j = i / k_files_per_dir; auto& d : digits) {
+            d = j % branching;
+            j /= branching;
+        }
+        auto p = root;
+        for (auto it = digits.rbegin(); it != digits.rend(); ++it) {
+            p /= fmt::format("d{}", *it);
+        }
+        return p / fmt::format("file{}.cpp", i);
+    }
+
+    bool is_unformatted(size_t i) const {
+        auto r = rng(i, 0);
+        return std::uniform_real_distribution<double>()(r) < unformatted_ratio;
+    }
+
+    // Functions until `file_size`. The unformatted version has trailing whitespace on the first
+    // line.
+    std::string content(size_t i, bool unformatted) const {
+        auto r = rng(i, 1);
+        std::string s;
+        for (size_t n = 0; s.size() < file_size; ++n) {
+            s += fmt::format("int f{}_{}(int x) {{\n    return x * {} + {};\n}}\n\n",
+                             i,
+                             n,
+                             r() % 1000,
+                             r() % 1000);
+        }
+        if (unformatted) {
+            s.insert(s.find('\n'), "  ");
+        }
+        return s;
+    }
+
+    size_t num_unformatted() const {
+        size_t n = 0;
+        for (size_t i = 0; i < num_files; ++i) {
+            n += is_unformatted(i) ? 1 : 0;
+        }
+        return n;
+    }
+
+    // Writes the tree, unless it's already there with the same parameters. Returns whether it was
+    // written, nullopt on error.
+    std::optional<bool> generate() const {
+        const auto stamp_file = root / k_tree_stamp_filename;
+        if (fs_read_file_noexcept(stamp_file) == stamp()) {
+            return false;
+        }
+        std::error_code ec;
+        fs::remove_all(root, ec);
+        for (size_t i = 0; i < num_files; ++i) {
+            auto p = path(i);
+            if (i % k_files_per_dir == 0) {
+                fs::create_directories(p.parent_path(), ec);
+            }
+            if (!fs_write_file_noexcept(p, content(i, is_unformatted(i)))) {
+                fmt::print(stderr, "Can't write {}\n", ToUtf8(p));
+                return std::nullopt;
+            }
+        }
+        // Last, so an interrupted generation isn't reused.
+        if (!fs_write_file_noexcept(stamp_file, stamp())) {
+            fmt::print(stderr, "Can't write {}\n", ToUtf8(stamp_file));
+            return std::nullopt;
+        }
+        return true;
+    }
+
+    const fs::path root;
+    const size_t num_files;
+
+   private:
+    std::mt19937_64 rng(size_t i, uint64_t stream) const {
+        return std::mt19937_64(hash64(fmt::format("{}/{}", i, stream), seed));
+    }
+    std::string stamp() const {
+        return fmt::format(
+            "{} {} {} {} {}\n", num_files, depth, file_size, unformatted_ratio, seed);
+    }
+
+    const int depth;
+    const size_t file_size;
+    const double unformatted_ratio;
+    const uint64_t seed;
+    size_t branching;
+};
+
+// Processes messages until `done` returns true. Returns false if interrupted or stalled.
+bool ProcessMsgsUntil(State& ctx, const std::function<bool()>& done) {
+    auto last_progress = chr::steady_clock::now();
+    bool progressed = false;
+    while (!done()) {
+        switch (ProcessMsgs(ctx)) {
+            case ProcessMsgsResult::QueueWasNotEmpty:
+                progressed = true;
+                break;
+            case ProcessMsgsResult::QueueWasEmpty:
+                if (progressed) {
+                    last_progress = chr::steady_clock::now();
+                    progressed = false;
+                } else if (chr::steady_clock::now() - last_progress > k_stall_timeout) {
+                    fmt::print(stderr, "Stalled.\n");
+                    return false;
+                }
+                std::this_thread::sleep_for(chr::microseconds(50));
+                break;
+            case ProcessMsgsResult::ShouldExit:
+                return false;
+        }
+    }
+    return true;
+}
+
+double Seconds(chr::steady_clock::duration d) {
+    return chr::duration<double>(d).count();
+}
+
+std::string HistogramToJson(const Histogram& h) {
+    auto ms = [](Histogram::Duration d) {
+        return chr::duration<double, std::milli>(d).count();
+    };
+    return fmt::format(
+        "{{\"count\":{},\"mean\":{:.3f},\"p50\":{:.3f},\"p90\":{:.3f},\"p99\":{:.3f},"
+        "\"max\":{:.3f}}}",
+        h.count(),
+        ms(h.mean()),
+        ms(h.percentile(50)),
+        ms(h.percentile(90)),
+        ms(h.percentile(99)),
+        ms(h.max()));
+}
+
+// Runs the benchmark on one tree, returns the result as a JSON object.
+std::optional<std::string> RunBench(const BenchOptions& bo,
+                                    const ClangFormat& clang_format,
+                                    size_t num_files) {
+    const SyntheticTree tree(bo, num_files);
+    fmt::print(stderr, "Generating {} files in {}\n", num_files, ToUtf8(tree.root));
+    const auto generate_started_at = chr::steady_clock::now();
+    const auto generated = tree.generate();
+    if (!generated) {
+        return std::nullopt;
+    }
+    const auto generate_time = chr::steady_clock::now() - generate_started_at;
+
+    State ctx;
+    auto& os = ctx.options;
+    os.paths = {tree.root};
+    os.use_gitignore = false;
+    os.use_verified_cache = false;
+    os.num_formatter_threads = bo.jobs;
+    InitDirScanning(ctx);
+    StartFormatterThreads(ctx, clang_format, bo.jobs);
+    const auto processes_spawned_before = g_metrics.processes_spawned.load();
+
+    auto num_tracked = [&ctx] {
+        return ctx.files.count(FileStatus::Formatted)
+             + ctx.files.count(FileStatus::NeedsFormatting);
+    };
+
+    // Add All.
+    fmt::print(stderr, "Add All\n");
+    const auto rss_before = CurrentRssBytes();
+    const auto add_all_started_at = chr::steady_clock::now();
+    ctx.to_app_queue.enqueue(msg::AddAll{});
+    bool ok = ProcessMsgsUntil(ctx, [&] {
+        return num_tracked() >= num_files && ctx.jobs_in_flight.empty();
+    });
+    const auto add_all_time = chr::steady_clock::now() - add_all_started_at;
+    const auto rss_after = CurrentRssBytes();
+    const auto num_unformatted_found = ctx.files.count(FileStatus::NeedsFormatting);
+    const auto add_all_processes_spawned =
+        g_metrics.processes_spawned.load() - processes_spawned_before;
+
+    // Save to formatted, on randomly chosen formatted files. Formatting restores their original
+    // content, so the tree can be reused.
+    fmt::print(stderr, "Save to formatted\n");
+    Histogram save_to_formatted;
+    fs::path saved_path;
+    std::optional<FileId> saved_file;
+    bool saved_path_seen_unformatted = false, saved_path_formatted = false;
+    ctx.on_file_status_changed = [&](FileId file) {
+        if (file != saved_file) {
+            return;
+        }
+        if (ctx.files.status(file) == FileStatus::NeedsFormatting) {
+            saved_path_seen_unformatted = true;
+            ctx.to_app_queue.enqueue(msg::FormatOne{file});
+        } else if (saved_path_seen_unformatted
+                   && ctx.files.status(file) == FileStatus::Formatted) {
+            saved_path_formatted = true;
+        }
+    };
+    std::mt19937_64 rng(bo.seed);
+    std::uniform_int_distribution<size_t> random_file(0, num_files - 1);
+    for (size_t attempts = 0;
+         ok && save_to_formatted.count() < bo.saves && attempts < 100 * bo.saves;
+         ++attempts) {
+        const auto i = random_file(rng);
+        if (tree.is_unformatted(i)) {
+            continue;
+        }
+        saved_path = tree.path(i);
+        saved_file = ctx.files.find(saved_path);
+        saved_path_seen_unformatted = saved_path_formatted = false;
+        if (!fs_write_file_noexcept(saved_path, tree.content(i, true))) {
+            fmt::print(stderr, "Can't write {}\n", ToUtf8(saved_path));
+            ok = false;
+            break;
+        }
+        const auto saved_at = chr::steady_clock::now();
+        ctx.to_app_queue.enqueue(msg::FileChanged{saved_path});
+        ok = ProcessMsgsUntil(ctx, [&] {
+            return saved_path_formatted;
+        });
+        save_to_formatted.add(chr::steady_clock::now() - saved_at);
+    }
+    ctx.on_file_status_changed = nullptr;
+
+    // ProcessMsgs drain rate, on files not changed since checked.
+    fmt::print(stderr, "ProcessMsgs drain\n");
+    size_t num_drained = 0;
+    chr::steady_clock::duration drain_time = {};
+    if (ok) {
+        for (FileId file = 0; file < ctx.files.size(); ++file) {
+            if (ctx.files.status(file) == FileStatus::Formatted) {
+                ctx.to_app_queue.enqueue(msg::FileChanged{ctx.files.path(file)});
+                ++num_drained;
+            }
+        }
+        const auto drain_started_at = chr::steady_clock::now();
+        for (;;) {
+            auto r = ProcessMsgs(ctx);
+            if (r != ProcessMsgsResult::QueueWasNotEmpty) {
+                ok = r == ProcessMsgsResult::QueueWasEmpty;
+                break;
+            }
+        }
+        drain_time = chr::steady_clock::now() - drain_started_at;
+    }
+
+    StopThreads(ctx);
+    if (!ok) {
+        return std::nullopt;
+    }
+
+    const auto hardware_concurrency = std::max(1, int(std::thread::hardware_concurrency()));
+    auto r = fmt::format(
+        "{{\"files\":{},\"depth\":{},\"file_size\":{},\"unformatted_ratio\":{},\"seed\":{},"
+        "\"latency_ms\":{},\"latency_us_per_file\":{},\"formatter_threads\":{},"
+        "\"hardware_concurrency\":{},\"clang_format_version\":{},",
+        num_files,
+        bo.depth,
+        bo.file_size,
+        bo.unformatted_ratio,
+        bo.seed,
+        bo.latency_ms,
+        bo.latency_us_per_file,
+        bo.jobs > 0 ? bo.jobs : hardware_concurrency,
+        hardware_concurrency,
+        json_quote(clang_format.version()));
+    r += fmt::format(
+        "\"tree_generated\":{},\"generate_s\":{:.3f},", *generated, Seconds(generate_time));
+    r += fmt::format(
+        "\"add_all_s\":{:.3f},\"add_all_files_per_s\":{:.1f},\"add_all_processes_spawned\":{},"
+        "\"unformatted_expected\":{},\"unformatted_found\":{},",
+        Seconds(add_all_time),
+        double(num_files) / Seconds(add_all_time),
+        add_all_processes_spawned,
+        tree.num_unformatted(),
+        num_unformatted_found);
+    if (rss_before && rss_after) {
+        r += fmt::format("\"rss_bytes_per_file\":{:.1f},",
+                         (double(*rss_after) - double(*rss_before)) / double(num_files));
+    } else {
+        r += "\"rss_bytes_per_file\":null,";
+    }
+    r += fmt::format("\"save_to_formatted_ms\":{},", HistogramToJson(save_to_formatted));
+    r += fmt::format("\"drain_msgs\":{},\"drain_msgs_per_s\":{:.1f}}}",
+                     num_drained,
+                     double(num_drained) / Seconds(drain_time));
+    return r;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    BenchOptions bo;
+    for (int i = 1; i < argc; ++i) {
+        auto ai = std::string_view(argv[i]);
+        if (ai == "-h" || ai == "--help") {
+            DisplayHelp();
+            return EXIT_SUCCESS;
+        }
+        if (i + 1 >= argc) {
+            fmt::print(stderr, "Invalid option or missing argument: {}\n", ai);
+            return EXIT_FAILURE;
+        }
+        auto a = std::string_view(argv[++i]);
+        auto parse = [ai](std::string_view text, auto& value) {
+            auto fcr = std::from_chars(text.data(), text.data() + text.size(), value);
+            if (fcr.ec != std::errc() || fcr.ptr != text.data() + text.size()) {
+                fmt::print(stderr, "Invalid argument for {}: {}\n", ai, text);
+                return false;
+            }
+            return true;
+        };
+        bool valid = true;
+        if (ai == "--sizes") {
+            bo.sizes.clear();
+            for (auto s = a; valid;) {
+                const auto comma = s.find(',');
+                size_t n = 0;
+                valid = parse(s.substr(0, comma), n) && n > 0;
+                bo.sizes.push_back(n);
+                if (comma == std::string_view::npos) {
+                    break;
+                }
+                s.remove_prefix(comma + 1);
+            }
+        } else if (ai == "--depth") {
+            valid = parse(a, bo.depth);
+        } else if (ai == "--file-size") {
+            valid = parse(a, bo.file_size);
+        } else if (ai == "--unformatted-ratio") {
+            // std::from_chars for floating point isn't available everywhere.
+            char* end = nullptr;
+            const auto arg = std::string(a);
+            bo.unformatted_ratio = std::strtod(arg.c_str(), &end);
+            valid = end == arg.c_str() + arg.size() && bo.unformatted_ratio >= 0
+                 && bo.unformatted_ratio <= 1;
+            if (!valid) {
+                fmt::print(stderr, "Invalid argument for {}: {}\n", ai, a);
+            }
+        } else if (ai == "--latency-ms") {
+            valid = parse(a, bo.latency_ms);
+        } else if (ai == "--latency-us-per-file") {
+            valid = parse(a, bo.latency_us_per_file);
+        } else if (ai == "-j" || ai == "--jobs") {
+            valid = parse(a, bo.jobs);
+        } else if (ai == "--saves") {
+            valid = parse(a, bo.saves);
+        } else if (ai == "--seed") {
+            valid = parse(a, bo.seed);
+        } else if (ai == "--work-dir") {
+            bo.work_dir = fs::absolute(PathFromUtf8(a));
+        } else if (ai == "--clang-format-dir") {
+            bo.clang_format_dir = fs::absolute(PathFromUtf8(a));
+        } else if (ai == "--output") {
+            bo.output = PathFromUtf8(a);
+        } else {
+            fmt::print(stderr, "Invalid option: {}\n", ai);
+            valid = false;
+        }
+        if (!valid) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::signal(SIGINT, [](int) {
+        g_sigint_received = true;
+    });
+
+    // The process backend runs the first clang-format on PATH.
+#if defined(_WIN32)
+    constexpr char k_path_separator = ';';
+#else
+    constexpr char k_path_separator = ':';
+#endif
+    const char* path_env = std::getenv("PATH");
+    auto path = bo.clang_format_dir.string();
+    if (path_env) {
+        path += k_path_separator + std::string(path_env);
+    }
+    SetEnv("PATH", path);
+    SetEnv("CLAFORD_FAKE_LATENCY_MS", std::to_string(bo.latency_ms));
+    SetEnv("CLAFORD_FAKE_LATENCY_US_PER_FILE", std::to_string(bo.latency_us_per_file));
+    auto clang_format = ClangFormat::make(ClangFormatBackend::Process);
+    if (!clang_format) {
+        return EXIT_FAILURE;
+    }
+
+    std::FILE* output = nullptr;
+    if (bo.output) {
+        output = std::fopen(bo.output->string().c_str(), "a");
+        if (!output) {
+            fmt::print(stderr, "Can't open {}\n", ToUtf8(*bo.output));
+            return EXIT_FAILURE;
+        }
+    }
+    int result = EXIT_SUCCESS;
+    for (auto n : bo.sizes) {
+        auto r = RunBench(bo, **clang_format, n);
+        if (!r) {
+            result = EXIT_FAILURE;
+            break;
+        }
+        fmt::print("{}\n", *r);
+        std::fflush(stdout);
+        if (output) {
+            fmt::print(output, "{}\n", *r);
+        }
+    }
+    if (output) {
+        std::fclose(output);
+    }
+    return result;
+}
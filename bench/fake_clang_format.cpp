@@ -0,0 +1,190 @@
+// Stand-in for clang-format in claford_bench: the same command line and diagnostics for the
+// subset claford uses, with a tunable latency instead of real formatting. "Formatting" removes
+// trailing whitespace.
+//
+//     clang-format --version
+//     clang-format FILE                     Prints the formatted FILE.
+//     clang-format [--assume-filename=F]    Prints the formatted stdin.
+//     clang-format -i FILE...               Formats the files in place.
+//     clang-format --dry-run -Werror FILE...
+//     clang-format --output-replacements-xml FILE...
+//     --lines=FIRST:LAST                    Only these lines, with a single FILE.
+//
+// Environment:
+//     CLAFORD_FAKE_LATENCY_MS               Sleep per invocation (process startup, config).
+//     CLAFORD_FAKE_LATENCY_US_PER_FILE      Sleep per file.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace chr = std::chrono;
+
+namespace {
+int64_t EnvInt(const char* name) {
+    const char* v = std::getenv(name);
+    return v ? std::strtoll(v, nullptr, 10) : 0;
+}
+
+std::optional<std::string> ReadFile(const std::string& path) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f) {
+        return std::nullopt;
+    }
+    return std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+bool WriteFile(const std::string& path, std::string_view content) {
+    std::ofstream f(path, std::ios::binary | std::ios::trunc);
+    f.write(content.data(), std::streamsize(content.size()));
+    return bool(f);
+}
+
+struct Formatted {
+    std::string content;
+    // 1-based position of the first change, 0 if none.
+    size_t first_line = 0, first_col = 0;
+    std::string first_line_text;
+    // Offset and length of the removed whitespace.
+    std::vector<std::pair<size_t, size_t>> removed;
+};
+
+// Formats the `lines` (1-based, inclusive) or everything if empty.
+Formatted Format(std::string_view s, const std::vector<std::pair<size_t, size_t>>& lines) {
+    Formatted r;
+    r.content.reserve(s.size());
+    const auto* begin = s.data();
+    size_t line = 1;
+    while (!s.empty()) {
+        auto eol = s.find('\n');
+        auto text = s.substr(0, eol);
+        bool selected = lines.empty();
+        for (auto& [first, last] : lines) {
+            selected = selected || (first <= line && line <= last);
+        }
+        auto end = text.find_last_not_of(" \t");
+        auto trimmed =
+            selected ? text.substr(0, end == std::string_view::npos ? 0 : end + 1) : text;
+        if (trimmed.size() != text.size()) {
+            r.removed.emplace_back(size_t(text.data() - begin) + trimmed.size(),
+                                   text.size() - trimmed.size());
+            if (r.first_line == 0) {
+                r.first_line = line;
+                r.first_col = trimmed.size() + 1;
+                r.first_line_text = text;
+            }
+        }
+        r.content += trimmed;
+        if (eol == std::string_view::npos) {
+            break;
+        }
+        r.content += '\n';
+        s.remove_prefix(eol + 1);
+        ++line;
+    }
+    return r;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    bool in_place = false, dry_run = false, werror = false, xml = false;
+    std::vector<std::string> files;
+    std::vector<std::pair<size_t, size_t>> lines;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view a = argv[i];
+        if (a == "--version") {
+            std::puts("clang-format version 0.0.0 (claford fake)");
+            return EXIT_SUCCESS;
+        } else if (a == "-i") {
+            in_place = true;
+        } else if (a == "--dry-run" || a == "-n") {
+            dry_run = true;
+        } else if (a == "-Werror") {
+            werror = true;
+        } else if (a == "--output-replacements-xml") {
+            xml = true;
+        } else if (a.starts_with("--lines=")) {
+            auto range = std::string(a.substr(8));
+            char* end = nullptr;
+            const auto first = std::strtoull(range.c_str(), &end, 10);
+            if (*end != ':') {
+                std::cerr << "error: invalid --lines " << range << "\n";
+                return EXIT_FAILURE;
+            }
+            lines.emplace_back(first, std::strtoull(end + 1, nullptr, 10));
+        } else if (a.starts_with("-")) {
+            // Other options don't change the fake's output.
+        } else {
+            files.emplace_back(a);
+        }
+    }
+    if (files.empty()) {
+        if (in_place) {
+            std::cerr << "error: cannot use -i when reading from stdin.\n";
+            return EXIT_FAILURE;
+        }
+        std::this_thread::sleep_for(chr::milliseconds(EnvInt("CLAFORD_FAKE_LATENCY_MS")));
+        const std::string content(std::istreambuf_iterator<char>(std::cin), {});
+        std::cout << Format(content, lines).content;
+        return EXIT_SUCCESS;
+    }
+    if (!lines.empty() && files.size() > 1) {
+        std::cerr << "error: -lines can only be used for single file.\n";
+        return EXIT_FAILURE;
+    }
+    if (!in_place && !dry_run && !xml && files.size() > 1) {
+        std::cerr << "error: -output-replacements-xml or -i needed for more than one file\n";
+        return EXIT_FAILURE;
+    }
+
+    std::this_thread::sleep_for(chr::milliseconds(EnvInt("CLAFORD_FAKE_LATENCY_MS")));
+    const auto latency_per_file = chr::microseconds(EnvInt("CLAFORD_FAKE_LATENCY_US_PER_FILE"));
+
+    bool failed = false, found_violations = false;
+    for (auto& f : files) {
+        std::this_thread::sleep_for(latency_per_file);
+        auto content = ReadFile(f);
+        if (!content) {
+            std::cerr << "error: cannot open " << f << "\n";
+            failed = true;
+            continue;
+        }
+        auto formatted = Format(*content, lines);
+        if (dry_run) {
+            if (formatted.first_line != 0) {
+                found_violations = true;
+                std::cerr << f << ":" << formatted.first_line << ":" << formatted.first_col
+                          << ": " << (werror ? "error" : "warning")
+                          << ": code should be clang-formatted [-Wclang-format-violations]\n"
+                          << formatted.first_line_text << "\n"
+                          << std::string(formatted.first_col - 1, ' ') << "^\n";
+            }
+        } else if (xml) {
+            std::cout << "<?xml version='1.0'?>\n"
+                      << "<replacements xml:space='preserve' incomplete_format='false'>\n";
+            for (auto& [offset, length] : formatted.removed) {
+                std::cout << "<replacement offset='" << offset << "' length='" << length
+                          << "'></replacement>\n";
+            }
+            std::cout << "</replacements>\n";
+        } else if (in_place) {
+            if (formatted.first_line != 0 && !WriteFile(f, formatted.content)) {
+                std::cerr << "error: cannot write " << f << "\n";
+                failed = true;
+            }
+        } else {
+            std::cout << formatted.content;
+        }
+    }
+    return failed || (werror && found_violations) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,835 @@
+#include "app.h"
+
+#include "async_clang_format.h"
+#include "git_status.h"
+#include "ipc.h"
+#include "util.h"
+
+#include <fmt/format.h>
+#include <nowide/iostream.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdlib>
+#include <filesystem>
+#include <future>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+
+namespace fs = std::filesystem;
+
+std::atomic<bool> g_sigint_received;
+
+namespace {
+// Directory scanning is mostly waiting for the filesystem, more threads don't help much.
+constexpr int k_max_dir_scanner_threads = 8;
+// Messages taken from the queue at once. Each is handled in microseconds, so the UI can check its
+// time budget between batches.
+constexpr size_t k_max_msgs_per_batch = 128;
+
+// Collects the files found by a rescan, which are sent in one message so that the tracked files
+// missing from it can be told apart.
+struct RescanResult {
+    std::mutex mutex;
+    std::vector<FoundFile> files;
+};
+}  // namespace
+
+void InitDirScanning(State& ctx) {
+    auto& os = ctx.options;
+    ctx.path_filter = std::make_shared<PathFilter>(
+        os.paths, os.include_globs, os.exclude_globs, os.use_gitignore);
+    const int num_threads =
+        std::min(k_max_dir_scanner_threads, std::max(1, int(std::thread::hardware_concurrency())));
+    ctx.dir_scanner = std::make_unique<DirScanner>(
+        num_threads, ctx.path_filter, [&ctx](std::vector<FoundFile> files) {
+            ctx.to_app_queue.enqueue(msg::FilesFound{std::move(files)});
+        });
+    auto rescan_result = std::make_shared<RescanResult>();
+    ctx.rescanner = std::make_unique<DirScanner>(
+        num_threads,
+        ctx.path_filter,
+        [rescan_result](std::vector<FoundFile> files) {
+            std::lock_guard lock(rescan_result->mutex);
+            rescan_result->files.insert(rescan_result->files.end(),
+                                        std::make_move_iterator(files.begin()),
+                                        std::make_move_iterator(files.end()));
+        },
+        [&ctx, rescan_result]() {
+            std::lock_guard lock(rescan_result->mutex);
+            ctx.to_app_queue.enqueue(msg::Rescanned{std::move(rescan_result->files)});
+            rescan_result->files.clear();
+        });
+    ctx.watching_since = fs::file_time_type::clock::now();
+}
+
+void StartFormatterThreads(State& ctx, const ClangFormat& clang_format, int num_threads) {
+    if (num_threads <= 0) {
+        num_threads = std::max(1, int(std::thread::hardware_concurrency()));
+    }
+    fmt::print(stderr, "Using {} formatter thread(s).\n", num_threads);
+    for (int i = 0; i < num_threads; ++i) {
+        ctx.async_clang_format_workers.emplace_back(AsyncClangFormat,
+                                                    clang_format.clone(),
+                                                    num_threads,
+                                                    &ctx.to_async_clang_format_queue,
+                                                    &ctx.to_app_queue,
+                                                    &ctx.self_writes,
+                                                    &ctx.exit_flag);
+    }
+}
+
+void StopThreads(State& ctx) {
+    ctx.exit_flag = true;
+    ctx.to_app_queue.wake_result_waiters();
+    if (ctx.dir_scanner) {
+        ctx.dir_scanner->stop();
+    }
+    if (ctx.rescanner) {
+        ctx.rescanner->stop();
+    }
+    if (ctx.add_changed.valid()) {
+        ctx.add_changed.wait();
+    }
+    for (auto& t : ctx.async_clang_format_workers) {
+        if (t.joinable()) {
+            t.join();
+        }
+    }
+    ctx.async_clang_format_workers.clear();
+}
+
+int CheckStagedFiles(State& ctx, const ClangFormat& clang_format) {
+    std::vector<StagedFile> files;
+    for (auto& root : ctx.options.paths) {
+        auto staged = GitStagedFiles(root);
+        if (!staged) {
+            return EXIT_FAILURE;
+        }
+        for (auto& f : *staged) {
+            if (ctx.options.extensions.contains(f.path.extension())
+                && !ctx.path_filter->is_excluded(f.path, false)) {
+                files.push_back(std::move(f));
+            }
+        }
+    }
+    // The roots may be in the same work tree.
+    std::sort(BE(files), [](const StagedFile& a, const StagedFile& b) {
+        return a.path < b.path;
+    });
+    files.erase(std::unique(BE(files),
+                            [](const StagedFile& a, const StagedFile& b) {
+                                return a.path == b.path;
+                            }),
+                files.end());
+
+    // Formatted in memory, like the buffers of the local API.
+    enum class Result : uint8_t { Formatted, NeedsFormatting, Failed };
+    std::vector<Result> results(files.size());
+    std::atomic<size_t> next_file = 0;
+    const int num_threads = std::min(
+        int(files.size()),
+        ctx.options.num_formatter_threads > 0
+            ? ctx.options.num_formatter_threads
+            : std::max(1, int(std::thread::hardware_concurrency())));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&files, &results, &next_file, cf = clang_format.clone()]() {
+            for (size_t i; (i = next_file++) < files.size();) {
+                auto formatted = cf->format_buffer(files[i].path, files[i].content, {});
+                if (!formatted) {
+                    results[i] = Result::Failed;
+                } else if (*formatted != files[i].content) {
+                    results[i] = Result::NeedsFormatting;
+                }
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    size_t num_unformatted = 0;
+    size_t num_failed = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (results[i] == Result::NeedsFormatting) {
+            ++num_unformatted;
+            fmt::print("{}\n", ToUtf8(files[i].path));
+        } else if (results[i] == Result::Failed) {
+            ++num_failed;
+            fmt::print(stderr, "ERROR formatting {}\n", ToUtf8(files[i].path));
+        }
+    }
+    fmt::print(stderr,
+               "Checked {} staged files, {} need formatting.\n",
+               files.size(),
+               num_unformatted);
+    return num_unformatted == 0 && num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void IpcSend(State& ctx, IpcClientId client, std::string line) {
+    if (ctx.ipc_send) {
+        ctx.ipc_send(client, std::move(line));
+    }
+}
+
+// The FILE fields of ipc.h.
+std::string IpcFileStatusFields(std::string_view path, FileStatus status, fs::file_time_type time) {
+    if (status == FileStatus::Untracked) {
+        return fmt::format("\"path\":{},\"status\":\"untracked\"", json_quote(path));
+    }
+    return fmt::format("\"path\":{},\"status\":\"{}\",\"time_ms\":{}",
+                       json_quote(path),
+                       status == FileStatus::Formatted ? "formatted" : "unformatted",
+                       ToUnixMilliseconds(time));
+}
+
+void NotifyFileStatusChanged(State& ctx, FileId file) {
+    if (ctx.on_file_status_changed) {
+        ctx.on_file_status_changed(file);
+    }
+    if (!ctx.ipc_subscribers.empty()) {
+        const auto fields = IpcFileStatusFields(
+            ToUtf8(ctx.files.path(file)), ctx.files.status(file), ctx.files.time(file));
+        const auto line = fmt::format("{{\"event\":\"status\",{}}}\n", fields);
+        for (auto client : ctx.ipc_subscribers) {
+            IpcSend(ctx, client, line);
+        }
+    }
+}
+
+void SetFileFormatted(State& ctx, FileId file, fs::file_time_type last_write_time) {
+    ctx.files.set_status(file, FileStatus::Formatted, last_write_time);
+    NotifyFileStatusChanged(ctx, file);
+}
+
+void SetFileNeedsFormatting(State& ctx, FileId file, fs::file_time_type last_write_time) {
+    ctx.files.set_status(file, FileStatus::NeedsFormatting, last_write_time);
+    NotifyFileStatusChanged(ctx, file);
+}
+
+void IpcSendFormatResponse(State& ctx, const IpcFormatWait& wait) {
+    bool all_ok = true;
+    std::string files;
+    for (size_t i = 0; i < wait.paths.size(); ++i) {
+        const bool ok = wait.results[i].value_or(false);
+        all_ok = all_ok && ok;
+        files += fmt::format(
+            "{}{{\"path\":{},\"ok\":{}}}", i == 0 ? "" : ",", json_quote(wait.paths[i]), ok);
+    }
+    IpcSend(ctx,
+            wait.client,
+            fmt::format(
+                "{{\"id\":{},\"ok\":{},\"files\":[{}]}}\n", wait.request_id, all_ok, files));
+}
+
+// Answers the "format" requests that were waiting for `file` only.
+void IpcFormatFinished(State& ctx, FileId file, bool result) {
+    auto& waits = ctx.ipc_format_waits;
+    for (auto it = waits.begin(); it != waits.end();) {
+        for (size_t i = 0; i < it->files.size(); ++i) {
+            if (it->files[i] == file && !it->results[i]) {
+                it->results[i] = result;
+                --it->num_pending;
+            }
+        }
+        if (it->num_pending == 0) {
+            IpcSendFormatResponse(ctx, *it);
+            it = waits.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Makes the result of the job in flight for `file` (if any) outdated and drops the pending request.
+// The "format" requests waiting for a dropped format fail.
+void CancelJob(State& ctx, FileId file) {
+    if (auto it = ctx.jobs_in_flight.find(file); it != ctx.jobs_in_flight.end()) {
+        ++*it->second.latest_generation;
+        const bool drops_format = it->second.has_pending
+                               && it->second.pending_command == ACFMsg::Command::Format;
+        it->second.has_pending = false;
+        if (drops_format && !ctx.ipc_format_waits.empty()) {
+            IpcFormatFinished(ctx, file, false);
+        }
+    }
+}
+
+// Untracks a removed file, the "format" requests waiting for it fail. Its pending request is
+// dropped with the job in flight: repeated, the check of the missing file would add it back as
+// needing formatting.
+void ForgetFile(State& ctx, FileId file) {
+    CancelJob(ctx, file);
+    if (!ctx.ipc_format_waits.empty()) {
+        IpcFormatFinished(ctx, file, false);
+    }
+    if (ctx.files.status(file) != FileStatus::Untracked) {
+        ctx.files.set_status(file, FileStatus::Untracked);
+        NotifyFileStatusChanged(ctx, file);
+    }
+}
+
+// Sends a job to the formatter threads, unless one is already queued or running for the file. In
+// that case the job in flight is superseded and the request is repeated when it finishes. If the
+// job in flight is a check with a lower priority, it's left for the formatter threads to skip and
+// the new job is sent right away. `last_write_time` is for checks.
+void EnqueueJob(State& ctx,
+                ACFMsg::Command command,
+                JobPriority priority,
+                FileId file,
+                fs::file_time_type last_write_time = {}) {
+    auto& job = ctx.jobs_in_flight[file];
+    const auto generation = ++*job.latest_generation;
+    if (job.num_queued_or_running > 0) {
+        // Checking doesn't replace a pending format, formatting is followed by a check anyway.
+        const bool keep_pending = job.has_pending && job.pending_command == ACFMsg::Command::Format
+                               && command == ACFMsg::Command::CheckFormat;
+        if (job.command == ACFMsg::Command::Format || priority >= job.priority || keep_pending) {
+            job.pending_priority =
+                job.has_pending ? std::min(job.pending_priority, priority) : priority;
+            if (!keep_pending) {
+                job.pending_command = command;
+                job.pending_last_write_time = last_write_time;
+            }
+            job.has_pending = true;
+            return;
+        }
+        if (job.has_pending) {
+            priority = std::min(priority, job.pending_priority);
+            job.has_pending = false;
+        }
+    }
+    ++job.num_queued_or_running;
+    job.command = command;
+    job.priority = priority;
+    ctx.to_async_clang_format_queue.enqueue(ACFMsg{.command = command,
+                                                   .path = ctx.files.path(file),
+                                                   .file = file,
+                                                   .last_write_time = last_write_time,
+                                                   .latest_generation = job.latest_generation,
+                                                   .generation = generation,
+                                                   .priority = priority});
+}
+
+// Checks the file unless it's known to be formatted at `last_write_time`.
+void CheckFile(State& ctx, FileId file, fs::file_time_type last_write_time, JobPriority priority) {
+    if (ctx.files.status(file) == FileStatus::Formatted
+        && ctx.files.time(file) == last_write_time) {
+        return;
+    }
+    EnqueueJob(ctx, ACFMsg::Command::CheckFormat, priority, file, last_write_time);
+}
+
+void FormatFile(State& ctx, FileId file, JobPriority priority) {
+    EnqueueJob(ctx, ACFMsg::Command::Format, priority, file);
+}
+
+// `last_write_time` is of the file the formatter wrote, a later change is not mistaken for the
+// formatted version.
+void FormatCompletion(State& ctx, FileId file, bool result, fs::file_time_type last_write_time) {
+    const auto path = ctx.files.path(file);
+    if (result) {
+        SetFileFormatted(ctx, file, last_write_time);
+        nowide::cerr << "Formatted " << path << "\n";
+    } else {
+        nowide::cerr << "ERROR formatting " << path << "\n";
+    }
+    if (!ctx.ipc_format_waits.empty()) {
+        IpcFormatFinished(ctx, file, result);
+    }
+}
+
+void JobFinished(State& ctx, const msg::AsyncClangFormatResult& r) {
+    auto it = ctx.jobs_in_flight.find(r.file);
+    assert(it != ctx.jobs_in_flight.end());
+    auto& job = it->second;
+    const bool superseded = *job.latest_generation != r.generation;
+    // The result of a superseded check is about an earlier version of the file, but a format job
+    // has changed the file either way.
+    if (r.command == ACFMsg::Command::Format) {
+        FormatCompletion(ctx, r.file, r.result, r.last_write_time);
+    } else if (!superseded) {
+        if (r.result) {
+            // Already formatted.
+            SetFileFormatted(ctx, r.file, r.last_write_time);
+        } else {
+            // Needs formatting.
+            SetFileNeedsFormatting(ctx, r.file, r.last_write_time);
+        }
+    }
+    if (--job.num_queued_or_running > 0) {
+        return;
+    }
+    const bool has_pending = job.has_pending;
+    const auto pending_command = job.pending_command;
+    const auto pending_priority = job.pending_priority;
+    const auto pending_last_write_time = job.pending_last_write_time;
+    ctx.jobs_in_flight.erase(it);
+    if (!has_pending) {
+        return;
+    }
+    if (pending_command == ACFMsg::Command::Format) {
+        FormatFile(ctx, r.file, pending_priority);
+    } else {
+        CheckFile(ctx, r.file, pending_last_write_time, pending_priority);
+    }
+}
+
+// Re-checks the tracked files below `dir` whose config file in effect changed or is the one in
+// `dir`. Those with the same config content are answered from the verified cache.
+void ClangFormatConfigChanged(State& ctx, const fs::path& dir) {
+    auto& config_cache = *ctx.clang_format_config_cache;
+    const auto dir_file = ctx.files.find(dir);
+    if (!dir_file) {
+        config_cache.invalidate(dir);
+        return;
+    }
+    // The config files in effect before the change, by directory.
+    std::vector<std::pair<FileId, fs::path>> files;
+    std::unordered_map<fs::path, std::optional<ClangFormatConfig>> old_config_of_dir;
+    for (FileId file = 0; file < ctx.files.size(); ++file) {
+        if (ctx.files.status(file) != FileStatus::Untracked
+            && ctx.files.is_inside(file, *dir_file)) {
+            auto parent = ctx.files.path(file).parent_path();
+            if (!old_config_of_dir.contains(parent)) {
+                old_config_of_dir.emplace(parent, config_cache.peek(parent));
+            }
+            files.emplace_back(file, std::move(parent));
+        }
+    }
+    config_cache.invalidate(dir);
+    std::unordered_map<fs::path, bool> changed_of_dir;
+    for (auto& [d, old_config] : old_config_of_dir) {
+        const auto config = config_cache.get(d);
+        // A config inheriting from the one in `dir` has the same file but a different hash, if
+        // its hash is known.
+        changed_of_dir[d] = !old_config || old_config->file != config.file
+                         || (config.file && config.file->parent_path() == dir)
+                         || (old_config->hash != 0 && old_config->hash != config.hash);
+    }
+    size_t num_checked = 0;
+    for (auto& [file, parent] : files) {
+        if (changed_of_dir[parent]) {
+            // The file didn't change, only its expected formatting.
+            EnqueueJob(
+                ctx, ACFMsg::Command::CheckFormat, JobPriority::Bulk, file, ctx.files.time(file));
+            ++num_checked;
+        }
+    }
+    fmt::print(stderr,
+               "Config file changed in {}, checking {} files again.\n",
+               ToUtf8(dir),
+               num_checked);
+}
+
+void FileChanged(const fs::path& path, State& ctx) {
+    if (IsClangFormatConfigFile(path)) {
+        ClangFormatConfigChanged(ctx, path.parent_path());
+        return;
+    }
+    // Filter by extension.
+    if (!ctx.options.extensions.contains(path.extension())) {
+        return;
+    }
+    // Ignore non-existing.
+    if (!fs_exists_noexcept(path)) {
+        if (auto file = ctx.files.find(path)) {
+            ForgetFile(ctx, *file);
+        }
+        return;
+    }
+    // Ignore files not changed since formatting.
+    auto last_write_time = fs_last_write_time_noexcept(path);
+    if (!last_write_time) {
+        if (auto file = ctx.files.find(path)) {
+            ForgetFile(ctx, *file);
+        }
+        return;
+    }
+    CheckFile(ctx, ctx.files.intern(path), *last_write_time, JobPriority::Recent);
+}
+
+void HandleMsg(State& ctx, const msg::FileChanged& m) {
+    FileChanged(m.path, ctx);
+    g_metrics.event_to_enqueue.add(std::chrono::steady_clock::now() - m.received_at);
+}
+
+void HandleMsg(State& ctx, const msg::AddAll&) {
+    if (!ctx.dir_scanner->start(ctx.options.paths, ctx.options.extensions)) {
+        fmt::print(stderr, "Still adding files.\n");
+    }
+}
+
+// git runs in the background, the files it reports are checked like the ones found by Add All.
+void HandleMsg(State& ctx, const msg::AddChanged&) {
+    if (ctx.add_changed.valid()
+        && ctx.add_changed.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        fmt::print(stderr, "Still adding changed files.\n");
+        return;
+    }
+    ctx.add_changed = std::async(std::launch::async, [&ctx]() {
+        const auto started_at = std::chrono::steady_clock::now();
+        std::vector<FoundFile> files;
+        for (auto& root : ctx.options.paths) {
+            auto changed = GitChangedFiles(root);
+            if (!changed) {
+                fmt::print(stderr, "Use Add All for {}.\n", ToUtf8(root));
+                continue;
+            }
+            for (auto& path : *changed) {
+                if (!ctx.options.extensions.contains(path.extension())
+                    || ctx.path_filter->is_excluded(path, false)) {
+                    continue;
+                }
+                if (auto last_write_time = fs_last_write_time_noexcept(path)) {
+                    files.push_back(FoundFile{std::move(path), *last_write_time});
+                }
+            }
+        }
+        fmt::print(stderr,
+                   "Found {} changed files in {} ms.\n",
+                   files.size(),
+                   std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::steady_clock::now() - started_at)
+                       .count());
+        ctx.to_app_queue.enqueue(msg::FilesFound{std::move(files)});
+    });
+}
+
+void HandleMsg(State& ctx, const msg::FilesFound& m) {
+    // Extension already filtered, last write time already queried by the scanner.
+    for (auto& f : m.files) {
+        CheckFile(ctx, ctx.files.intern(f.path), f.last_write_time, JobPriority::Bulk);
+    }
+}
+
+// Lexically, like the paths of the file events.
+bool IsInWatchedPaths(const State& ctx, const fs::path& path) {
+    return std::any_of(BE(ctx.options.paths), [&path](const fs::path& root) {
+        return std::mismatch(BE(root), path.begin(), path.end()).first == root.end();
+    });
+}
+
+// One rescan at a time. Not `rescanner->is_running()`: the scanner stops running before its
+// Rescanned message is handled, which still needs `rescanning_dirs`.
+void StartRescan(State& ctx) {
+    if (ctx.pending_rescan_dirs.empty() || !ctx.rescanning_dirs.empty()) {
+        return;
+    }
+    ctx.rescanning_dirs = std::move(ctx.pending_rescan_dirs);
+    ctx.pending_rescan_dirs.clear();
+    fmt::print(stderr, "File events were lost, rescanning:\n");
+    for (auto& d : ctx.rescanning_dirs) {
+        fmt::print(stderr, "    {}\n", ToUtf8(d));
+    }
+    ctx.rescanner->start(ctx.rescanning_dirs, ctx.options.extensions);
+}
+
+void HandleMsg(State& ctx, const msg::Rescan& m) {
+    auto& pending = ctx.pending_rescan_dirs;
+    std::error_code ec;
+    if (!m.dir.empty() && IsInWatchedPaths(ctx, m.dir)) {
+        // Canonical like the paths found by the scanner.
+        pending.push_back(fs::weakly_canonical(m.dir, ec));
+    } else {
+        for (auto& root : ctx.options.paths) {
+            pending.push_back(fs::weakly_canonical(root, ec));
+        }
+    }
+    std::sort(BE(pending));
+    pending.erase(std::unique(BE(pending)), pending.end());
+    StartRescan(ctx);
+}
+
+void HandleMsg(State& ctx, const msg::Rescanned& m) {
+    // Only the files that diverged from the tracked state are checked.
+    std::vector<bool> found(ctx.files.size());
+    size_t num_changed = 0;
+    for (auto& f : m.files) {
+        auto file = ctx.files.find(f.path);
+        if (!file || ctx.files.status(*file) == FileStatus::Untracked) {
+            // Not tracked: only added if its events would have added it.
+            if (f.last_write_time < ctx.watching_since) {
+                continue;
+            }
+            file = ctx.files.intern(f.path);
+        } else if (*file < found.size()) {
+            found[*file] = true;
+            if (ctx.files.time(*file) == f.last_write_time) {
+                continue;
+            }
+        }
+        CheckFile(ctx, *file, f.last_write_time, JobPriority::Bulk);
+        ++num_changed;
+    }
+    // The tracked files not found are gone, unless created since their directory was scanned.
+    std::vector<FileId> dirs;
+    for (auto& d : ctx.rescanning_dirs) {
+        if (auto dir = ctx.files.find(d)) {
+            dirs.push_back(*dir);
+        }
+    }
+    size_t num_removed = 0;
+    for (FileId file = 0; file < found.size(); ++file) {
+        if (found[file] || ctx.files.status(file) == FileStatus::Untracked
+            || std::none_of(BE(dirs),
+                            [&ctx, file](FileId dir) {
+                                return ctx.files.is_inside(file, dir);
+                            })
+            || fs_exists_noexcept(ctx.files.path(file))) {
+            continue;
+        }
+        ForgetFile(ctx, file);
+        ++num_removed;
+    }
+    fmt::print(stderr,
+               "Rescanned {} files: {} changed, {} removed.\n",
+               m.files.size(),
+               num_changed,
+               num_removed);
+    ctx.rescanning_dirs.clear();
+    StartRescan(ctx);
+}
+
+void HandleMsg(State& ctx, const msg::FormatAll&) {
+    // Many files: behind the user's and the editor's single files.
+    for (FileId file = 0; file < ctx.files.size(); ++file) {
+        if (ctx.files.status(file) == FileStatus::NeedsFormatting) {
+            FormatFile(ctx, file, JobPriority::Bulk);
+        }
+    }
+}
+
+void HandleMsg(State& ctx, const msg::FormatOne& m) {
+    FormatFile(ctx, m.file, JobPriority::Interactive);
+}
+
+void HandleMsg(State& ctx, const msg::TouchOne& m) {
+    std::error_code ec;
+    const auto now = fs::file_time_type::clock::now();
+    const auto path = ctx.files.path(m.file);
+    fs::last_write_time(path, now, ec);
+    if (!ec) {
+        // Assume touch is for formatted files.
+        if (ctx.files.status(m.file) == FileStatus::Formatted) {
+            SetFileFormatted(ctx, m.file, fs_last_write_time_noexcept(path).value_or(now));
+        } else {
+            assert(false);
+        }
+    }
+}
+
+void HandleMsg(State& ctx, const msg::AsyncClangFormatResult& m) {
+    JobFinished(ctx, m);
+    g_metrics.completion_to_ui.add(std::chrono::steady_clock::now() - m.completed_at);
+}
+
+// A tracked path, or its canonical form, which the scanner finds.
+std::optional<FileId> FindIpcFile(const State& ctx, const fs::path& path) {
+    if (auto file = ctx.files.find(path)) {
+        return file;
+    }
+    std::error_code ec;
+    auto canonical = fs::weakly_canonical(path, ec);
+    return ec ? std::nullopt : ctx.files.find(canonical);
+}
+
+// The file to format for a "format" request: one that would be checked if it changed.
+std::optional<FileId> IpcFormatTarget(State& ctx, const fs::path& path) {
+    std::error_code ec;
+    if (!ctx.options.extensions.contains(path.extension()) || !fs::is_regular_file(path, ec)) {
+        return std::nullopt;
+    }
+    if (auto file = FindIpcFile(ctx, path)) {
+        return file;
+    }
+    if (!IsInWatchedPaths(ctx, path) || ctx.path_filter->is_excluded(path, false)) {
+        return std::nullopt;
+    }
+    return ctx.files.intern(path);
+}
+
+// Answered from the file table, except "format" with waiting.
+void HandleMsg(State& ctx, const msg::IpcRequestReceived& m) {
+    const auto& r = m.request;
+    if (r.cmd == "status") {
+        bool all_formatted = true;
+        std::string files;
+        for (auto& p : r.paths) {
+            const auto path = PathFromUtf8(p);
+            const auto file = FindIpcFile(ctx, path);
+            auto status = file ? ctx.files.status(*file) : FileStatus::Untracked;
+            auto time = file ? ctx.files.time(*file) : fs::file_time_type{};
+            // The change may not have been checked yet, or its event not even received.
+            if (status != FileStatus::Untracked) {
+                if (auto last_write_time = fs_last_write_time_noexcept(path); !last_write_time) {
+                    status = FileStatus::Untracked;
+                } else if (*last_write_time != time) {
+                    status = FileStatus::NeedsFormatting;
+                    time = *last_write_time;
+                }
+            }
+            all_formatted = all_formatted && status == FileStatus::Formatted;
+            files += fmt::format(
+                "{}{{{}}}", files.empty() ? "" : ",", IpcFileStatusFields(p, status, time));
+        }
+        IpcSend(ctx,
+                m.client,
+                fmt::format(
+                    "{{\"id\":{},\"ok\":{},\"files\":[{}]}}\n", r.id, all_formatted, files));
+    } else if (r.cmd == "unformatted") {
+        std::string files;
+        const bool any = ctx.files.count(FileStatus::NeedsFormatting) > 0;
+        for (FileId file = 0; any && file < ctx.files.size(); ++file) {
+            if (ctx.files.status(file) == FileStatus::NeedsFormatting) {
+                files += fmt::format("{}{{{}}}",
+                                     files.empty() ? "" : ",",
+                                     IpcFileStatusFields(ToUtf8(ctx.files.path(file)),
+                                                         FileStatus::NeedsFormatting,
+                                                         ctx.files.time(file)));
+            }
+        }
+        IpcSend(
+            ctx, m.client, fmt::format("{{\"id\":{},\"ok\":true,\"files\":[{}]}}\n", r.id, files));
+    } else if (r.cmd == "format") {
+        IpcFormatWait wait{.client = m.client,
+                           .request_id = r.id,
+                           .paths = r.paths,
+                           .files = {},
+                           .results = {},
+                           .num_pending = 0};
+        for (auto& p : r.paths) {
+            const auto file = IpcFormatTarget(ctx, PathFromUtf8(p));
+            if (file && std::find(BE(wait.files), file) == wait.files.end()) {
+                FormatFile(ctx, *file, JobPriority::Interactive);
+            }
+            wait.files.push_back(file);
+            wait.results.push_back(file ? std::nullopt : std::optional(false));
+            wait.num_pending += file ? 1 : 0;
+        }
+        if (!r.wait) {
+            for (size_t i = 0; i < wait.files.size(); ++i) {
+                wait.results[i] = wait.files[i].has_value();
+            }
+            wait.num_pending = 0;
+        }
+        if (wait.num_pending == 0) {
+            IpcSendFormatResponse(ctx, wait);
+        } else {
+            ctx.ipc_format_waits.push_back(std::move(wait));
+        }
+    } else if (r.cmd == "format_buffer") {
+        if (r.path.empty()) {
+            IpcSend(ctx, m.client, IpcErrorJson(r.id, "Missing \"path\""));
+        } else {
+            // Answered by the formatter thread.
+            auto job = std::make_shared<BufferJob>(BufferJob{
+                .assumed_path = PathFromUtf8(r.path),
+                .content = r.content,
+                .lines = r.lines,
+                .on_done = [send = ctx.ipc_send, client = m.client, id = r.id](
+                               std::optional<std::string> formatted) {
+                    send(client,
+                         formatted ? fmt::format("{{\"id\":{},\"ok\":true,\"content\":{}}}\n",
+                                                 id,
+                                                 json_quote(*formatted))
+                                   : IpcErrorJson(id, "clang-format failed"));
+                }});
+            ctx.to_async_clang_format_queue.enqueue(
+                ACFMsg{.command = ACFMsg::Command::FormatBuffer,
+                       .path = job->assumed_path,
+                       .latest_generation = nullptr,
+                       .priority = JobPriority::Interactive,
+                       .buffer = std::move(job)});
+        }
+    } else if (r.cmd == "subscribe") {
+        ctx.ipc_subscribers.push_back(m.client);
+        IpcSend(ctx, m.client, fmt::format("{{\"id\":{},\"ok\":true}}\n", r.id));
+    } else {
+        IpcSend(ctx, m.client, IpcErrorJson(r.id, fmt::format("Unknown command: {}", r.cmd)));
+    }
+    g_metrics.ipc_request.add(std::chrono::steady_clock::now() - m.received_at);
+}
+
+void HandleMsg(State& ctx, const msg::IpcClientGone& m) {
+    std::erase(ctx.ipc_subscribers, m.client);
+    std::erase_if(ctx.ipc_format_waits, [&m](const IpcFormatWait& wait) {
+        return wait.client == m.client;
+    });
+}
+
+void WriteMetricsFile(State& ctx) {
+    ctx.metrics_written_at = std::chrono::steady_clock::now();
+    const auto& file = *ctx.options.metrics_file;
+    const auto app_queue_depth = ctx.to_app_queue.size_approx();
+    const auto job_queue_depth = ctx.to_async_clang_format_queue.size_approx();
+    auto content = file.extension() == ".json"
+                     ? MetricsToJson(g_metrics, app_queue_depth, job_queue_depth)
+                     : MetricsToPrometheus(g_metrics, app_queue_depth, job_queue_depth);
+    // Replace atomically, the file may be read any time.
+    auto tmp_file = file;
+    tmp_file += ".tmp";
+    std::error_code ec;
+    if (!fs_write_file_noexcept(tmp_file, content)) {
+        fmt::print(stderr, "Can't write {}\n", ToUtf8(tmp_file));
+        return;
+    }
+    fs::rename(tmp_file, file, ec);
+    if (ec) {
+        fmt::print(stderr,
+                   "Can't rename {} to {}: {}\n",
+                   ToUtf8(tmp_file),
+                   ToUtf8(file),
+                   ec.message());
+    }
+}
+
+ProcessMsgsResult ProcessMsgs(State& ctx) {
+    if (g_sigint_received) {
+        return ProcessMsgsResult::ShouldExit;
+    }
+    if (ctx.options.metrics_file
+        && std::chrono::steady_clock::now() - ctx.metrics_written_at >= k_metrics_write_period) {
+        WriteMetricsFile(ctx);
+    }
+    std::array<AppMsg, k_max_msgs_per_batch> msgs;
+    const auto n = ctx.to_app_queue.try_dequeue_bulk(msgs.data(), msgs.size());
+    if (n == 0) {
+        return ProcessMsgsResult::QueueWasEmpty;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        std::visit(
+            [&ctx](const auto& m) {
+                HandleMsg(ctx, m);
+            },
+            msgs[i]);
+    }
+    return ProcessMsgsResult::QueueWasNotEmpty;
+}
+
+void PrintQueueWaitStats() {
+    auto ms = [](Histogram::Duration d) {
+        return std::chrono::duration<double, std::milli>(d).count();
+    };
+    for (size_t i = 0; i < k_num_job_priorities; ++i) {
+        auto& h = g_metrics.queue_wait[i];
+        if (h.count() == 0) {
+            continue;
+        }
+        fmt::print(stderr,
+                   "Queue wait, {} jobs: {}, mean {:.1f} ms, p50 <= {:.1f} ms, p99 <= {:.1f} ms, "
+                   "max {:.1f} ms\n",
+                   JobPriorityName(JobPriority(i)),
+                   h.count(),
+                   ms(h.mean()),
+                   ms(h.percentile(50)),
+                   ms(h.percentile(99)),
+                   ms(h.max()));
+    }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "clang_format.h"
+#include "state.h"
+#include "ui.h"
+
+#include <atomic>
+#include <chrono>
+
+// The app thread's message handling, and the setup shared by claford and claford_bench.
+
+extern std::atomic<bool> g_sigint_received;
+
+constexpr auto k_metrics_write_period = std::chrono::seconds(10);
+
+// Creates the path filter and the Add All scanner for `ctx.options`.
+void InitDirScanning(State& ctx);
+// Starts the formatter threads, each with its own clone of `clang_format`. 0 means one per core.
+void StartFormatterThreads(State& ctx, const ClangFormat& clang_format, int num_threads);
+// Stops the scanner and the formatter threads.
+void StopThreads(State& ctx);
+// Checks the staged content of the files in `ctx.options.paths` on one thread per core, prints the
+// unformatted ones on stdout. Returns the exit code, a failure if any of them isn't formatted.
+int CheckStagedFiles(State& ctx, const ClangFormat& clang_format);
+
+ProcessMsgsResult ProcessMsgs(State& ctx);
+void WriteMetricsFile(State& ctx);
+void PrintQueueWaitStats();
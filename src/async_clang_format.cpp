@@ -1,43 +1,123 @@
 #include "async_clang_format.h"
 
+#include "metrics.h"
 #include "state.h"
 #include "util.h"
 
 #include <fmt/format.h>
 
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <vector>
+
+namespace {
+// Limits of jobs handled by a single clang-format invocation.
+constexpr size_t k_max_batch_files = 64;
+constexpr uintmax_t k_max_batch_bytes = 4 * 1024 * 1024;
+}  // namespace
+
 void AsyncClangFormat(std::unique_ptr<ClangFormat> clang_format,
+                      int num_threads,
                       ToAsyncClangFormatQueue* input_queue,
                       ToAppQueue* app_queue,
+                      SelfWrites* self_writes,
                       std::atomic<bool>* exit_flag) {
-    ACFMsg msg;
+    std::vector<ACFMsg> msgs(k_max_batch_files);
     for (;;) {
         constexpr int64_t k_one_second_in_usec = 1000000;
-        bool got_msg = input_queue->wait_dequeue_timed(msg, k_one_second_in_usec);
+        // Don't take more than a fair share, leave work for the other threads.
+        const size_t max_n = std::clamp(
+            input_queue->size_approx() / size_t(num_threads), size_t(1), k_max_batch_files);
+        const size_t n =
+            input_queue->wait_dequeue_bulk_timed(msgs.data(), max_n, k_one_second_in_usec);
         if (*exit_flag) {
             break;
         }
-        if (!got_msg) {
-            continue;
+        auto enqueue_result = [&](const ACFMsg& msg,
+                                  bool result,
+                                  std::filesystem::file_time_type last_write_time) {
+            app_queue->enqueue_result(
+                msg::AsyncClangFormatResult{.file = msg.file,
+                                            .command = msg.command,
+                                            .generation = msg.generation,
+                                            .last_write_time = last_write_time,
+                                            .result = result},
+                *exit_flag);
+        };
+        // Buffers first, an editor is waiting for them.
+        for (size_t i = 0; i < n; ++i) {
+            if (msgs[i].command != ACFMsg::Command::FormatBuffer) {
+                continue;
+            }
+            auto& job = *msgs[i].buffer;
+            const auto started_at = std::chrono::steady_clock::now();
+            auto formatted = clang_format->format_buffer(job.assumed_path, job.content, job.lines);
+            g_metrics.clang_format_run.add(std::chrono::steady_clock::now() - started_at);
+            ++g_metrics.jobs_run;
+            job.on_done(std::move(formatted));
+            msgs[i].buffer.reset();
         }
-        switch (msg.command) {
-            case ACFMsg::Command::CheckFormat: {
-                bool result = clang_format->is_file_formatted(msg.path);
-                app_queue->enqueue(msg::AsyncClangFormatResult{
-                    .completion = [path = std::move(msg.path),
-                                   completion = std::move(msg.completion),
-                                   result]() {
-                        completion(path, result);
-                    }});
-            } break;
-            case ACFMsg::Command::Format: {
-                bool result = clang_format->format_file_in_place(msg.path);
-                app_queue->enqueue(msg::AsyncClangFormatResult{
-                    .completion = [path = std::move(msg.path),
-                                   completion = std::move(msg.completion),
-                                   result]() {
-                        completion(path, result);
-                    }});
-            } break;
+        // Check and Format jobs are batched separately, in the original order.
+        for (auto command : {ACFMsg::Command::CheckFormat, ACFMsg::Command::Format}) {
+            std::vector<std::filesystem::path> batch;
+            std::vector<size_t> batch_indices;
+            uintmax_t batch_bytes = 0;
+            auto run_batch = [&]() {
+                if (batch.empty()) {
+                    return;
+                }
+                const auto started_at = std::chrono::steady_clock::now();
+                if (command == ACFMsg::Command::CheckFormat) {
+                    auto results = clang_format->are_files_formatted(batch);
+                    g_metrics.clang_format_run.add(std::chrono::steady_clock::now() - started_at);
+                    for (size_t i = 0; i < batch_indices.size(); ++i) {
+                        const auto& msg = msgs[batch_indices[i]];
+                        enqueue_result(
+                            msg, results[i] != CheckResult::Unformatted, msg.last_write_time);
+                    }
+                } else {
+                    auto results = clang_format->format_files_in_place(batch);
+                    g_metrics.clang_format_run.add(std::chrono::steady_clock::now() - started_at);
+                    for (size_t i = 0; i < batch_indices.size(); ++i) {
+                        const auto& msg = msgs[batch_indices[i]];
+                        if (results[i]) {
+                            // Before the result is sent, so the file monitor can recognize the
+                            // write by the time the app sees it.
+                            self_writes->record(msg.path, results[i]->content_hash);
+                        }
+                        enqueue_result(msg,
+                                       results[i].has_value(),
+                                       results[i] ? results[i]->last_write_time
+                                                  : msg.last_write_time);
+                    }
+                }
+                g_metrics.jobs_run += batch.size();
+                batch.clear();
+                batch_indices.clear();
+                batch_bytes = 0;
+            };
+            for (size_t i = 0; i < n; ++i) {
+                if (msgs[i].command != command) {
+                    continue;
+                }
+                if (command == ACFMsg::Command::CheckFormat && msgs[i].latest_generation
+                    && *msgs[i].latest_generation != msgs[i].generation) {
+                    // Superseded, the app thread drops the result.
+                    ++g_metrics.jobs_skipped;
+                    enqueue_result(msgs[i], false, msgs[i].last_write_time);
+                    continue;
+                }
+                std::error_code ec;
+                auto size = std::filesystem::file_size(msgs[i].path, ec);
+                if (!batch.empty() && batch_bytes + (ec ? 0 : size) > k_max_batch_bytes) {
+                    run_batch();
+                }
+                batch.push_back(msgs[i].path);
+                batch_indices.push_back(i);
+                batch_bytes += ec ? 0 : size;
+            }
+            run_batch();
         }
     }
 }
@@ -1,9 +1,17 @@
 #pragma once
 
 #include "clang_format.h"
+#include "self_writes.h"
 #include "state.h"
 
+#include <atomic>
+#include <memory>
+
+// Formatter thread main function. `num_threads` of these run concurrently on the same queues, each
+// with its own `clang_format` instance. The files formatted are recorded in `self_writes`.
 void AsyncClangFormat(std::unique_ptr<ClangFormat> clang_format,
+                      int num_threads,
                       ToAsyncClangFormatQueue* input_queue,
                       ToAppQueue* app_queue,
+                      SelfWrites* self_writes,
                       std::atomic<bool>* exit_flag);
@@ -1,38 +1,457 @@
 #include "clang_format.h"
 
+#include "clang_format_lib.h"
+#include "formatted_cache.h"
+#include "metrics.h"
 #include "util.h"
 
 #include <fmt/format.h>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/io_context.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/process.hpp>
 #include <boost/process/filesystem.hpp>
+#include <charconv>
+#include <chrono>
 #include <filesystem>
+#include <future>
+#include <iterator>
 #include <nowide/cstdlib.hpp>
 
 namespace bp = boost::process;
 namespace fs = std::filesystem;
 
+namespace {
+constexpr size_t k_formatted_cache_max_bytes = 64 * 1024 * 1024;
+
+void AppendLinesArgs(std::vector<std::string>& args, std::span<const LineRange> lines) {
+    for (auto& r : lines) {
+        args.push_back(fmt::format("--lines={}:{}", r.first, r.last));
+    }
+}
+
+struct Replacement {
+    size_t offset;
+    size_t length;
+    std::string text;
+};
+
+// Decodes the escapes clang-format writes in the replacement texts.
+std::optional<std::string> UnescapeXml(std::string_view s) {
+    std::string result;
+    result.reserve(s.size());
+    while (!s.empty()) {
+        if (s[0] != '&') {
+            result += s[0];
+            s.remove_prefix(1);
+            continue;
+        }
+        const auto end = s.find(';');
+        if (end == std::string_view::npos) {
+            return std::nullopt;
+        }
+        const auto entity = s.substr(1, end - 1);
+        if (entity == "lt") {
+            result += '<';
+        } else if (entity == "gt") {
+            result += '>';
+        } else if (entity == "amp") {
+            result += '&';
+        } else if (entity == "apos") {
+            result += '\'';
+        } else if (entity == "quot") {
+            result += '"';
+        } else if (entity.starts_with('#')) {
+            const bool hex = entity.starts_with("#x");
+            unsigned code = 0;
+            auto digits = entity.substr(hex ? 2 : 1);
+            auto fcr =
+                std::from_chars(digits.data(), digits.data() + digits.size(), code, hex ? 16 : 10);
+            // clang-format escapes only line breaks this way.
+            if (fcr.ec != std::errc() || fcr.ptr != digits.data() + digits.size()
+                || code >= 0x80) {
+                return std::nullopt;
+            }
+            result += char(code);
+        } else {
+            return std::nullopt;
+        }
+        s.remove_prefix(end + 1);
+    }
+    return result;
+}
+
+std::optional<size_t> XmlNumberAttribute(std::string_view tag, std::string_view name) {
+    const auto key = fmt::format(" {}='", name);
+    const auto p = tag.find(key);
+    if (p == std::string_view::npos) {
+        return std::nullopt;
+    }
+    const auto value = tag.substr(p + key.size());
+    size_t result = 0;
+    auto fcr = std::from_chars(value.data(), value.data() + value.size(), result);
+    if (fcr.ec != std::errc() || fcr.ptr == value.data() + value.size() || *fcr.ptr != '\'') {
+        return std::nullopt;
+    }
+    return result;
+}
+
+// Parses the output of `clang-format --output-replacements-xml FILE...`, a document per file:
+//
+//     <?xml version='1.0'?>
+//     <replacements xml:space='preserve' incomplete_format='false'>
+//     <replacement offset='10' length='2'>&#10;</replacement>
+//     </replacements>
+std::optional<std::vector<std::vector<Replacement>>> ParseReplacementsXml(std::string_view out) {
+    std::vector<std::vector<Replacement>> result;
+    for (size_t pos = 0; (pos = out.find("<replacements ", pos)) != std::string_view::npos;) {
+        const auto end = out.find("</replacements>", pos);
+        if (end == std::string_view::npos) {
+            return std::nullopt;
+        }
+        const auto document = out.substr(pos, end - pos);
+        auto& replacements = result.emplace_back();
+        for (size_t p = 0; (p = document.find("<replacement ", p)) != std::string_view::npos;) {
+            const auto tag_end = document.find('>', p);
+            const auto text_end = document.find("</replacement>", p);
+            if (tag_end == std::string_view::npos || text_end == std::string_view::npos
+                || text_end < tag_end) {
+                return std::nullopt;
+            }
+            const auto tag = document.substr(p, tag_end - p);
+            auto offset = XmlNumberAttribute(tag, "offset");
+            auto length = XmlNumberAttribute(tag, "length");
+            auto text = UnescapeXml(document.substr(tag_end + 1, text_end - tag_end - 1));
+            if (!offset || !length || !text) {
+                return std::nullopt;
+            }
+            replacements.push_back(
+                Replacement{.offset = *offset, .length = *length, .text = std::move(*text)});
+            p = text_end;
+        }
+        pos = end;
+    }
+    return result;
+}
+
+// nullopt if the replacements don't fit `content`, they are sorted and don't overlap.
+std::optional<std::string> ApplyReplacements(std::string_view content,
+                                             std::span<const Replacement> replacements) {
+    std::string result;
+    result.reserve(content.size());
+    size_t copied = 0;
+    for (auto& r : replacements) {
+        if (r.offset < copied || r.offset + r.length > content.size()) {
+            return std::nullopt;
+        }
+        result += content.substr(copied, r.offset - copied);
+        result += r.text;
+        copied = r.offset + r.length;
+    }
+    result += content.substr(copied);
+    return result;
+}
+}  // namespace
+
 struct ClangFormatImpl : public ClangFormat {
     bp::filesystem::path path;
+    std::string version_string;
+    std::shared_ptr<FormattedCache> formatted_cache;
+
+    ClangFormatImpl(bp::filesystem::path path,
+                    std::string version_string,
+                    std::shared_ptr<FormattedCache> formatted_cache)
+        : path(path)
+        , version_string(std::move(version_string))
+        , formatted_cache(std::move(formatted_cache)) {}
+
+    std::unique_ptr<ClangFormat> clone() const override {
+        return std::make_unique<ClangFormatImpl>(path, version_string, formatted_cache);
+    }
+
+    const std::string& version() const override {
+        return version_string;
+    }
+
+    // Runs clang-format once with the output captured and compares it to the file's content. If
+    // they differ the output is kept so a subsequent `format_file_in_place` doesn't need to run
+    // clang-format again. The content is piped in, so the output is of the content it's cached for
+    // even if the file changes meanwhile.
+    CheckResult is_file_formatted(const fs::path& f) override {
+        auto content = fs_read_file_noexcept(f);
+        if (!content) {
+            return CheckResult::Unformatted;
+        }
+        auto formatted = format_buffer(f, *content, {});
+        if (!formatted) {
+            return CheckResult::Unformatted;
+        }
+        if (*formatted == *content) {
+            formatted_cache->erase(f);
+            return CheckResult::Formatted;
+        }
+        formatted_cache->put(f, *content, std::move(*formatted));
+        return CheckResult::Unformatted;
+    }
+    // Writes the cached output of a check, or pipes the content through clang-format. Writing the
+    // output here instead of `clang-format -i` tells what was written.
+    std::optional<FormatResult> format_file_in_place(const fs::path& f) override {
+        return format_lines_in_place(f, {});
+    }
+
+    // Runs a single `clang-format --output-replacements-xml` for all files and applies the
+    // replacements to their content. The outputs of the unformatted files are cached like by
+    // `is_file_formatted`, so formatting them after a batch check doesn't run clang-format again.
+    // Falls back to one-by-one checks if the output can't be interpreted.
+    std::vector<CheckResult> are_files_formatted(std::span<const fs::path> files) override {
+        if (files.size() <= 1) {
+            return ClangFormat::are_files_formatted(files);
+        }
+        std::vector<std::string> contents;
+        for (auto& f : files) {
+            auto content = fs_read_file_noexcept(f);
+            if (!content) {
+                return ClangFormat::are_files_formatted(files);
+            }
+            contents.push_back(std::move(*content));
+        }
+        auto outputs = format_batch(files, contents);
+        if (!outputs) {
+            return ClangFormat::are_files_formatted(files);
+        }
+        std::vector<CheckResult> result(files.size());
+        for (size_t i = 0; i < files.size(); ++i) {
+            auto& formatted = (*outputs)[i];
+            if (!formatted) {
+                result[i] = is_file_formatted(files[i]);
+            } else if (*formatted == contents[i]) {
+                formatted_cache->erase(files[i]);
+                result[i] = CheckResult::Formatted;
+            } else {
+                formatted_cache->put(files[i], contents[i], std::move(*formatted));
+                result[i] = CheckResult::Unformatted;
+            }
+        }
+        return result;
+    }
 
-    explicit ClangFormatImpl(bp::filesystem::path path)
-        : path(path) {}
+    // Writes the cached outputs directly and runs a single `clang-format --output-replacements-xml`
+    // for the rest.
+    std::vector<std::optional<FormatResult>> format_files_in_place(
+        std::span<const fs::path> files) override {
+        std::vector<std::optional<FormatResult>> result(files.size());
+        std::vector<fs::path> remaining_files;
+        std::vector<std::string> remaining_contents;
+        std::vector<fs::file_time_type> remaining_times;
+        std::vector<size_t> remaining_indices;
+        for (size_t i = 0; i < files.size(); ++i) {
+            auto last_write_time = fs_last_write_time_noexcept(files[i]);
+            auto content = fs_read_file_noexcept(files[i]);
+            if (!last_write_time || !content) {
+                continue;
+            }
+            if (auto formatted = formatted_cache->take(files[i], *content)) {
+                result[i] = WriteFormatted(files[i], *content, *last_write_time, *formatted, {});
+            } else {
+                remaining_files.push_back(files[i]);
+                remaining_contents.push_back(std::move(*content));
+                remaining_times.push_back(*last_write_time);
+                remaining_indices.push_back(i);
+            }
+        }
+        if (remaining_files.size() <= 1) {
+            for (size_t j = 0; j < remaining_indices.size(); ++j) {
+                result[remaining_indices[j]] = format_file_in_place(remaining_files[j]);
+            }
+            return result;
+        }
+        auto outputs = format_batch(remaining_files, remaining_contents);
+        for (size_t j = 0; j < remaining_indices.size(); ++j) {
+            auto& r = result[remaining_indices[j]];
+            if (outputs && (*outputs)[j]) {
+                r = WriteFormatted(remaining_files[j],
+                                   remaining_contents[j],
+                                   remaining_times[j],
+                                   *(*outputs)[j],
+                                   {});
+            } else {
+                r = format_file_in_place(remaining_files[j]);
+            }
+        }
+        return result;
+    }
+
+    // Runs `clang-format --dry-run -Werror --lines=...`, falls back to checking the whole file if
+    // the output can't be interpreted.
+    CheckResult are_lines_formatted(const fs::path& f, std::span<const LineRange> lines) override {
+        std::vector<std::string> args = {"--dry-run", "-Werror"};
+        AppendLinesArgs(args, lines);
+        args.push_back(f.string());
+        std::error_code ec;
+        bp::ipstream pipe_err;
+        auto c = spawn(ec, bp::args(args), bp::std_out > bp::null, bp::std_err > pipe_err);
+        if (ec) {
+            return is_file_formatted(f);
+        }
+        bool found_violations = false;
+        std::string line;
+        while (std::getline(pipe_err, line)) {
+            if (line.find("[-Wclang-format-violations]") != std::string::npos) {
+                found_violations = true;
+            }
+        }
+        c.wait(ec);
+        if (found_violations) {
+            return CheckResult::Unformatted;
+        }
+        if (ec || c.exit_code() != EXIT_SUCCESS) {
+            return is_file_formatted(f);
+        }
+        return CheckResult::LinesFormatted;
+    }
+
+    std::optional<FormatResult> format_lines_in_place(const fs::path& f,
+                                                      std::span<const LineRange> lines) override {
+        auto last_write_time = fs_last_write_time_noexcept(f);
+        auto content = fs_read_file_noexcept(f);
+        if (!last_write_time || !content) {
+            return std::nullopt;
+        }
+        auto formatted = lines.empty() ? formatted_cache->take(f, *content) : std::nullopt;
+        if (!formatted) {
+            formatted = format_buffer(f, *content, lines);
+        }
+        if (!formatted) {
+            return std::nullopt;
+        }
+        return WriteFormatted(f, *content, *last_write_time, *formatted, lines);
+    }
+
+    // Pipes the content through `clang-format --assume-filename`.
+    std::optional<std::string> format_buffer(const fs::path& assumed_path,
+                                             const std::string& content,
+                                             std::span<const LineRange> lines) override {
+        std::vector<std::string> args = {"--assume-filename=" + assumed_path.string()};
+        AppendLinesArgs(args, lines);
+        std::error_code ec;
+        boost::asio::io_context ioc;
+        std::future<std::string> out;
+        // Written and read asynchronously, the child would block on a full pipe either way.
+        auto c = spawn(ec,
+                       bp::args(args),
+                       bp::std_in < boost::asio::buffer(content),
+                       bp::std_out > out,
+                       bp::std_err > bp::null,
+                       ioc);
+        if (ec) {
+            return std::nullopt;
+        }
+        ioc.run();
+        c.wait(ec);
+        if (ec || c.exit_code() != EXIT_SUCCESS) {
+            return std::nullopt;
+        }
+        return out.get();
+    }
+
+   private:
+    // Runs a single `clang-format --output-replacements-xml` for the files and applies the
+    // replacements to their `contents`. nullopt if the output can't be interpreted. An output is
+    // nullopt if its file changed meanwhile: the replacements may be of the new content.
+    std::optional<std::vector<std::optional<std::string>>> format_batch(
+        std::span<const fs::path> files, std::span<const std::string> contents) {
+        std::vector<std::string> args = {"--output-replacements-xml"};
+        for (auto& f : files) {
+            args.push_back(f.string());
+        }
+        auto out = run_and_capture_output(args);
+        auto replacements = out ? ParseReplacementsXml(*out) : std::nullopt;
+        if (!replacements || replacements->size() != files.size()) {
+            return std::nullopt;
+        }
+        std::vector<std::optional<std::string>> result(files.size());
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (fs_read_file_noexcept(files[i]) == contents[i]) {
+                result[i] = ApplyReplacements(contents[i], (*replacements)[i]);
+            }
+        }
+        return result;
+    }
 
-    bool is_file_formatted(const fs::path& f) override {
-        return bp::system(path,
-                          "--dry-run",
-                          "-Werror",
-                          f.string(),
-                          bp::std_out > bp::null,
-                          bp::std_err > bp::null)
-            == EXIT_SUCCESS;
+    // Starts clang-format, recording the cost of spawning the process.
+    template<class... Args>
+    bp::child spawn(std::error_code& ec, Args&&... args) {
+        const auto started_at = std::chrono::steady_clock::now();
+        bp::child c(path, std::forward<Args>(args)..., ec);
+        g_metrics.process_spawn.add(std::chrono::steady_clock::now() - started_at);
+        ++g_metrics.processes_spawned;
+        return c;
     }
-    bool format_file_in_place(const std::filesystem::path& f) override {
-        return bp::system(path, "-i", f.string(), bp::std_out > bp::null, bp::std_err > bp::null)
-            == EXIT_SUCCESS;
+
+    std::optional<std::string> run_and_capture_output(const std::vector<std::string>& args) {
+        std::error_code ec;
+        bp::ipstream pipe_out;
+        auto c = spawn(ec, bp::args(args), bp::std_out > pipe_out, bp::std_err > bp::null);
+        if (ec) {
+            return std::nullopt;
+        }
+        // Read everything before waiting, the child would block on a full pipe.
+        std::string out((std::istreambuf_iterator<char>(pipe_out)),
+                        std::istreambuf_iterator<char>());
+        c.wait(ec);
+        if (ec || c.exit_code() != EXIT_SUCCESS) {
+            return std::nullopt;
+        }
+        return out;
     }
 };
 
+std::vector<CheckResult> ClangFormat::are_files_formatted(std::span<const fs::path> files) {
+    std::vector<CheckResult> result;
+    result.reserve(files.size());
+    for (auto& f : files) {
+        result.push_back(is_file_formatted(f));
+    }
+    return result;
+}
+
+std::vector<std::optional<FormatResult>> ClangFormat::format_files_in_place(
+    std::span<const fs::path> files) {
+    std::vector<std::optional<FormatResult>> result;
+    result.reserve(files.size());
+    for (auto& f : files) {
+        result.push_back(format_file_in_place(f));
+    }
+    return result;
+}
+
+CheckResult ClangFormat::are_lines_formatted(const fs::path& f,
+                                             std::span<const LineRange> /* lines */) {
+    return is_file_formatted(f);
+}
+
+std::optional<FormatResult> ClangFormat::format_lines_in_place(
+    const fs::path& f, std::span<const LineRange> /* lines */) {
+    return format_file_in_place(f);
+}
+
+std::optional<FormatResult> WriteFormatted(const fs::path& f,
+                                           std::string_view content,
+                                           fs::file_time_type last_write_time,
+                                           std::string_view formatted,
+                                           std::span<const LineRange> lines) {
+    if (formatted != content) {
+        auto written_at = fs_replace_file_noexcept(f, formatted);
+        if (!written_at) {
+            return std::nullopt;
+        }
+        last_write_time = *written_at;
+    }
+    return FormatResult{.content_hash = hash64(formatted),
+                        .last_write_time = last_write_time,
+                        .partial = !lines.empty()};
+}
+
 std::vector<std::string> read_pipe_to_strings(bp::ipstream& pipe) {
     std::string line;
     std::vector<std::string> lines;
@@ -50,7 +469,7 @@ void print_error_report(const std::string& msg,
                         const std::vector<std::string>& err) {
     fmt::print(stderr, "{}\n", msg);
     if (out.empty() && err.empty()) {
-        fmt::print("Both stdout and stderr were empty.\n");
+        fmt::print(stderr, "Both stdout and stderr were empty.\n");
         return;
     }
     if (out.empty()) {
@@ -74,7 +493,18 @@ void print_error_report(const std::string& msg,
     }
 }
 
-std::optional<std::unique_ptr<ClangFormat>> ClangFormat::make() {
+std::optional<std::unique_ptr<ClangFormat>> ClangFormat::make(
+    ClangFormatBackend backend, std::shared_ptr<ClangFormatConfigCache> config_cache) {
+    if (backend != ClangFormatBackend::Process) {
+        if (auto lib = make_clang_format_lib(std::move(config_cache))) {
+            return lib;
+        }
+        if (backend == ClangFormatBackend::Library) {
+            fmt::print(stderr,
+                       "claford was built without libFormat, falling back to the clang-format "
+                       "executable.\n");
+        }
+    }
     auto clang_format_path = bp::search_path("clang-format");
     if (clang_format_path.native().empty()) {
         fmt::print(stderr, "clang-format not found on PATH, which is:\n");
@@ -83,7 +513,7 @@ std::optional<std::unique_ptr<ClangFormat>> ClangFormat::make() {
         }
         return std::nullopt;
     }
-    fmt::print("Found clang-format: {}\n", ToUtf8(fs::path(clang_format_path.native())));
+    fmt::print(stderr, "Found clang-format: {}\n", ToUtf8(fs::path(clang_format_path.native())));
     std::error_code ec;
     bp::ipstream pipe_err, pipe_out;
     int r = bp::system(
@@ -119,6 +549,9 @@ std::optional<std::unique_ptr<ClangFormat>> ClangFormat::make() {
         return std::nullopt;
     }
 
-    fmt::print("`clang-format --version: {}\n", out_lines[0]);
-    return std::make_unique<ClangFormatImpl>(clang_format_path);
+    fmt::print(stderr, "`clang-format --version`: {}\n", out_lines[0]);
+    return std::make_unique<ClangFormatImpl>(
+        clang_format_path,
+        out_lines[0],
+        std::make_shared<FormattedCache>(k_formatted_cache_max_bytes));
 }
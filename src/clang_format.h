@@ -1,14 +1,93 @@
 #pragma once
 
+#include <cstdint>
 #include <filesystem>
+#include <memory>
 #include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class ClangFormatConfigCache;
+
+// 1-based, inclusive, like clang-format's --lines.
+struct LineRange {
+    unsigned first;
+    unsigned last;
+
+    bool operator==(const LineRange&) const = default;
+};
+
+// What a successful format left in a file: the hash of its content, written or found formatted, and
+// its last write time after the write. A later save is told apart by them, reading the file again
+// could see that save instead.
+struct FormatResult {
+    uint64_t content_hash = 0;  // hash64 of the content.
+    std::filesystem::file_time_type last_write_time;
+    // Only some lines were formatted, the rest of the file may still be unformatted.
+    bool partial = false;
+};
+
+enum class CheckResult : uint8_t {
+    Unformatted,
+    Formatted,
+    // Only some lines were checked, the rest of the file is assumed to be formatted.
+    LinesFormatted,
+};
+
+enum class ClangFormatBackend {
+    Auto,     // Library if available, otherwise Process.
+    Process,  // Run the clang-format executable found on PATH.
+    Library   // Use clang's libFormat in-process.
+};
 
 class ClangFormat {
    public:
-    static std::optional<std::unique_ptr<ClangFormat>> make();
+    // The library backend resolves the config files through `config_cache`, a private one if
+    // nullptr.
+    static std::optional<std::unique_ptr<ClangFormat>> make(
+        ClangFormatBackend backend = ClangFormatBackend::Auto,
+        std::shared_ptr<ClangFormatConfigCache> config_cache = nullptr);
 
     virtual ~ClangFormat() = default;
 
-    virtual bool is_file_formatted(const std::filesystem::path& f) = 0;
-    virtual bool format_file_in_place(const std::filesystem::path& f) = 0;
+    // Returns an independent instance, so each formatter thread can own one.
+    virtual std::unique_ptr<ClangFormat> clone() const = 0;
+
+    // Identifies the formatter, results of different versions may differ.
+    virtual const std::string& version() const = 0;
+
+    virtual CheckResult is_file_formatted(const std::filesystem::path& f) = 0;
+    // nullopt on error.
+    virtual std::optional<FormatResult> format_file_in_place(const std::filesystem::path& f) = 0;
+
+    // Batch versions, one result per file. The default implementations process the files one by
+    // one, backends can override them to handle several files per clang-format invocation.
+    virtual std::vector<CheckResult> are_files_formatted(
+        std::span<const std::filesystem::path> files);
+    virtual std::vector<std::optional<FormatResult>> format_files_in_place(
+        std::span<const std::filesystem::path> files);
+
+    // Only the given lines (sorted, not overlapping), the rest of the file is assumed formatted.
+    // The default implementations process the whole file.
+    virtual CheckResult are_lines_formatted(const std::filesystem::path& f,
+                                            std::span<const LineRange> lines);
+    virtual std::optional<FormatResult> format_lines_in_place(const std::filesystem::path& f,
+                                                              std::span<const LineRange> lines);
+
+    // Formats `content` as if it were the file at `assumed_path`, which needn't exist: the style is
+    // looked up from its directory. Only `lines` if not empty. Nothing is written to disk. Returns
+    // nullopt on error.
+    virtual std::optional<std::string> format_buffer(const std::filesystem::path& assumed_path,
+                                                     const std::string& content,
+                                                     std::span<const LineRange> lines) = 0;
 };
+
+// For the backends: replaces the file's `content`, read at `last_write_time`, with `formatted`
+// unless they are the same. `lines` are the lines formatted, all if empty.
+std::optional<FormatResult> WriteFormatted(const std::filesystem::path& f,
+                                           std::string_view content,
+                                           std::filesystem::file_time_type last_write_time,
+                                           std::string_view formatted,
+                                           std::span<const LineRange> lines);
@@ -0,0 +1,140 @@
+#include "clang_format_config.h"
+
+#include <algorithm>
+#include <string_view>
+
+namespace fs = std::filesystem;
+
+namespace {
+const char* const k_config_filenames[] = {".clang-format", "_clang-format"};
+
+// Any of its styles may be based on the config file in effect for the parent directory.
+bool InheritsParentConfig(std::string_view content) {
+    return content.find("InheritParentConfig") != std::string_view::npos;
+}
+
+uint64_t CombineHashes(uint64_t hash, uint64_t parent_hash) {
+    return hash64(std::string_view(reinterpret_cast<const char*>(&hash), sizeof(hash)),
+                  parent_hash);
+}
+
+// The directory whose config file in effect a config file in `config_dir` inherits from.
+std::optional<fs::path> ParentConfigDir(const fs::path& config_dir) {
+    if (!config_dir.has_parent_path() || config_dir.parent_path() == config_dir) {
+        return std::nullopt;
+    }
+    return config_dir.parent_path();
+}
+}  // namespace
+
+std::optional<fs::path> FindClangFormatConfigFileInDir(const fs::path& dir) {
+    for (auto* n : k_config_filenames) {
+        auto candidate = dir / n;
+        if (fs_exists_noexcept(candidate) && !fs_is_directory_noexcept(candidate)) {
+            return candidate;
+        }
+    }
+    return std::nullopt;
+}
+
+bool IsClangFormatConfigFile(const fs::path& path) {
+    const auto filename = path.filename();
+    return std::any_of(std::begin(k_config_filenames),
+                       std::end(k_config_filenames),
+                       [&filename](const char* n) {
+                           return filename == n;
+                       });
+}
+
+ClangFormatConfig ClangFormatConfigCache::get(const fs::path& dir) {
+    std::lock_guard lock(mutex);
+    ClangFormatConfig result{.file = config_file_for_locked(dir)};
+    if (result.file) {
+        result.hash = hash_locked(*result.file);
+    }
+    return result;
+}
+
+std::optional<ClangFormatConfig> ClangFormatConfigCache::peek(const fs::path& dir) {
+    std::lock_guard lock(mutex);
+    auto it = config_file_of_dir.find(dir);
+    if (it == config_file_of_dir.end()) {
+        return std::nullopt;
+    }
+    ClangFormatConfig result{.file = it->second};
+    if (result.file) {
+        result.hash = peek_hash_locked(*result.file);
+    }
+    return result;
+}
+
+void ClangFormatConfigCache::invalidate(const fs::path& dir) {
+    std::lock_guard lock(mutex);
+    std::erase_if(config_file_of_dir, [&dir](const auto& kv) {
+        auto& d = kv.first;
+        return std::mismatch(BE(dir), d.begin(), d.end()).first == dir.end();
+    });
+    for (auto* n : k_config_filenames) {
+        file_hashes.erase(dir / n);
+    }
+}
+
+std::optional<fs::path> ClangFormatConfigCache::config_file_for_locked(const fs::path& dir) {
+    if (auto it = config_file_of_dir.find(dir); it != config_file_of_dir.end()) {
+        return it->second;
+    }
+    auto result = FindClangFormatConfigFileInDir(dir);
+    if (!result && dir.has_parent_path() && dir.parent_path() != dir) {
+        result = config_file_for_locked(dir.parent_path());
+    }
+    config_file_of_dir.emplace(dir, result);
+    return result;
+}
+
+uint64_t ClangFormatConfigCache::hash_locked(const fs::path& file) {
+    auto last_write_time = fs_last_write_time_noexcept(file);
+    if (!last_write_time) {
+        return 0;
+    }
+    auto it = file_hashes.find(file);
+    if (it == file_hashes.end() || it->second.last_write_time != *last_write_time) {
+        auto content = fs_read_file_noexcept(file);
+        it = file_hashes
+                 .insert_or_assign(file,
+                                   FileHash{*last_write_time,
+                                            content ? hash64(*content) : 0,
+                                            content && InheritsParentConfig(*content)})
+                 .first;
+    }
+    // Copied, the recursion may rehash `file_hashes`.
+    const auto hash = it->second.hash;
+    if (!it->second.inherits_parent_config) {
+        return hash;
+    }
+    const auto parent_dir = ParentConfigDir(file.parent_path());
+    const auto parent_file = parent_dir ? config_file_for_locked(*parent_dir) : std::nullopt;
+    return CombineHashes(hash, parent_file ? hash_locked(*parent_file) : 0);
+}
+
+uint64_t ClangFormatConfigCache::peek_hash_locked(const fs::path& file) {
+    auto it = file_hashes.find(file);
+    if (it == file_hashes.end()) {
+        return 0;
+    }
+    if (!it->second.inherits_parent_config) {
+        return it->second.hash;
+    }
+    std::optional<fs::path> parent_file;
+    if (const auto parent_dir = ParentConfigDir(file.parent_path())) {
+        auto dir_it = config_file_of_dir.find(*parent_dir);
+        if (dir_it == config_file_of_dir.end()) {
+            return 0;
+        }
+        parent_file = dir_it->second;
+    }
+    if (!parent_file) {
+        return CombineHashes(it->second.hash, 0);
+    }
+    const auto parent_hash = peek_hash_locked(*parent_file);
+    return parent_hash == 0 ? 0 : CombineHashes(it->second.hash, parent_hash);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "util.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
+// Returns the .clang-format or _clang-format file located directly in `dir`.
+std::optional<std::filesystem::path> FindClangFormatConfigFileInDir(
+    const std::filesystem::path& dir);
+// Whether `path` is named .clang-format or _clang-format.
+bool IsClangFormatConfigFile(const std::filesystem::path& path);
+
+struct ClangFormatConfig {
+    std::optional<std::filesystem::path> file;  // nullopt: no config file, fallback style.
+    // Hash of the file's content and of the parent config files it inherits from
+    // (`BasedOnStyle: InheritParentConfig`), 0 if no file.
+    uint64_t hash = 0;
+
+    bool operator==(const ClangFormatConfig&) const = default;
+};
+
+// Thread-safe cache of the .clang-format file in effect for each directory (same lookup as
+// `clang-format -style=file`) and the hash of its content. The content hashes are revalidated by
+// the config files' last write times, the config files in effect are kept until `invalidate`.
+class ClangFormatConfigCache {
+   public:
+    ClangFormatConfig get(const std::filesystem::path& dir);
+    // The config file in effect for `dir` if it's cached, without accessing the disk. `hash` is 0
+    // if it hasn't been read yet.
+    std::optional<ClangFormatConfig> peek(const std::filesystem::path& dir);
+    // Forgets the config files in effect for `dir` and the directories below it, after a config
+    // file in `dir` was added, changed or removed.
+    void invalidate(const std::filesystem::path& dir);
+
+   private:
+    std::optional<std::filesystem::path> config_file_for_locked(const std::filesystem::path& dir);
+    // The hash of `file` with the files it inherits from, read from the disk if changed.
+    uint64_t hash_locked(const std::filesystem::path& file);
+    // Same from the cached hashes only, 0 if any of them is missing.
+    uint64_t peek_hash_locked(const std::filesystem::path& file);
+
+    struct FileHash {
+        std::filesystem::file_time_type last_write_time;
+        uint64_t hash;  // Of the file's own content.
+        bool inherits_parent_config;
+    };
+
+    std::mutex mutex;
+    std::unordered_map<std::filesystem::path, std::optional<std::filesystem::path>>
+        config_file_of_dir;
+    std::unordered_map<std::filesystem::path, FileHash> file_hashes;
+};
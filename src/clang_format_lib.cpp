@@ -0,0 +1,173 @@
+#include "clang_format_lib.h"
+
+#if CLAFORD_HAVE_LIBFORMAT
+
+#    include "clang_format_config.h"
+#    include "util.h"
+
+#    include <clang/Basic/Version.h>
+#    include <clang/Format/Format.h>
+#    include <clang/Tooling/Core/Replacement.h>
+#    include <fmt/format.h>
+
+#    include <algorithm>
+#    include <map>
+
+namespace fs = std::filesystem;
+
+namespace {
+struct ClangFormatLib : public ClangFormat {
+    struct CachedStyle {
+        uint64_t config_hash;
+        clang::format::FormatStyle style;
+    };
+    // The .clang-format file in effect for each directory, shared by the clones.
+    std::shared_ptr<ClangFormatConfigCache> config_cache;
+    // (config file, language) -> parsed style.
+    std::map<std::pair<fs::path, clang::format::FormatStyle::LanguageKind>, CachedStyle> styles;
+
+    const std::string version_string = clang::getClangFullVersion();
+
+    explicit ClangFormatLib(std::shared_ptr<ClangFormatConfigCache> config_cache)
+        : config_cache(std::move(config_cache)) {}
+
+    std::unique_ptr<ClangFormat> clone() const override {
+        return std::make_unique<ClangFormatLib>(config_cache);
+    }
+
+    const std::string& version() const override {
+        return version_string;
+    }
+
+    CheckResult is_file_formatted(const fs::path& f) override {
+        return are_lines_formatted(f, {});
+    }
+    std::optional<FormatResult> format_file_in_place(const fs::path& f) override {
+        return format_lines_in_place(f, {});
+    }
+
+    CheckResult are_lines_formatted(const fs::path& f, std::span<const LineRange> lines) override {
+        auto content = fs_read_file_noexcept(f);
+        if (!content) {
+            return CheckResult::Unformatted;
+        }
+        auto formatted = format(f, *content, lines);
+        if (!formatted || *formatted != *content) {
+            return CheckResult::Unformatted;
+        }
+        return lines.empty() ? CheckResult::Formatted : CheckResult::LinesFormatted;
+    }
+    std::optional<FormatResult> format_lines_in_place(const fs::path& f,
+                                                      std::span<const LineRange> lines) override {
+        auto last_write_time = fs_last_write_time_noexcept(f);
+        auto content = fs_read_file_noexcept(f);
+        if (!last_write_time || !content) {
+            return std::nullopt;
+        }
+        auto formatted = format(f, *content, lines);
+        if (!formatted) {
+            return std::nullopt;
+        }
+        return WriteFormatted(f, *content, *last_write_time, *formatted, lines);
+    }
+
+    std::optional<std::string> format_buffer(const fs::path& assumed_path,
+                                             const std::string& content,
+                                             std::span<const LineRange> lines) override {
+        return format(assumed_path, content, lines);
+    }
+
+   private:
+    // The byte ranges of `lines`, the whole code if empty.
+    static std::vector<clang::tooling::Range> ranges_of(const std::string& code,
+                                                        std::span<const LineRange> lines) {
+        if (lines.empty()) {
+            return {clang::tooling::Range(0, unsigned(code.size()))};
+        }
+        std::vector<clang::tooling::Range> result;
+        unsigned line = 1;
+        size_t line_start = 0;
+        for (auto& r : lines) {
+            for (; line < r.first && line_start < code.size(); ++line) {
+                line_start = std::min(code.find('\n', line_start), code.size() - 1) + 1;
+            }
+            const auto start = line_start;
+            for (; line <= r.last && line_start < code.size(); ++line) {
+                line_start = std::min(code.find('\n', line_start), code.size() - 1) + 1;
+            }
+            result.emplace_back(unsigned(start), unsigned(line_start - start));
+        }
+        return result;
+    }
+
+    // Same steps as the clang-format executable: sort includes, then reformat `lines`.
+    std::optional<std::string> format(const fs::path& f,
+                                      const std::string& code,
+                                      std::span<const LineRange> lines) {
+        auto* style = style_for(f, code);
+        if (!style) {
+            return std::nullopt;
+        }
+        const auto filename = ToUtf8(f);
+        auto ranges = ranges_of(code, lines);
+        auto replaces = clang::format::sortIncludes(*style, code, ranges, filename);
+        auto changed_code = clang::tooling::applyAllReplacements(code, replaces);
+        if (!changed_code) {
+            llvm::consumeError(changed_code.takeError());
+            return std::nullopt;
+        }
+        ranges = clang::tooling::calculateRangesAfterReplacements(replaces, ranges);
+        auto format_changes = clang::format::reformat(*style, *changed_code, ranges, filename);
+        replaces = replaces.merge(format_changes);
+        auto result = clang::tooling::applyAllReplacements(code, replaces);
+        if (!result) {
+            llvm::consumeError(result.takeError());
+            return std::nullopt;
+        }
+        return std::move(*result);
+    }
+
+    // Same lookup and fallback as the executable with -style=file, including the parent configs
+    // of `BasedOnStyle: InheritParentConfig`. Cached by the config file in effect, whose hash
+    // covers the files it inherits from.
+    const clang::format::FormatStyle* style_for(const fs::path& f, const std::string& code) {
+        const auto filename = ToUtf8(f);
+        const auto language = clang::format::guessLanguage(filename, code);
+        const auto config = config_cache->get(f.parent_path());
+        auto key = std::make_pair(config.file.value_or(fs::path()), language);
+        auto it = styles.find(key);
+        if (it != styles.end() && it->second.config_hash == config.hash) {
+            return &it->second.style;
+        }
+        auto style = clang::format::getStyle("file", filename, "LLVM", code);
+        if (!style) {
+            fmt::print(stderr,
+                       "Invalid config file for {}: {}\n",
+                       filename,
+                       llvm::toString(style.takeError()));
+            return nullptr;
+        }
+        auto& cached = styles[key];
+        cached = CachedStyle{config.hash, std::move(*style)};
+        return &cached.style;
+    }
+};
+}  // namespace
+
+std::unique_ptr<ClangFormat> make_clang_format_lib(
+    std::shared_ptr<ClangFormatConfigCache> config_cache) {
+    fmt::print(stderr, "Using in-process libFormat: {}\n", clang::getClangFullVersion());
+    if (!config_cache) {
+        config_cache = std::make_shared<ClangFormatConfigCache>();
+    }
+    return std::make_unique<ClangFormatLib>(std::move(config_cache));
+}
+
+#else
+
+std::unique_ptr<ClangFormat> make_clang_format_lib(
+    std::shared_ptr<ClangFormatConfigCache> /* config_cache */) {
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "clang_format.h"
+#include "clang_format_config.h"
+
+#include <memory>
+
+// In-process backend using clang's libFormat. Returns nullptr if claford was built without it
+// (CLAFORD_USE_LIBFORMAT=OFF). The clones share `config_cache`, a new one is made if nullptr.
+std::unique_ptr<ClangFormat> make_clang_format_lib(
+    std::shared_ptr<ClangFormatConfigCache> config_cache);
@@ -0,0 +1,161 @@
+// claford_client: command line client of the local API of a running claford, see ipc.h. For
+// pre-commit hooks and editor plugins, and to try the API out.
+
+#include "ipc.h"
+#include "ipc_client.h"
+#include "util.h"
+
+#include <fmt/format.h>
+#include <nowide/args.hpp>
+#include <nowide/iostream.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iterator>
+#include <string_view>
+
+namespace fs = std::filesystem;
+
+namespace {
+// Also if claford isn't running, so a hook can fall back to running clang-format.
+constexpr int k_exit_no_server = 2;
+
+void DisplayHelp() {
+    fmt::print("claford_client - query a running claford\n");
+    fmt::print("Usage: claford_client [options] command [files...]\n\n");
+    fmt::print("   -h|--help: this help\n");
+    fmt::print("   --socket PATH: claford's socket (default: {})\n",
+               ToUtf8(DefaultIpcSocketPath()));
+    fmt::print("   --no-wait: with format, don't wait for the files to be formatted\n");
+    fmt::print("   --assume-filename PATH: with format_buffer, the path of the buffer\n");
+    fmt::print("   --lines FIRST:LAST: with format_buffer, only these lines (can be repeated)\n");
+    fmt::print("\n");
+    fmt::print("Commands, printing the responses as JSON lines:\n");
+    fmt::print("   status files...: the status of the files, fails if any isn't formatted\n");
+    fmt::print("   unformatted: the files known to need formatting\n");
+    fmt::print("   format files...: format the files, fails if any couldn't be formatted\n");
+    fmt::print("   subscribe: print the status changes until interrupted\n");
+    fmt::print("   format_buffer: format stdin to stdout like clang-format --assume-filename,\n");
+    fmt::print("       with claford's warm formatter\n");
+    fmt::print("\n");
+    fmt::print("Exit code 0 on success, 1 on failure, {} if claford can't be reached.\n",
+               k_exit_no_server);
+}
+}  // namespace
+
+int main_core(int argc, char* argv[]) {
+    nowide::args _(argc, argv);
+
+    fs::path socket_path = DefaultIpcSocketPath();
+    IpcRequest request;
+    for (int i = 1; i < argc; ++i) {
+        auto ai = std::string_view(argv[i]);
+        if (ai == "-h" || ai == "--help") {
+            DisplayHelp();
+            return EXIT_SUCCESS;
+        } else if (ai == "--socket") {
+            if (i + 1 >= argc) {
+                nowide::cerr << "Missing argument after " << ai << "\n";
+                return EXIT_FAILURE;
+            }
+            socket_path = PathFromUtf8(argv[++i]);
+        } else if (ai == "--no-wait") {
+            request.wait = false;
+        } else if (ai == "--assume-filename") {
+            if (i + 1 >= argc) {
+                nowide::cerr << "Missing argument after " << ai << "\n";
+                return EXIT_FAILURE;
+            }
+            std::error_code ec;
+            auto abs_path = fs::absolute(PathFromUtf8(argv[++i]), ec);
+            if (ec) {
+                nowide::cerr << "Can't convert path to absolute: " << argv[i] << "\n";
+                return EXIT_FAILURE;
+            }
+            request.path = ToUtf8(abs_path.lexically_normal());
+        } else if (ai == "--lines") {
+            if (i + 1 >= argc) {
+                nowide::cerr << "Missing argument after " << ai << "\n";
+                return EXIT_FAILURE;
+            }
+            auto range = ParseLineRange(argv[++i]);
+            if (!range) {
+                nowide::cerr << "Invalid line range: " << argv[i] << "\n";
+                return EXIT_FAILURE;
+            }
+            request.lines.push_back(*range);
+        } else if (ai.starts_with("-")) {
+            nowide::cerr << "Invalid option: " << ai << "\n";
+            return EXIT_FAILURE;
+        } else if (request.cmd.empty()) {
+            request.cmd = ai;
+        } else {
+            std::error_code ec;
+            auto abs_path = fs::absolute(PathFromUtf8(ai), ec);
+            if (ec) {
+                nowide::cerr << "Can't convert path to absolute: " << ai << "\n";
+                return EXIT_FAILURE;
+            }
+            request.paths.push_back(ToUtf8(abs_path.lexically_normal()));
+        }
+    }
+    if (request.cmd.empty()) {
+        DisplayHelp();
+        return EXIT_FAILURE;
+    }
+
+    if (request.cmd == "format_buffer") {
+        if (request.path.empty()) {
+            nowide::cerr << "format_buffer needs --assume-filename.\n";
+            return EXIT_FAILURE;
+        }
+        request.content.assign(std::istreambuf_iterator<char>(nowide::cin),
+                               std::istreambuf_iterator<char>());
+    }
+
+    std::string error;
+    auto client = IpcClient::connect(socket_path, error);
+    if (!client) {
+        nowide::cerr << error << "\n";
+        return k_exit_no_server;
+    }
+    auto response = client->request(request);
+    if (!response) {
+        nowide::cerr << "claford closed the connection.\n";
+        return k_exit_no_server;
+    }
+    auto object = ParseFlatJsonObject(*response);
+    const bool ok = object && object->booleans.contains("ok") && object->booleans.at("ok");
+    if (request.cmd == "format_buffer") {
+        // Only the formatted content on stdout, like clang-format.
+        if (!ok || !object->strings.contains("content")) {
+            nowide::cerr << *response << "\n";
+            return EXIT_FAILURE;
+        }
+        nowide::cout << object->strings.at("content") << std::flush;
+        return EXIT_SUCCESS;
+    }
+    nowide::cout << *response << "\n";
+    if (!ok) {
+        return EXIT_FAILURE;
+    }
+    if (request.cmd == "subscribe") {
+        while (auto line = client->read_line()) {
+            nowide::cout << *line << std::endl;
+        }
+        return k_exit_no_server;
+    }
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        return main_core(argc, argv);
+    } catch (std::exception& e) {
+        nowide::cerr << "Terminating with exception: " << e.what() << "\n";
+    } catch (...) {
+        nowide::cerr << "Terminating with unknown exception.\n";
+    }
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,292 @@
+#include "dir_scanner.h"
+
+#include "util.h"
+
+#include <fmt/format.h>
+
+#ifndef _WIN32
+#    include <dirent.h>
+#    include <fcntl.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#endif
+
+#include <algorithm>
+
+namespace fs = std::filesystem;
+namespace chr = std::chrono;
+
+namespace {
+// Number of files reported in a single `on_files` call.
+constexpr size_t k_batch_size = 256;
+}  // namespace
+
+DirScanner::DirScanner(int num_threads,
+                       std::shared_ptr<PathFilter> filter,
+                       OnFilesFn on_files,
+                       OnDoneFn on_done)
+    : num_threads(std::max(1, num_threads))
+    , filter(std::move(filter))
+    , on_files(std::move(on_files))
+    , on_done(std::move(on_done)) {}
+
+DirScanner::~DirScanner() {
+    stop();
+}
+
+bool DirScanner::start(const std::vector<fs::path>& roots, const std::set<fs::path>& exts) {
+    if (is_running()) {
+        return false;
+    }
+    join();
+
+    // Canonical roots, without the ones inside other roots.
+    std::vector<fs::path> canonical_roots;
+    for (auto& r : roots) {
+        std::error_code ec;
+        auto canonical_root = fs::canonical(r, ec);
+        if (ec) {
+            fmt::print(stderr,
+                       "Can't convert {} to canonical path, reason: {}\n",
+                       ToUtf8(r),
+                       ec.message());
+            continue;
+        }
+        canonical_roots.push_back(std::move(canonical_root));
+    }
+    std::sort(BE(canonical_roots));
+    dirs.clear();
+    for (auto& r : canonical_roots) {
+        if (!dirs.empty()) {
+            auto& outer = dirs.back();
+            if (std::mismatch(BE(outer), r.begin(), r.end()).first == outer.end()) {
+                continue;
+            }
+        }
+        dirs.push_back(std::move(r));
+    }
+
+    extensions.clear();
+    for (auto& e : exts) {
+        extensions.insert(e.native());
+    }
+    stop_flag = false;
+    num_files_found = 0;
+    num_busy_threads = 0;
+    started_at = chr::steady_clock::now();
+    num_running_threads = num_threads;
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back(&DirScanner::worker, this);
+    }
+    return true;
+}
+
+bool DirScanner::is_running() const {
+    return num_running_threads > 0;
+}
+
+void DirScanner::stop() {
+    {
+        std::lock_guard lock(mutex);
+        stop_flag = true;
+    }
+    cv.notify_all();
+    join();
+}
+
+void DirScanner::join() {
+    for (auto& t : threads) {
+        if (t.joinable()) {
+            t.join();
+        }
+    }
+    threads.clear();
+}
+
+void DirScanner::worker() {
+    std::vector<FoundFile> batch;
+    for (;;) {
+        fs::path dir;
+        {
+            std::unique_lock lock(mutex);
+            cv.wait(lock, [this]() {
+                return stop_flag || !dirs.empty() || num_busy_threads == 0;
+            });
+            if (stop_flag || dirs.empty()) {
+                // Stopped, or no directory left and no one to share more.
+                break;
+            }
+            dir = std::move(dirs.back());
+            dirs.pop_back();
+            ++num_busy_threads;
+        }
+        scan_dir(dir, batch);
+        {
+            std::lock_guard lock(mutex);
+            if (--num_busy_threads == 0 && dirs.empty()) {
+                cv.notify_all();
+            }
+        }
+    }
+    if (!stop_flag) {
+        flush(batch);
+    }
+    if (--num_running_threads == 0 && !stop_flag) {
+        fmt::print(stderr,
+                   "Found {} files in {} ms.\n",
+                   num_files_found.load(),
+                   chr::duration_cast<chr::milliseconds>(chr::steady_clock::now() - started_at)
+                       .count());
+        if (on_done) {
+            on_done();
+        }
+    }
+}
+
+bool DirScanner::has_extension(std::basic_string_view<fs::path::value_type> filename) const {
+    // Same as fs::path::extension(): a leading dot doesn't start an extension.
+    auto dot = filename.rfind('.');
+    if (dot == filename.npos || dot == 0) {
+        return false;
+    }
+    return extensions.find(filename.substr(dot)) != extensions.end();
+}
+
+bool DirScanner::should_share() {
+    std::lock_guard lock(mutex);
+    return dirs.size() < size_t(num_threads);
+}
+
+void DirScanner::share(fs::path dir) {
+    {
+        std::lock_guard lock(mutex);
+        dirs.push_back(std::move(dir));
+    }
+    cv.notify_one();
+}
+
+void DirScanner::add_file(fs::path path, bool is_symlink, std::vector<FoundFile>& batch) {
+    if (filter && filter->is_excluded(path, false)) {
+        return;
+    }
+    if (is_symlink) {
+        std::error_code ec;
+        path = fs::canonical(path, ec);
+        if (ec || !fs::is_regular_file(path, ec)) {
+            return;
+        }
+    }
+    auto last_write_time = fs_last_write_time_noexcept(path);
+    if (!last_write_time) {
+        return;
+    }
+    batch.push_back(FoundFile{.path = std::move(path), .last_write_time = *last_write_time});
+    if (batch.size() >= k_batch_size) {
+        flush(batch);
+    }
+}
+
+void DirScanner::flush(std::vector<FoundFile>& batch) {
+    if (batch.empty()) {
+        return;
+    }
+    num_files_found += batch.size();
+    on_files(std::move(batch));
+    batch.clear();
+}
+
+#ifdef _WIN32
+void DirScanner::scan_dir(const fs::path& dir, std::vector<FoundFile>& batch) {
+    std::error_code ec;
+    // The directory entries come with the file attributes, `is_*` don't need further syscalls.
+    for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        if (stop_flag) {
+            return;
+        }
+        auto& entry = *it;
+        if (entry.is_symlink(ec)) {
+            if (has_extension(entry.path().filename().native())) {
+                add_file(entry.path(), true, batch);
+            }
+        } else if (entry.is_directory(ec)) {
+            if (filter && filter->is_excluded(entry.path(), true)) {
+                continue;
+            }
+            if (should_share()) {
+                share(entry.path());
+            } else {
+                scan_dir(entry.path(), batch);
+            }
+        } else if (entry.is_regular_file(ec)
+                   && has_extension(entry.path().filename().native())) {
+            add_file(entry.path(), false, batch);
+        }
+    }
+}
+#else
+void DirScanner::scan_dir(const fs::path& dir, std::vector<FoundFile>& batch) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    scan_dir_fd(fd, dir.native(), batch);
+}
+
+// Takes ownership of `fd`.
+void DirScanner::scan_dir_fd(int fd, const std::string& dir, std::vector<FoundFile>& batch) {
+    DIR* d = fdopendir(fd);
+    if (!d) {
+        close(fd);
+        return;
+    }
+    auto child_path = [&dir](std::string_view name) {
+        std::string s;
+        s.reserve(dir.size() + 1 + name.size());
+        s += dir;
+        if (s.empty() || s.back() != '/') {
+            s += '/';
+        }
+        s += name;
+        return s;
+    };
+    while (const dirent* de = readdir(d)) {
+        if (stop_flag) {
+            break;
+        }
+        const std::string_view name = de->d_name;
+        if (name == "." || name == "..") {
+            continue;
+        }
+        auto type = de->d_type;
+        if (type == DT_UNKNOWN) {
+            // Some filesystems don't fill in d_type.
+            struct stat st;
+            if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode)   ? DT_DIR
+                 : S_ISREG(st.st_mode) ? DT_REG
+                 : S_ISLNK(st.st_mode) ? DT_LNK
+                                       : DT_UNKNOWN;
+        }
+        if (type == DT_DIR) {
+            auto sub = child_path(name);
+            if (filter && filter->is_excluded(sub, true)) {
+                continue;
+            }
+            if (should_share()) {
+                share(std::move(sub));
+            } else {
+                int sub_fd =
+                    openat(dirfd(d), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (sub_fd >= 0) {
+                    scan_dir_fd(sub_fd, sub, batch);
+                }
+            }
+        } else if ((type == DT_REG || type == DT_LNK) && has_extension(name)) {
+            add_file(child_path(name), type == DT_LNK, batch);
+        }
+    }
+    closedir(d);
+}
+#endif
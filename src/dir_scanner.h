@@ -0,0 +1,83 @@
+#pragma once
+
+#include "path_filter.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+struct FoundFile {
+    std::filesystem::path path;
+    std::filesystem::file_time_type last_write_time;
+};
+
+// Walks directory trees on a pool of threads and reports the files with the given extensions in
+// batches, while the scan is still running. The extensions are matched against the names read from
+// the directories, so non-matching files cost no syscalls. On POSIX the directories are read with
+// readdir and subdirectories are opened with openat. Subtrees excluded by the path filter are not
+// entered.
+class DirScanner {
+   public:
+    // `on_files` and `on_done` are called from the scanner threads. `on_done` is called after the
+    // last `on_files` of a scan that wasn't stopped.
+    using OnFilesFn = std::function<void(std::vector<FoundFile>)>;
+    using OnDoneFn = std::function<void()>;
+
+    // `filter` may be nullptr.
+    DirScanner(int num_threads,
+               std::shared_ptr<PathFilter> filter,
+               OnFilesFn on_files,
+               OnDoneFn on_done = {});
+    ~DirScanner();
+    DirScanner(const DirScanner&) = delete;
+    DirScanner& operator=(const DirScanner&) = delete;
+
+    // Starts scanning in the background. Returns false if the previous scan is still running.
+    bool start(const std::vector<std::filesystem::path>& roots,
+               const std::set<std::filesystem::path>& extensions);
+    bool is_running() const;
+    // Abandons the current scan, returns when the threads have stopped.
+    void stop();
+
+   private:
+    void worker();
+    void scan_dir(const std::filesystem::path& dir, std::vector<FoundFile>& batch);
+#ifndef _WIN32
+    void scan_dir_fd(int fd, const std::string& dir, std::vector<FoundFile>& batch);
+#endif
+    // Takes the path of a file with a matching name.
+    void add_file(std::filesystem::path path, bool is_symlink, std::vector<FoundFile>& batch);
+    void flush(std::vector<FoundFile>& batch);
+    bool has_extension(std::basic_string_view<std::filesystem::path::value_type> filename) const;
+    // Whether a subdirectory should be put on the shared stack for other threads, instead of being
+    // scanned by the current one.
+    bool should_share();
+    void share(std::filesystem::path dir);
+    void join();
+
+    const int num_threads;
+    const std::shared_ptr<PathFilter> filter;
+    const OnFilesFn on_files;
+    const OnDoneFn on_done;
+
+    std::set<std::filesystem::path::string_type, std::less<>> extensions;
+    std::vector<std::thread> threads;
+    std::atomic<int> num_running_threads = 0;
+    std::atomic<bool> stop_flag = false;
+    std::atomic<size_t> num_files_found = 0;
+    std::chrono::steady_clock::time_point started_at;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::filesystem::path> dirs;  // Waiting to be scanned.
+    int num_busy_threads = 0;                 // Scanning a directory taken from `dirs`.
+};
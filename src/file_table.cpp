@@ -0,0 +1,138 @@
+#include "file_table.h"
+
+#include "util.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace fs = std::filesystem;
+
+namespace {
+constexpr size_t k_min_slots = 1024;
+}  // namespace
+
+FileId FileTable::intern(const fs::path& path) {
+    auto parent_path = path.parent_path();
+    if (!path.has_filename() || parent_path == path) {
+        FileId id = k_no_node;
+        for (auto& c : path) {
+            if (!c.empty()) {
+                id = intern_child(id, c.native());
+            }
+        }
+        return id;
+    }
+    if (last_parent == k_no_node || parent_path.native() != last_parent_path) {
+        FileId id = k_no_node;
+        for (auto& c : parent_path) {
+            if (!c.empty()) {
+                id = intern_child(id, c.native());
+            }
+        }
+        last_parent = id;
+        last_parent_path = parent_path.native();
+    }
+    return intern_child(last_parent, path.filename().native());
+}
+
+std::optional<FileId> FileTable::find(const fs::path& path) const {
+    FileId id = k_no_node;
+    for (auto& c : path) {
+        if (c.empty()) {
+            continue;
+        }
+        auto child = find_child(id, c.native());
+        if (!child) {
+            return std::nullopt;
+        }
+        id = *child;
+    }
+    if (id == k_no_node) {
+        return std::nullopt;
+    }
+    return id;
+}
+
+fs::path FileTable::path(FileId id) const {
+    std::vector<FileId> ids;
+    for (; id != k_no_node; id = parents[id]) {
+        ids.push_back(id);
+    }
+    fs::path result;
+    for (auto it = ids.rbegin(); it != ids.rend(); ++it) {
+        result /= name(*it);
+    }
+    return result;
+}
+
+bool FileTable::is_inside(FileId id, FileId dir) const {
+    for (; id != k_no_node; id = parents[id]) {
+        if (id == dir) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void FileTable::set_status(FileId id, FileStatus status, fs::file_time_type time) {
+    --counts[size_t(statuses[id])];
+    ++counts[size_t(status)];
+    statuses[id] = status;
+    times[id] = time;
+}
+
+uint64_t FileTable::hash_of(FileId parent, NameView name) const {
+    return hash64(std::string_view(reinterpret_cast<const char*>(name.data()),
+                                   name.size() * sizeof(Char)),
+                  parent);
+}
+
+size_t FileTable::find_slot(FileId parent, NameView name) const {
+    const auto mask = slots.size() - 1;
+    for (auto i = size_t(hash_of(parent, name)) & mask;; i = (i + 1) & mask) {
+        const auto id = slots[i];
+        if (id == k_no_node || (parents[id] == parent && this->name(id) == name)) {
+            return i;
+        }
+    }
+}
+
+std::optional<FileId> FileTable::find_child(FileId parent, NameView name) const {
+    if (slots.empty()) {
+        return std::nullopt;
+    }
+    const auto id = slots[find_slot(parent, name)];
+    if (id == k_no_node) {
+        return std::nullopt;
+    }
+    return id;
+}
+
+FileId FileTable::intern_child(FileId parent, NameView name) {
+    // Load factor at most 1/2.
+    if ((parents.size() + 1) * 2 > slots.size()) {
+        rehash(std::max(k_min_slots, slots.size() * 2));
+    }
+    const auto slot = find_slot(parent, name);
+    if (slots[slot] != k_no_node) {
+        return slots[slot];
+    }
+    assert(names.size() + name.size() <= UINT32_MAX && name.size() <= UINT16_MAX);
+    const auto id = FileId(parents.size());
+    parents.push_back(parent);
+    name_offsets.push_back(uint32_t(names.size()));
+    name_sizes.push_back(uint16_t(name.size()));
+    names.append(name);
+    statuses.push_back(FileStatus::Untracked);
+    times.emplace_back();
+    ++counts[size_t(FileStatus::Untracked)];
+    slots[slot] = id;
+    return id;
+}
+
+void FileTable::rehash(size_t num_slots) {
+    slots.assign(num_slots, k_no_node);
+    for (FileId id = 0; id < parents.size(); ++id) {
+        slots[find_slot(parents[id], name(id))] = id;
+    }
+}
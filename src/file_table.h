@@ -0,0 +1,80 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Dense index of a path in the `FileTable`.
+using FileId = uint32_t;
+
+enum class FileStatus : uint8_t {
+    Untracked,        // Never checked, removed, or a directory.
+    Formatted,        // Formatted at `time`.
+    NeedsFormatting,  // Unformatted since `time`.
+};
+
+// Interns paths as the nodes of a directory tree: each node stores its parent's ID and its name as
+// a slice of a shared arena, so a million files in a few thousand directories cost little more
+// than their file names. IDs are dense and stable, the per-file status and time are kept in arrays
+// indexed by them. Nodes are never removed. Not thread-safe, owned by the app thread.
+class FileTable {
+   public:
+    // Returns the ID of the absolute `path`, adding it and its ancestors if new.
+    FileId intern(const std::filesystem::path& path);
+    std::optional<FileId> find(const std::filesystem::path& path) const;
+    std::filesystem::path path(FileId id) const;
+    // Whether `id` is `dir` or is below it.
+    bool is_inside(FileId id, FileId dir) const;
+    // Number of nodes, all IDs are less than this.
+    size_t size() const {
+        return parents.size();
+    }
+
+    FileStatus status(FileId id) const {
+        return statuses[id];
+    }
+    // Of `Formatted` and `NeedsFormatting` files.
+    std::filesystem::file_time_type time(FileId id) const {
+        return times[id];
+    }
+    void set_status(FileId id, FileStatus status, std::filesystem::file_time_type time = {});
+    // Number of files with `status`.
+    size_t count(FileStatus status) const {
+        return counts[size_t(status)];
+    }
+
+   private:
+    using Char = std::filesystem::path::value_type;
+    using NameView = std::basic_string_view<Char>;
+    static constexpr FileId k_no_node = UINT32_MAX;
+
+    NameView name(FileId id) const {
+        return NameView(names).substr(name_offsets[id], name_sizes[id]);
+    }
+    uint64_t hash_of(FileId parent, NameView name) const;
+    // Index of the slot of the child or of the empty slot where it would be inserted.
+    size_t find_slot(FileId parent, NameView name) const;
+    std::optional<FileId> find_child(FileId parent, NameView name) const;
+    FileId intern_child(FileId parent, NameView name);
+    void rehash(size_t num_slots);
+
+    // Node data, indexed by ID. The root name and directory are nodes, too.
+    std::vector<FileId> parents;  // k_no_node for the first component.
+    std::vector<uint32_t> name_offsets;
+    std::vector<uint16_t> name_sizes;
+    std::basic_string<Char> names;
+    std::vector<FileStatus> statuses;
+    std::vector<std::filesystem::file_time_type> times;
+    std::array<size_t, 3> counts = {};
+
+    // Open addressing hash table of node IDs by (parent, name), power of two size.
+    std::vector<FileId> slots;
+
+    // Files come in batches from the same directory.
+    std::filesystem::path::string_type last_parent_path;
+    FileId last_parent = k_no_node;
+};
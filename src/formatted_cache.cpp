@@ -0,0 +1,54 @@
+#include "formatted_cache.h"
+
+#include "util.h"
+
+FormattedCache::FormattedCache(size_t max_total_bytes)
+    : max_total_bytes(max_total_bytes) {}
+
+void FormattedCache::put(const std::filesystem::path& path,
+                         std::string_view input,
+                         std::string formatted) {
+    if (formatted.size() > max_total_bytes) {
+        return;
+    }
+    const auto input_hash = hash64(input);
+    std::lock_guard lock(mutex);
+    if (auto it = index.find(path); it != index.end()) {
+        erase_locked(it->second);
+    }
+    while (!lru.empty() && total_bytes + formatted.size() > max_total_bytes) {
+        erase_locked(std::prev(lru.end()));
+    }
+    total_bytes += formatted.size();
+    lru.push_front(Entry{path, input.size(), input_hash, std::move(formatted)});
+    index.emplace(path, lru.begin());
+}
+
+std::optional<std::string> FormattedCache::take(const std::filesystem::path& path,
+                                                std::string_view input) {
+    const auto input_hash = hash64(input);
+    std::lock_guard lock(mutex);
+    auto it = index.find(path);
+    if (it == index.end()) {
+        return std::nullopt;
+    }
+    std::optional<std::string> result;
+    if (it->second->input_size == input.size() && it->second->input_hash == input_hash) {
+        result = std::move(it->second->formatted);
+    }
+    erase_locked(it->second);
+    return result;
+}
+
+void FormattedCache::erase(const std::filesystem::path& path) {
+    std::lock_guard lock(mutex);
+    if (auto it = index.find(path); it != index.end()) {
+        erase_locked(it->second);
+    }
+}
+
+void FormattedCache::erase_locked(List::iterator it) {
+    total_bytes -= it->formatted.size();
+    index.erase(it->path);
+    lru.erase(it);
+}
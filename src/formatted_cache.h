@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Thread-safe, size-bounded LRU cache of clang-format outputs keyed by path and the size and hash
+// of the content formatted. Lets a format request reuse the output of a preceding check instead of
+// running clang-format again. The content is compared rather than the last write time: two saves
+// within the file system's timestamp resolution would leave the same time.
+class FormattedCache {
+   public:
+    explicit FormattedCache(size_t max_total_bytes);
+
+    void put(const std::filesystem::path& path, std::string_view input, std::string formatted);
+    // Removes and returns the entry if it was made from `input`, the file's current content.
+    std::optional<std::string> take(const std::filesystem::path& path, std::string_view input);
+    void erase(const std::filesystem::path& path);
+
+   private:
+    struct Entry {
+        std::filesystem::path path;
+        size_t input_size;
+        uint64_t input_hash;
+        std::string formatted;
+    };
+    using List = std::list<Entry>;
+
+    void erase_locked(List::iterator it);
+
+    const size_t max_total_bytes;
+    size_t total_bytes = 0;
+    std::mutex mutex;
+    List lru;  // Most recent at front.
+    std::unordered_map<std::filesystem::path, List::iterator> index;
+};
@@ -0,0 +1,158 @@
+#include "git_status.h"
+
+#include "util.h"
+
+#include <fmt/format.h>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/process.hpp>
+#include <boost/process/filesystem.hpp>
+
+#include <charconv>
+#include <future>
+#include <string_view>
+
+namespace bp = boost::process;
+namespace fs = std::filesystem;
+
+namespace {
+// Runs `git -C dir args...` with `input` on stdin, returns its stdout.
+std::optional<std::string> RunGit(const fs::path& dir,
+                                  std::vector<std::string> args,
+                                  const std::string& input = {}) {
+    auto git = bp::search_path("git");
+    if (git.native().empty()) {
+        fmt::print(stderr, "git not found on PATH.\n");
+        return std::nullopt;
+    }
+    const auto command = fmt::format("git {}", fmt::join(args, " "));
+    args.insert(args.begin(), {"-C", dir.string()});
+    std::error_code ec;
+    boost::asio::io_context ioc;
+    std::future<std::string> out, err;
+    // Written and read asynchronously, git would block on a full pipe either way.
+    bp::child c(git,
+                bp::args(args),
+                bp::std_in < boost::asio::buffer(input),
+                bp::std_out > out,
+                bp::std_err > err,
+                ioc,
+                ec);
+    if (ec) {
+        fmt::print(stderr, "Can't run git: {}\n", ec.message());
+        return std::nullopt;
+    }
+    ioc.run();
+    c.wait(ec);
+    if (ec || c.exit_code() != EXIT_SUCCESS) {
+        fmt::print(stderr, "`{}` failed in {}: {}\n", command, ToUtf8(dir), trim(err.get()));
+        return std::nullopt;
+    }
+    return out.get();
+}
+
+// The fields of the output of a git command with -z.
+std::vector<std::string_view> SplitNul(std::string_view s) {
+    std::vector<std::string_view> result;
+    while (!s.empty()) {
+        const auto end = std::min(s.find('\0'), s.size());
+        result.push_back(s.substr(0, end));
+        s.remove_prefix(std::min(end + 1, s.size()));
+    }
+    return result;
+}
+
+// The paths of the porcelain and --name-only outputs are relative to it.
+std::optional<fs::path> GitTopLevel(const fs::path& dir) {
+    auto out = RunGit(dir, {"rev-parse", "--show-toplevel"});
+    if (!out || trim(*out).empty()) {
+        return std::nullopt;
+    }
+    return PathFromUtf8(trim(*out));
+}
+}  // namespace
+
+std::optional<std::vector<fs::path>> GitChangedFiles(const fs::path& dir) {
+    auto top = GitTopLevel(dir);
+    if (!top) {
+        return std::nullopt;
+    }
+    auto out = RunGit(dir, {"status", "--porcelain=v1", "-z", "--untracked-files=all", "--", "."});
+    if (!out) {
+        return std::nullopt;
+    }
+    // Entries are `XY PATH`, X the index and Y the work tree status. Renames and copies are
+    // followed by the original path.
+    std::vector<fs::path> result;
+    const auto fields = SplitNul(*out);
+    for (size_t i = 0; i < fields.size(); ++i) {
+        const auto entry = fields[i];
+        if (entry.size() < 4) {
+            continue;
+        }
+        const char x = entry[0];
+        const char y = entry[1];
+        if (x == 'R' || x == 'C') {
+            ++i;
+        }
+        if (x == 'D' || y == 'D') {
+            continue;
+        }
+        result.push_back(*top / PathFromUtf8(entry.substr(3)));
+    }
+    return result;
+}
+
+std::optional<std::vector<StagedFile>> GitStagedFiles(const fs::path& dir) {
+    auto top = GitTopLevel(dir);
+    if (!top) {
+        return std::nullopt;
+    }
+    auto names = RunGit(
+        dir, {"diff", "--cached", "--name-only", "-z", "--diff-filter=ACMR", "--", "."});
+    if (!names) {
+        return std::nullopt;
+    }
+    std::vector<std::string_view> paths;
+    std::string requests;
+    for (auto p : SplitNul(*names)) {
+        // Can't be requested from cat-file.
+        if (p.empty() || p.find('\n') != std::string_view::npos) {
+            continue;
+        }
+        paths.push_back(p);
+        requests += fmt::format(":{}\n", p);
+    }
+    if (paths.empty()) {
+        return std::vector<StagedFile>{};
+    }
+    // All blobs in one process: each is `<oid> blob <size>\n<content>\n`, or `<name> missing\n`.
+    auto out = RunGit(*top, {"cat-file", "--batch"}, requests);
+    if (!out) {
+        return std::nullopt;
+    }
+    std::vector<StagedFile> result;
+    std::string_view rest = *out;
+    for (auto p : paths) {
+        const auto header_end = rest.find('\n');
+        if (header_end == std::string_view::npos) {
+            break;
+        }
+        const auto header = rest.substr(0, header_end);
+        rest.remove_prefix(header_end + 1);
+        if (header.ends_with(" missing")) {
+            continue;
+        }
+        const auto size_text = header.substr(header.rfind(' ') + 1);
+        size_t size = 0;
+        auto fcr = std::from_chars(size_text.data(), size_text.data() + size_text.size(), size);
+        if (fcr.ec != std::errc() || size + 1 > rest.size()) {
+            fmt::print(stderr, "Unexpected output of `git cat-file`: {}\n", header);
+            return std::nullopt;
+        }
+        result.push_back(StagedFile{.path = *top / PathFromUtf8(p),
+                                    .content = std::string(rest.substr(0, size))});
+        rest.remove_prefix(size + 1);
+    }
+    return result;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Queries git (the executable found on PATH) about the work tree containing `dir`. The results are
+// limited to `dir` and its subdirectories, the paths are absolute. nullopt if `dir` isn't in a git
+// work tree or git failed, the reason printed on stderr.
+
+// The files differing from HEAD: modified or added in the index or the work tree, and the untracked
+// files not ignored by git. Deleted files are left out. Uses git's index and untracked caches, so
+// it costs a fraction of walking the tree.
+std::optional<std::vector<std::filesystem::path>> GitChangedFiles(const std::filesystem::path& dir);
+
+struct StagedFile {
+    std::filesystem::path path;
+    std::string content;  // Of the index, not of the work tree.
+};
+
+// The files added, copied, modified or renamed in the index relative to HEAD, with their staged
+// content.
+std::optional<std::vector<StagedFile>> GitStagedFiles(const std::filesystem::path& dir);
@@ -0,0 +1,429 @@
+#include "ipc.h"
+
+#include "util.h"
+
+#include <fmt/format.h>
+
+#if !defined(_WIN32)
+#    include <unistd.h>
+#endif
+
+#include <charconv>
+#include <cstdlib>
+
+namespace fs = std::filesystem;
+
+namespace {
+// Recursive descent over a single line, nesting is only followed to skip values.
+class JsonReader {
+   public:
+    explicit JsonReader(std::string_view s)
+        : s(s) {}
+
+    std::optional<FlatJsonObject> read_object() {
+        FlatJsonObject result;
+        skip_ws();
+        if (!consume('{')) {
+            return std::nullopt;
+        }
+        skip_ws();
+        if (consume('}')) {
+            return at_end() ? std::optional(std::move(result)) : std::nullopt;
+        }
+        for (;;) {
+            skip_ws();
+            auto key = read_string();
+            skip_ws();
+            if (!key || !consume(':')) {
+                return std::nullopt;
+            }
+            skip_ws();
+            if (!read_member(*key, result)) {
+                return std::nullopt;
+            }
+            skip_ws();
+            if (consume('}')) {
+                return at_end() ? std::optional(std::move(result)) : std::nullopt;
+            }
+            if (!consume(',')) {
+                return std::nullopt;
+            }
+        }
+    }
+
+   private:
+    static constexpr int k_max_depth = 32;
+
+    bool at_end() {
+        skip_ws();
+        return pos == s.size();
+    }
+
+    void skip_ws() {
+        while (pos < s.size() && is_space(s[pos])) {
+            ++pos;
+        }
+    }
+
+    static bool is_space(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    bool consume(char c) {
+        if (pos < s.size() && s[pos] == c) {
+            ++pos;
+            return true;
+        }
+        return false;
+    }
+
+    bool consume(std::string_view word) {
+        if (s.substr(pos).starts_with(word)) {
+            pos += word.size();
+            return true;
+        }
+        return false;
+    }
+
+    bool read_member(const std::string& key, FlatJsonObject& out) {
+        if (pos >= s.size()) {
+            return false;
+        }
+        const char c = s[pos];
+        if (c == '"') {
+            auto value = read_string();
+            if (!value) {
+                return false;
+            }
+            out.strings[key] = std::move(*value);
+            return true;
+        }
+        if (c == 't' || c == 'f') {
+            const bool value = c == 't';
+            if (!consume(value ? "true" : "false")) {
+                return false;
+            }
+            out.booleans[key] = value;
+            return true;
+        }
+        if (c == '-' || (c >= '0' && c <= '9')) {
+            const auto start = pos;
+            if (!skip_number()) {
+                return false;
+            }
+            // Fractions are skipped.
+            const auto number = s.substr(start, pos - start);
+            int64_t value = 0;
+            auto fcr = std::from_chars(number.data(), number.data() + number.size(), value);
+            if (fcr.ec == std::errc() && fcr.ptr == number.data() + number.size()) {
+                out.integers[key] = value;
+            }
+            return true;
+        }
+        if (c == '[') {
+            // An array of strings, or skipped.
+            const auto start = pos;
+            std::vector<std::string> values;
+            ++pos;
+            skip_ws();
+            if (consume(']')) {
+                out.string_arrays[key] = std::move(values);
+                return true;
+            }
+            for (;;) {
+                skip_ws();
+                if (pos >= s.size() || s[pos] != '"') {
+                    pos = start;
+                    return skip_value(0);
+                }
+                auto value = read_string();
+                if (!value) {
+                    return false;
+                }
+                values.push_back(std::move(*value));
+                skip_ws();
+                if (consume(']')) {
+                    out.string_arrays[key] = std::move(values);
+                    return true;
+                }
+                if (!consume(',')) {
+                    return false;
+                }
+            }
+        }
+        return skip_value(0);
+    }
+
+    bool skip_number() {
+        consume('-');
+        const auto start = pos;
+        while (pos < s.size() && ((s[pos] >= '0' && s[pos] <= '9') || s[pos] == '.' || s[pos] == 'e'
+                                  || s[pos] == 'E' || s[pos] == '+' || s[pos] == '-')) {
+            ++pos;
+        }
+        return pos > start;
+    }
+
+    bool skip_value(int depth) {
+        if (depth > k_max_depth || pos >= s.size()) {
+            return false;
+        }
+        const char c = s[pos];
+        if (c == '"') {
+            return read_string().has_value();
+        }
+        if (c == '{' || c == '[') {
+            const char close = c == '{' ? '}' : ']';
+            ++pos;
+            skip_ws();
+            if (consume(close)) {
+                return true;
+            }
+            for (;;) {
+                skip_ws();
+                if (c == '{') {
+                    if (!read_string()) {
+                        return false;
+                    }
+                    skip_ws();
+                    if (!consume(':')) {
+                        return false;
+                    }
+                    skip_ws();
+                }
+                if (!skip_value(depth + 1)) {
+                    return false;
+                }
+                skip_ws();
+                if (consume(close)) {
+                    return true;
+                }
+                if (!consume(',')) {
+                    return false;
+                }
+            }
+        }
+        if (c == '-' || (c >= '0' && c <= '9')) {
+            return skip_number();
+        }
+        return consume("true") || consume("false") || consume("null");
+    }
+
+    std::optional<unsigned> read_hex4() {
+        if (pos + 4 > s.size()) {
+            return std::nullopt;
+        }
+        unsigned value = 0;
+        for (int i = 0; i < 4; ++i) {
+            const char c = s[pos++];
+            value <<= 4;
+            if (c >= '0' && c <= '9') {
+                value |= unsigned(c - '0');
+            } else if (c >= 'a' && c <= 'f') {
+                value |= unsigned(c - 'a' + 10);
+            } else if (c >= 'A' && c <= 'F') {
+                value |= unsigned(c - 'A' + 10);
+            } else {
+                return std::nullopt;
+            }
+        }
+        return value;
+    }
+
+    static void append_utf8(std::string& out, unsigned cp) {
+        if (cp < 0x80) {
+            out += char(cp);
+        } else if (cp < 0x800) {
+            out += char(0xc0 | (cp >> 6));
+            out += char(0x80 | (cp & 0x3f));
+        } else if (cp < 0x10000) {
+            out += char(0xe0 | (cp >> 12));
+            out += char(0x80 | ((cp >> 6) & 0x3f));
+            out += char(0x80 | (cp & 0x3f));
+        } else {
+            out += char(0xf0 | (cp >> 18));
+            out += char(0x80 | ((cp >> 12) & 0x3f));
+            out += char(0x80 | ((cp >> 6) & 0x3f));
+            out += char(0x80 | (cp & 0x3f));
+        }
+    }
+
+    std::optional<std::string> read_string() {
+        if (!consume('"')) {
+            return std::nullopt;
+        }
+        std::string result;
+        while (pos < s.size()) {
+            const char c = s[pos++];
+            if (c == '"') {
+                return result;
+            }
+            if (c != '\\') {
+                result += c;
+                continue;
+            }
+            if (pos >= s.size()) {
+                return std::nullopt;
+            }
+            switch (s[pos++]) {
+                case '"':
+                    result += '"';
+                    break;
+                case '\\':
+                    result += '\\';
+                    break;
+                case '/':
+                    result += '/';
+                    break;
+                case 'b':
+                    result += '\b';
+                    break;
+                case 'f':
+                    result += '\f';
+                    break;
+                case 'n':
+                    result += '\n';
+                    break;
+                case 'r':
+                    result += '\r';
+                    break;
+                case 't':
+                    result += '\t';
+                    break;
+                case 'u': {
+                    auto cp = read_hex4();
+                    if (!cp) {
+                        return std::nullopt;
+                    }
+                    // A surrogate pair.
+                    if (*cp >= 0xd800 && *cp < 0xdc00 && consume("\\u")) {
+                        auto low = read_hex4();
+                        if (!low || *low < 0xdc00 || *low >= 0xe000) {
+                            return std::nullopt;
+                        }
+                        *cp = 0x10000 + ((*cp - 0xd800) << 10) + (*low - 0xdc00);
+                    }
+                    append_utf8(result, *cp);
+                    break;
+                }
+                default:
+                    return std::nullopt;
+            }
+        }
+        return std::nullopt;
+    }
+
+    std::string_view s;
+    size_t pos = 0;
+};
+}  // namespace
+
+std::optional<FlatJsonObject> ParseFlatJsonObject(std::string_view s) {
+    return JsonReader(s).read_object();
+}
+
+std::optional<IpcRequest> ParseIpcRequest(std::string_view line, std::string& error) {
+    auto object = ParseFlatJsonObject(line);
+    if (!object) {
+        error = "Invalid JSON object";
+        return std::nullopt;
+    }
+    IpcRequest request;
+    if (auto it = object->integers.find("id"); it != object->integers.end()) {
+        request.id = uint64_t(it->second);
+    }
+    auto cmd = object->strings.find("cmd");
+    if (cmd == object->strings.end()) {
+        error = "Missing \"cmd\"";
+        return std::nullopt;
+    }
+    request.cmd = std::move(cmd->second);
+    if (auto it = object->string_arrays.find("paths"); it != object->string_arrays.end()) {
+        request.paths = std::move(it->second);
+    }
+    if (auto it = object->booleans.find("wait"); it != object->booleans.end()) {
+        request.wait = it->second;
+    }
+    if (auto it = object->strings.find("path"); it != object->strings.end()) {
+        request.path = std::move(it->second);
+    }
+    if (auto it = object->strings.find("content"); it != object->strings.end()) {
+        request.content = std::move(it->second);
+    }
+    if (auto it = object->string_arrays.find("lines"); it != object->string_arrays.end()) {
+        for (auto& l : it->second) {
+            auto range = ParseLineRange(l);
+            if (!range) {
+                error = fmt::format("Invalid line range: {}", l);
+                return std::nullopt;
+            }
+            request.lines.push_back(*range);
+        }
+    }
+    return request;
+}
+
+std::optional<LineRange> ParseLineRange(std::string_view s) {
+    LineRange r = {};
+    const auto* end = s.data() + s.size();
+    auto fcr = std::from_chars(s.data(), end, r.first);
+    if (fcr.ec != std::errc() || fcr.ptr == end || *fcr.ptr != ':') {
+        return std::nullopt;
+    }
+    fcr = std::from_chars(fcr.ptr + 1, end, r.last);
+    if (fcr.ec != std::errc() || fcr.ptr != end || r.first < 1 || r.last < r.first) {
+        return std::nullopt;
+    }
+    return r;
+}
+
+std::string IpcRequestToJson(const IpcRequest& request) {
+    std::string r = fmt::format("{{\"id\":{},\"cmd\":{}", request.id, json_quote(request.cmd));
+    if (!request.paths.empty()) {
+        r += ",\"paths\":[";
+        for (size_t i = 0; i < request.paths.size(); ++i) {
+            r += i == 0 ? "" : ",";
+            r += json_quote(request.paths[i]);
+        }
+        r += "]";
+    }
+    if (!request.wait) {
+        r += ",\"wait\":false";
+    }
+    if (!request.path.empty()) {
+        r += fmt::format(",\"path\":{}", json_quote(request.path));
+    }
+    if (request.cmd == "format_buffer") {
+        r += fmt::format(",\"content\":{}", json_quote(request.content));
+    }
+    if (!request.lines.empty()) {
+        r += ",\"lines\":[";
+        for (size_t i = 0; i < request.lines.size(); ++i) {
+            r += fmt::format(
+                "{}\"{}:{}\"", i == 0 ? "" : ",", request.lines[i].first, request.lines[i].last);
+        }
+        r += "]";
+    }
+    r += "}\n";
+    return r;
+}
+
+std::string IpcErrorJson(uint64_t id, std::string_view error) {
+    return fmt::format("{{\"id\":{},\"ok\":false,\"error\":{}}}\n", id, json_quote(error));
+}
+
+fs::path DefaultIpcSocketPath() {
+    if (const char* runtime_dir = std::getenv("XDG_RUNTIME_DIR"); runtime_dir && *runtime_dir) {
+        return PathFromUtf8(runtime_dir) / "claford.sock";
+    }
+    std::error_code ec;
+    auto dir = fs::temp_directory_path(ec);
+    if (ec) {
+        dir = "/tmp";
+    }
+#if defined(_WIN32)
+    return dir / "claford.sock";
+#else
+    return dir / fmt::format("claford-{}.sock", getuid());
+#endif
+}
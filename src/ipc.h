@@ -0,0 +1,64 @@
+#pragma once
+
+#include "clang_format.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The local API: JSON lines over a Unix domain socket, one object per line in both directions.
+//
+// Requests: {"id":N,"cmd":CMD,...}, the response echoes "id" and has "ok":
+//   "status", "paths":[...]: {"id":N,"ok":all formatted,"files":[FILE...]}, a file changed since
+//       its last check is "unformatted"
+//   "unformatted": {"id":N,"ok":true,"files":[FILE...]}, the tracked files needing formatting
+//   "format", "paths":[...], "wait":true|false (default true): formats the files at interactive
+//       priority. Waiting, the response comes when all of them were formatted:
+//       {"id":N,"ok":all succeeded,"files":[{"path":P,"ok":B}...]}, otherwise right away, with
+//       "ok" meaning queued. Only files with a watched extension in the watched directories.
+//   "subscribe": {"id":N,"ok":true}, then {"event":"status",FILE fields} on every status change
+//   "format_buffer", "path":P, "content":C, "lines":["FIRST:LAST"...] (optional): formats C as
+//       if it were the file P, which needn't exist, only the lines given. Nothing is written.
+//       {"id":N,"ok":true,"content":FORMATTED}
+// where FILE is {"path":P,"status":"formatted"|"unformatted"|"untracked","time_ms":T}, T being the
+// Unix time of the version the status is about. Errors are {"id":N,"ok":false,"error":MSG}.
+// Paths are absolute UTF-8. A client may shut down its writing side after the requests, the
+// server closes the connection once they are answered.
+
+using IpcClientId = uint64_t;
+
+struct IpcRequest {
+    uint64_t id = 0;
+    std::string cmd;
+    std::vector<std::string> paths;
+    bool wait = true;
+    // format_buffer
+    std::string path;
+    std::string content;
+    std::vector<LineRange> lines;
+};
+
+// The members of a JSON object that are strings, integers, booleans or arrays of strings; the
+// others are skipped.
+struct FlatJsonObject {
+    std::map<std::string, std::string, std::less<>> strings;
+    std::map<std::string, int64_t, std::less<>> integers;
+    std::map<std::string, bool, std::less<>> booleans;
+    std::map<std::string, std::vector<std::string>, std::less<>> string_arrays;
+};
+
+// nullopt if `s` is not a JSON object.
+std::optional<FlatJsonObject> ParseFlatJsonObject(std::string_view s);
+// nullopt with `error` set if `line` is not a valid request.
+std::optional<IpcRequest> ParseIpcRequest(std::string_view line, std::string& error);
+std::string IpcRequestToJson(const IpcRequest& request);
+std::string IpcErrorJson(uint64_t id, std::string_view error);
+// "FIRST:LAST", 1-based, inclusive, like clang-format's --lines.
+std::optional<LineRange> ParseLineRange(std::string_view s);
+
+// $XDG_RUNTIME_DIR/claford.sock, or claford-<uid>.sock in the temp directory.
+std::filesystem::path DefaultIpcSocketPath();
@@ -0,0 +1,110 @@
+#include "ipc_client.h"
+
+#if !defined(_WIN32)
+
+#    include "util.h"
+
+#    include <fmt/format.h>
+
+#    include <sys/socket.h>
+#    include <sys/un.h>
+#    include <unistd.h>
+
+#    include <cerrno>
+#    include <cstring>
+
+namespace fs = std::filesystem;
+
+namespace {
+#    if defined(MSG_NOSIGNAL)
+constexpr int k_send_flags = MSG_NOSIGNAL;
+#    else
+constexpr int k_send_flags = 0;
+#    endif
+}  // namespace
+
+std::unique_ptr<IpcClient> IpcClient::connect(const fs::path& socket_path, std::string& error) {
+    const auto path = ToUtf8(socket_path);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        error = fmt::format("Socket path too long: {}", path);
+        return nullptr;
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        error = fmt::format("Can't create socket: {}", strerror(errno));
+        return nullptr;
+    }
+#    if defined(SO_NOSIGPIPE)
+    const int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#    endif
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        error = fmt::format("Can't connect to {}: {}", path, strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+    return std::unique_ptr<IpcClient>(new IpcClient(fd));
+}
+
+IpcClient::~IpcClient() {
+    close(fd);
+}
+
+bool IpcClient::send(const IpcRequest& request) {
+    const auto line = IpcRequestToJson(request);
+    for (size_t sent = 0; sent < line.size();) {
+        const auto n = ::send(fd, line.data() + sent, line.size() - sent, k_send_flags);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        sent += size_t(n);
+    }
+    return true;
+}
+
+std::optional<std::string> IpcClient::read_line() {
+    for (;;) {
+        if (auto end = buffer.find('\n'); end != std::string::npos) {
+            auto line = buffer.substr(0, end);
+            buffer.erase(0, end + 1);
+            return line;
+        }
+        char chunk[4096];
+        const auto n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return std::nullopt;
+        }
+        buffer.append(chunk, size_t(n));
+    }
+}
+
+std::optional<std::string> IpcClient::request(IpcRequest request) {
+    request.id = ++last_id;
+    if (!send(request)) {
+        return std::nullopt;
+    }
+    while (auto line = read_line()) {
+        auto object = ParseFlatJsonObject(*line);
+        if (!object) {
+            continue;
+        }
+        // Events have no ID, the errors of unparsable requests have 0.
+        auto id = object->integers.find("id");
+        if (id != object->integers.end()
+            && (uint64_t(id->second) == request.id || id->second == 0)) {
+            return line;
+        }
+    }
+    return std::nullopt;
+}
+
+#endif
@@ -0,0 +1,36 @@
+#pragma once
+
+#if !defined(_WIN32)
+
+#    include "ipc.h"
+
+#    include <cstdint>
+#    include <filesystem>
+#    include <memory>
+#    include <optional>
+#    include <string>
+
+// A blocking connection to the local API of a running claford, see ipc.h.
+class IpcClient {
+   public:
+    // nullptr with `error` set if nothing is listening on `socket_path`.
+    static std::unique_ptr<IpcClient> connect(const std::filesystem::path& socket_path,
+                                              std::string& error);
+    ~IpcClient();
+
+    bool send(const IpcRequest& request);
+    // The next response or event line, without the newline. nullopt if the connection was closed.
+    std::optional<std::string> read_line();
+    // Sends `request` with a new ID and returns its response, skipping events.
+    std::optional<std::string> request(IpcRequest request);
+
+   private:
+    explicit IpcClient(int fd)
+        : fd(fd) {}
+
+    int fd;
+    std::string buffer;
+    uint64_t last_id = 0;
+};
+
+#endif
@@ -0,0 +1,277 @@
+#include "ipc_server.h"
+
+#if !defined(_WIN32)
+
+#    include "util.h"
+
+#    include <fmt/format.h>
+
+#    include <fcntl.h>
+#    include <poll.h>
+#    include <sys/socket.h>
+#    include <sys/stat.h>
+#    include <sys/un.h>
+#    include <unistd.h>
+
+#    include <algorithm>
+#    include <cerrno>
+#    include <cstring>
+
+namespace fs = std::filesystem;
+
+namespace {
+constexpr size_t k_read_buffer_size = 64 * 1024;
+// Clients sending longer lines or not reading this much output are disconnected. Large enough for
+// the buffers of format_buffer.
+constexpr size_t k_max_line_size = 64 * 1024 * 1024;
+constexpr size_t k_max_unwritten_size = 64 * 1024 * 1024;
+
+#    if defined(MSG_NOSIGNAL)
+constexpr int k_send_flags = MSG_NOSIGNAL;
+#    else
+constexpr int k_send_flags = 0;  // SO_NOSIGPIPE is set on the sockets instead.
+#    endif
+
+bool SetNonBlockingAndCloseOnExec(int fd) {
+    const int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0
+        && fcntl(fd, F_SETFD, FD_CLOEXEC) == 0;
+}
+}  // namespace
+
+IpcServer::IpcServer(fs::path socket_path, ToAppQueue& to_app_queue)
+    : socket_path(std::move(socket_path))
+    , to_app_queue(to_app_queue) {}
+
+IpcServer::~IpcServer() {
+    stop();
+}
+
+bool IpcServer::start() {
+    const auto path = ToUtf8(socket_path);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        fmt::print(stderr, "Socket path too long: {}\n", path);
+        return false;
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    auto* sa = reinterpret_cast<sockaddr*>(&addr);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 || !SetNonBlockingAndCloseOnExec(listen_fd)) {
+        fmt::print(stderr, "Can't create socket: {}\n", strerror(errno));
+        return false;
+    }
+    // The socket file outlives a crashed instance, but can be connected to only if one is running.
+    if (const int probe_fd = socket(AF_UNIX, SOCK_STREAM, 0); probe_fd >= 0) {
+        const bool in_use = connect(probe_fd, sa, sizeof(addr)) == 0;
+        close(probe_fd);
+        if (in_use) {
+            fmt::print(stderr, "Another claford is listening on {}\n", path);
+            return false;
+        }
+    }
+    unlink(path.c_str());
+    // Only the user can connect.
+    const auto old_umask = umask(0077);
+    const int bind_result = bind(listen_fd, sa, sizeof(addr));
+    umask(old_umask);
+    if (bind_result != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+        fmt::print(stderr, "Can't listen on {}: {}\n", path, strerror(errno));
+        return false;
+    }
+    if (pipe(wake_pipe) != 0 || !SetNonBlockingAndCloseOnExec(wake_pipe[0])
+        || !SetNonBlockingAndCloseOnExec(wake_pipe[1])) {
+        fmt::print(stderr, "Can't create pipe: {}\n", strerror(errno));
+        return false;
+    }
+    thread = std::thread(&IpcServer::run, this);
+    fmt::print(stderr, "Listening on {}\n", path);
+    return true;
+}
+
+void IpcServer::stop() {
+    if (thread.joinable()) {
+        stop_flag = true;
+        wake();
+        thread.join();
+        unlink(ToUtf8(socket_path).c_str());
+    }
+    for (auto& c : clients) {
+        close(c.fd);
+    }
+    clients.clear();
+    std::lock_guard lock(outbox_mutex);
+    for (int* fd : {&listen_fd, &wake_pipe[0], &wake_pipe[1]}) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+void IpcServer::send(IpcClientId client, std::string line) {
+    std::lock_guard lock(outbox_mutex);
+    // Under the lock: `stop` closes the pipe under it too.
+    if (wake_pipe[1] < 0) {
+        return;
+    }
+    outbox.emplace_back(client, std::move(line));
+    wake();
+}
+
+void IpcServer::wake() {
+    const char c = 0;
+    // A full pipe is already signaled.
+    [[maybe_unused]] auto _ = write(wake_pipe[1], &c, 1);
+}
+
+void IpcServer::run() {
+    std::vector<pollfd> fds;
+    std::vector<std::pair<IpcClientId, std::string>> lines;
+    while (!stop_flag) {
+        fds.clear();
+        fds.push_back(pollfd{wake_pipe[0], POLLIN, 0});
+        fds.push_back(pollfd{listen_fd, POLLIN, 0});
+        for (auto& c : clients) {
+            // Still polled after EOF for the hangup.
+            const short in = c.read_closed ? 0 : POLLIN;
+            fds.push_back(pollfd{c.fd, short(c.out.empty() ? in : in | POLLOUT), 0});
+        }
+        if (poll(fds.data(), nfds_t(fds.size()), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fmt::print(stderr, "Local API poll failed: {}\n", strerror(errno));
+            return;
+        }
+        std::vector<bool> closed(clients.size());
+        for (size_t i = 0; i < clients.size(); ++i) {
+            const auto revents = fds[i + 2].revents;
+            if (clients[i].read_closed && (revents & (POLLHUP | POLLERR))) {
+                closed[i] = true;
+            } else if (!clients[i].read_closed && (revents & (POLLIN | POLLHUP | POLLERR))
+                       && !read_from(clients[i])) {
+                closed[i] = true;
+            } else if ((revents & POLLOUT) && !write_to(clients[i])) {
+                closed[i] = true;
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            char buffer[256];
+            while (read(wake_pipe[0], buffer, sizeof(buffer)) > 0) {
+            }
+            {
+                std::lock_guard lock(outbox_mutex);
+                lines.swap(outbox);
+            }
+            for (auto& [id, line] : lines) {
+                auto it = std::find_if(BE(clients), [id](const Client& c) {
+                    return c.id == id;
+                });
+                if (it != clients.end()) {
+                    // Events aren't answers, a subscription doesn't keep a half-closed client.
+                    if (!line.starts_with("{\"event\"") && it->num_unanswered_requests > 0) {
+                        --it->num_unanswered_requests;
+                    }
+                    it->out += line;
+                }
+            }
+            lines.clear();
+            // Written right away, most responses fit in the socket buffer.
+            for (size_t i = 0; i < clients.size(); ++i) {
+                if (!closed[i] && !clients[i].out.empty() && !write_to(clients[i])) {
+                    closed[i] = true;
+                }
+            }
+        }
+        for (size_t i = clients.size(); i-- > 0;) {
+            auto& c = clients[i];
+            if (closed[i]
+                || (c.read_closed && c.num_unanswered_requests == 0 && c.out.empty())) {
+                close(c.fd);
+                to_app_queue.enqueue(msg::IpcClientGone{c.id});
+                clients.erase(clients.begin() + ptrdiff_t(i));
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            for (;;) {
+                const int fd = accept(listen_fd, nullptr, nullptr);
+                if (fd < 0) {
+                    break;
+                }
+                SetNonBlockingAndCloseOnExec(fd);
+#    if defined(SO_NOSIGPIPE)
+                const int on = 1;
+                setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#    endif
+                clients.push_back(Client{.fd = fd, .id = ++last_client_id, .in = {}, .out = {}});
+            }
+        }
+    }
+}
+
+bool IpcServer::read_from(Client& client) {
+    char buffer[k_read_buffer_size];
+    for (;;) {
+        const auto n = read(client.fd, buffer, sizeof(buffer));
+        if (n == 0) {
+            // Half-closed after the requests, for example by `nc -N`, which still wait for the
+            // responses.
+            client.read_closed = true;
+            break;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        client.in.append(buffer, size_t(n));
+    }
+    size_t start = 0;
+    for (size_t end; (end = client.in.find('\n', start)) != std::string::npos; start = end + 1) {
+        parse_request(client, std::string_view(client.in).substr(start, end - start));
+    }
+    client.in.erase(0, start);
+    if (client.read_closed) {
+        // The last line may not be terminated.
+        parse_request(client, client.in);
+        client.in.clear();
+    }
+    return client.in.size() <= k_max_line_size && (client.out.empty() || write_to(client));
+}
+
+void IpcServer::parse_request(Client& client, std::string_view line) {
+    line = trim(line);
+    if (line.empty()) {
+        return;
+    }
+    std::string error;
+    if (auto request = ParseIpcRequest(line, error)) {
+        ++client.num_unanswered_requests;
+        to_app_queue.enqueue(msg::IpcRequestReceived{client.id, std::move(*request)});
+    } else {
+        client.out += IpcErrorJson(0, error);
+    }
+}
+
+bool IpcServer::write_to(Client& client) {
+    while (!client.out.empty()) {
+        const auto n = ::send(client.fd, client.out.data(), client.out.size(), k_send_flags);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN && client.out.size() <= k_max_unwritten_size;
+        }
+        client.out.erase(0, size_t(n));
+    }
+    return true;
+}
+
+#endif
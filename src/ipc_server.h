@@ -0,0 +1,63 @@
+#pragma once
+
+#if !defined(_WIN32)
+
+#    include "ipc.h"
+#    include "state.h"
+
+#    include <atomic>
+#    include <filesystem>
+#    include <mutex>
+#    include <string>
+#    include <string_view>
+#    include <thread>
+#    include <utility>
+#    include <vector>
+
+// Serves the local API (see ipc.h) on a Unix domain socket. The server thread accepts the clients,
+// reads their requests and sends them to the app thread as `msg::IpcRequestReceived`, which
+// answers from its state through `send`. The server thread only moves bytes, so a request costs
+// the app thread no more than a file event.
+class IpcServer {
+   public:
+    IpcServer(std::filesystem::path socket_path, ToAppQueue& to_app_queue);
+    ~IpcServer();
+
+    // Creates the socket, replacing the one left by a dead instance, and starts the thread. Returns
+    // false after printing the error on stderr, if another instance is listening, for example.
+    bool start();
+    void stop();
+    // Thread-safe, queues `line` to be written to `client`. Dropped if the client is gone or the
+    // server is stopped.
+    void send(IpcClientId client, std::string line);
+
+   private:
+    struct Client {
+        int fd;
+        IpcClientId id;
+        std::string in, out;
+        // The client shut down its side, it's closed when the requests it sent are answered.
+        bool read_closed = false;
+        size_t num_unanswered_requests = 0;
+    };
+
+    void run();
+    // False if the client is to be disconnected.
+    bool read_from(Client& client);
+    void parse_request(Client& client, std::string_view line);
+    bool write_to(Client& client);
+    void wake();
+
+    const std::filesystem::path socket_path;
+    ToAppQueue& to_app_queue;
+    int listen_fd = -1;
+    int wake_pipe[2] = {-1, -1};
+    std::atomic<bool> stop_flag = false;
+    std::thread thread;
+    std::vector<Client> clients;  // Server thread only.
+    IpcClientId last_client_id = 0;
+    std::mutex outbox_mutex;
+    std::vector<std::pair<IpcClientId, std::string>> outbox;
+};
+
+#endif
@@ -0,0 +1,75 @@
+#include "job_queue.h"
+
+#include "metrics.h"
+
+namespace chr = std::chrono;
+
+const char* JobPriorityName(JobPriority p) {
+    switch (p) {
+        case JobPriority::Interactive:
+            return "interactive";
+        case JobPriority::Recent:
+            return "recent";
+        case JobPriority::Bulk:
+            return "bulk";
+    }
+    return "?";
+}
+
+void JobQueue::enqueue(ACFMsg msg) {
+    msg.enqueued_at = chr::steady_clock::now();
+    {
+        std::lock_guard lock(mutex);
+        lanes[size_t(msg.priority)].push_back(std::move(msg));
+        UpdateMax(g_metrics.job_queue_max_depth, ++size);
+    }
+    cv.notify_one();
+}
+
+size_t JobQueue::wait_dequeue_bulk_timed(ACFMsg* out, size_t max_n, int64_t timeout_usec) {
+    std::unique_lock lock(mutex);
+    if (!cv.wait_for(lock, chr::microseconds(timeout_usec), [this]() {
+            return size > 0;
+        })) {
+        return 0;
+    }
+    const auto now = chr::steady_clock::now();
+    // A batch runs as one, so its jobs come from a single lane: an interactive job isn't held up
+    // by the bulk jobs taken with it.
+    auto& lane = lanes[pick_lane_locked()];
+    size_t n = 0;
+    for (; n < max_n && !lane.empty(); ++n) {
+        out[n] = std::move(lane.front());
+        lane.pop_front();
+        --size;
+        g_metrics.queue_wait[size_t(out[n].priority)].add(now - out[n].enqueued_at);
+    }
+    return n;
+}
+
+size_t JobQueue::pick_lane_locked() {
+    size_t result = k_num_job_priorities;
+    // A starving lane first, lowest priority first so all of them get their turn.
+    for (size_t i = k_num_job_priorities; i-- > 0;) {
+        if (!lanes[i].empty() && skips[i] >= k_max_lane_skips) {
+            result = i;
+            break;
+        }
+    }
+    if (result == k_num_job_priorities) {
+        for (size_t i = 0; i < k_num_job_priorities; ++i) {
+            if (!lanes[i].empty()) {
+                result = i;
+                break;
+            }
+        }
+    }
+    for (size_t i = 0; i < k_num_job_priorities; ++i) {
+        if (i == result || lanes[i].empty()) {
+            skips[i] = 0;
+        } else {
+            ++skips[i];
+        }
+    }
+    return result;
+}
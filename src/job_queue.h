@@ -0,0 +1,80 @@
+#pragma once
+
+#include "clang_format.h"
+#include "file_table.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Lanes of the formatter queue, in priority order.
+enum class JobPriority {
+    Interactive,  // Requested by the user in the UI.
+    Recent,       // Files changed just now.
+    Bulk,         // Add All, Format All.
+};
+constexpr size_t k_num_job_priorities = 3;
+
+const char* JobPriorityName(JobPriority p);
+
+// The input of a FormatBuffer job, which has no file.
+struct BufferJob {
+    std::filesystem::path assumed_path;
+    std::string content;
+    std::vector<LineRange> lines;  // All if empty.
+    // Called on the formatter thread with the formatted content, nullopt on error.
+    std::function<void(std::optional<std::string>)> on_done;
+};
+
+struct ACFMsg {
+    enum class Command { CheckFormat, Format, FormatBuffer };
+
+    Command command;
+    std::filesystem::path path;
+    FileId file = 0;
+    std::filesystem::file_time_type last_write_time = {};  // Of a check, echoed in the result.
+    // A CheckFormat job is skipped (completed with false) if `latest_generation` has moved past
+    // `generation` by the time a formatter thread takes it: a newer request superseded it.
+    std::shared_ptr<const std::atomic<uint64_t>> latest_generation;
+    uint64_t generation = 0;
+    JobPriority priority = JobPriority::Recent;
+    std::chrono::steady_clock::time_point enqueued_at = {};  // Set by `JobQueue::enqueue`.
+    std::shared_ptr<BufferJob> buffer = nullptr;              // Of FormatBuffer.
+};
+
+// Multi-producer, multi-consumer queue of formatter jobs with one FIFO lane per priority. The
+// consumers take from the highest priority non-empty lane, but a non-empty lane is served at
+// least once in every `k_max_lane_skips` + 1 dequeues, so bulk work isn't starved. Records the
+// time the jobs spend in the queue per lane and the queue depth in `g_metrics`.
+class JobQueue {
+   public:
+    static constexpr uint32_t k_max_lane_skips = 8;
+
+    void enqueue(ACFMsg msg);
+    // Waits for jobs up to `timeout_usec`, then moves up to `max_n` of them to `out`, all from the
+    // same lane. Returns the number of jobs taken.
+    size_t wait_dequeue_bulk_timed(ACFMsg* out, size_t max_n, int64_t timeout_usec);
+    size_t size_approx() const {
+        return size;
+    }
+
+   private:
+    size_t pick_lane_locked();
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::array<std::deque<ACFMsg>, k_num_job_priorities> lanes;
+    // Number of jobs taken from other lanes while the lane was non-empty.
+    std::array<uint32_t, k_num_job_priorities> skips = {};
+    std::atomic<size_t> size = 0;
+};
@@ -0,0 +1,368 @@
+#include "line_index.h"
+
+#include "util.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace fs = std::filesystem;
+
+namespace {
+// Smaller files are processed whole, clang-format is fast on them anyway.
+constexpr size_t k_min_lines = 1000;
+// 64 MB of hashes.
+constexpr size_t k_max_total_lines = 16 * 1024 * 1024;
+// Edits of more lines than this are processed whole.
+constexpr int k_max_edit_distance = 512;
+constexpr size_t k_max_ranges = 16;
+// Changed lines closer than this are merged into one range.
+constexpr unsigned k_merge_gap = 3;
+}  // namespace
+
+std::vector<uint32_t> HashLines(std::string_view content) {
+    std::vector<uint32_t> result;
+    for (size_t start = 0; start < content.size();) {
+        const auto end = std::min(content.find('\n', start), content.size());
+        result.push_back(uint32_t(hash64(content.substr(start, end - start))));
+        start = end + 1;
+    }
+    return result;
+}
+
+std::optional<std::vector<LineRange>> ChangedLineRanges(std::span<const uint32_t> old_lines,
+                                                        std::span<const uint32_t> new_lines) {
+    if (new_lines.empty()) {
+        return std::nullopt;
+    }
+    size_t prefix = 0;
+    while (prefix < old_lines.size() && prefix < new_lines.size()
+           && old_lines[prefix] == new_lines[prefix]) {
+        ++prefix;
+    }
+    size_t suffix = 0;
+    while (suffix < old_lines.size() - prefix && suffix < new_lines.size() - prefix
+           && old_lines.rbegin()[ptrdiff_t(suffix)] == new_lines.rbegin()[ptrdiff_t(suffix)]) {
+        ++suffix;
+    }
+    const auto a = old_lines.subspan(prefix, old_lines.size() - prefix - suffix);
+    const auto b = new_lines.subspan(prefix, new_lines.size() - prefix - suffix);
+    if (a.empty() && b.empty()) {
+        return std::vector<LineRange>{};
+    }
+
+    // Myers' O(ND) diff of the rest, keeping the furthest reaching x of each diagonal k per round.
+    const int n = int(a.size());
+    const int m = int(b.size());
+    const int max_d = std::min(n + m, k_max_edit_distance);
+    if (std::abs(n - m) > max_d) {
+        return std::nullopt;
+    }
+    const int o = max_d + 1;  // Offset of diagonal 0.
+    std::vector<int> v(size_t(2 * max_d + 3), 0);
+    std::vector<std::vector<int>> trace;
+    int d_found = -1;
+    for (int d = 0; d <= max_d && d_found < 0; ++d) {
+        trace.push_back(v);
+        for (int k = -d; k <= d; k += 2) {
+            int x = k == -d || (k != d && v[size_t(o + k - 1)] < v[size_t(o + k + 1)])
+                      ? v[size_t(o + k + 1)]
+                      : v[size_t(o + k - 1)] + 1;
+            int y = x - k;
+            while (x < n && y < m && a[size_t(x)] == b[size_t(y)]) {
+                ++x;
+                ++y;
+            }
+            v[size_t(o + k)] = x;
+            if (x >= n && y >= m) {
+                d_found = d;
+                break;
+            }
+        }
+    }
+    if (d_found < 0) {
+        return std::nullopt;
+    }
+
+    // Walk the edits backwards, marking the inserted lines and the lines around the removed ones.
+    std::vector<bool> changed(new_lines.size());
+    auto mark = [&changed, prefix](int i) {
+        const auto line = int64_t(prefix) + i;
+        if (line >= 0 && size_t(line) < changed.size()) {
+            changed[size_t(line)] = true;
+        }
+    };
+    int x = n;
+    int y = m;
+    for (int d = d_found; d > 0; --d) {
+        const auto& vd = trace[size_t(d)];
+        const int k = x - y;
+        const int prev_k = k == -d || (k != d && vd[size_t(o + k - 1)] < vd[size_t(o + k + 1)])
+                             ? k + 1
+                             : k - 1;
+        const int prev_x = vd[size_t(o + prev_k)];
+        const int prev_y = prev_x - prev_k;
+        while (x > prev_x && y > prev_y) {
+            --x;
+            --y;
+        }
+        if (x == prev_x) {
+            // b[prev_y] inserted.
+            mark(prev_y);
+        } else {
+            // a[prev_x] removed before b[y].
+            mark(y - 1);
+            mark(y);
+        }
+        x = prev_x;
+        y = prev_y;
+    }
+
+    std::vector<LineRange> result;
+    size_t num_lines = 0;
+    for (size_t i = 0; i < changed.size(); ++i) {
+        if (!changed[i]) {
+            continue;
+        }
+        const auto line = unsigned(i + 1);
+        if (!result.empty() && line <= result.back().last + k_merge_gap + 1) {
+            num_lines += line - result.back().last;
+            result.back().last = line;
+        } else {
+            ++num_lines;
+            result.push_back(LineRange{line, line});
+        }
+    }
+    if (result.size() > k_max_ranges || num_lines * 2 > new_lines.size()) {
+        return std::nullopt;
+    }
+    return result;
+}
+
+LineIndex::LineIndex(size_t max_total_lines)
+    : max_total_lines(max_total_lines) {}
+
+void LineIndex::put(const fs::path& path,
+                    uint64_t config_hash,
+                    std::vector<uint32_t> line_hashes) {
+    if (line_hashes.size() > max_total_lines) {
+        return;
+    }
+    std::lock_guard lock(mutex);
+    if (auto it = index.find(path); it != index.end()) {
+        erase_locked(it->second);
+    }
+    while (!lru.empty() && total_lines + line_hashes.size() > max_total_lines) {
+        erase_locked(std::prev(lru.end()));
+    }
+    total_lines += line_hashes.size();
+    lru.push_front(Entry{path, config_hash, std::move(line_hashes)});
+    index.emplace(path, lru.begin());
+}
+
+std::optional<std::vector<uint32_t>> LineIndex::get(const fs::path& path, uint64_t config_hash) {
+    std::lock_guard lock(mutex);
+    auto it = index.find(path);
+    if (it == index.end() || it->second->config_hash != config_hash) {
+        return std::nullopt;
+    }
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->line_hashes;
+}
+
+void LineIndex::erase(const fs::path& path) {
+    std::lock_guard lock(mutex);
+    if (auto it = index.find(path); it != index.end()) {
+        erase_locked(it->second);
+    }
+}
+
+void LineIndex::erase_locked(List::iterator it) {
+    total_lines -= it->line_hashes.size();
+    index.erase(it->path);
+    lru.erase(it);
+}
+
+namespace {
+struct IncrementalClangFormat : public ClangFormat {
+    std::unique_ptr<ClangFormat> clang_format;
+    std::shared_ptr<LineIndex> line_index;
+    std::shared_ptr<ClangFormatConfigCache> config_cache;
+
+    // How to process a file.
+    struct Plan {
+        uint64_t config_hash = 0;
+        std::optional<std::vector<uint32_t>> line_hashes;  // If the file is large enough.
+        std::optional<std::vector<LineRange>> lines;       // nullopt: the whole file.
+        bool unchanged = false;  // Same lines and config as when it was formatted.
+        FormatResult unchanged_result;  // The content and time planned for, if `unchanged`.
+    };
+
+    IncrementalClangFormat(std::unique_ptr<ClangFormat> clang_format,
+                           std::shared_ptr<LineIndex> line_index,
+                           std::shared_ptr<ClangFormatConfigCache> config_cache)
+        : clang_format(std::move(clang_format))
+        , line_index(std::move(line_index))
+        , config_cache(std::move(config_cache)) {}
+
+    std::unique_ptr<ClangFormat> clone() const override {
+        return std::make_unique<IncrementalClangFormat>(
+            clang_format->clone(), line_index, config_cache);
+    }
+
+    const std::string& version() const override {
+        return clang_format->version();
+    }
+
+    CheckResult is_file_formatted(const fs::path& f) override {
+        auto plan = plan_of(f);
+        if (plan.unchanged) {
+            return CheckResult::LinesFormatted;
+        }
+        const auto result = !plan.lines ? clang_format->is_file_formatted(f)
+                                        : clang_format->are_lines_formatted(f, *plan.lines);
+        if (result != CheckResult::Unformatted && plan.line_hashes) {
+            line_index->put(f, plan.config_hash, std::move(*plan.line_hashes));
+        }
+        return result;
+    }
+
+    std::optional<FormatResult> format_file_in_place(const fs::path& f) override {
+        auto plan = plan_of(f);
+        if (plan.unchanged) {
+            return plan.unchanged_result;
+        }
+        auto result = !plan.lines ? clang_format->format_file_in_place(f)
+                                  : clang_format->format_lines_in_place(f, *plan.lines);
+        if (result && plan.line_hashes) {
+            index_formatted_file(f, plan.config_hash, *result);
+        }
+        return result;
+    }
+
+    // The whole files are checked in one batch, the changed lines file by file.
+    std::vector<CheckResult> are_files_formatted(std::span<const fs::path> files) override {
+        std::vector<CheckResult> result(files.size());
+        std::vector<Plan> plans;
+        plans.reserve(files.size());
+        std::vector<fs::path> whole_files;
+        std::vector<size_t> whole_indices;
+        for (size_t i = 0; i < files.size(); ++i) {
+            plans.push_back(plan_of(files[i]));
+            if (plans[i].unchanged) {
+                result[i] = CheckResult::LinesFormatted;
+            } else if (plans[i].lines) {
+                result[i] = clang_format->are_lines_formatted(files[i], *plans[i].lines);
+            } else {
+                whole_files.push_back(files[i]);
+                whole_indices.push_back(i);
+            }
+        }
+        if (!whole_files.empty()) {
+            auto whole_result = clang_format->are_files_formatted(whole_files);
+            for (size_t j = 0; j < whole_indices.size(); ++j) {
+                result[whole_indices[j]] = whole_result[j];
+            }
+        }
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (result[i] != CheckResult::Unformatted && !plans[i].unchanged
+                && plans[i].line_hashes) {
+                line_index->put(files[i], plans[i].config_hash, std::move(*plans[i].line_hashes));
+            }
+        }
+        return result;
+    }
+
+    std::vector<std::optional<FormatResult>> format_files_in_place(
+        std::span<const fs::path> files) override {
+        std::vector<std::optional<FormatResult>> result(files.size());
+        std::vector<Plan> plans;
+        plans.reserve(files.size());
+        std::vector<fs::path> whole_files;
+        std::vector<size_t> whole_indices;
+        for (size_t i = 0; i < files.size(); ++i) {
+            plans.push_back(plan_of(files[i]));
+            if (plans[i].unchanged) {
+                result[i] = plans[i].unchanged_result;
+            } else if (plans[i].lines) {
+                result[i] = clang_format->format_lines_in_place(files[i], *plans[i].lines);
+            } else {
+                whole_files.push_back(files[i]);
+                whole_indices.push_back(i);
+            }
+        }
+        if (!whole_files.empty()) {
+            auto whole_result = clang_format->format_files_in_place(whole_files);
+            for (size_t j = 0; j < whole_indices.size(); ++j) {
+                result[whole_indices[j]] = whole_result[j];
+            }
+        }
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (result[i] && !plans[i].unchanged && plans[i].line_hashes) {
+                index_formatted_file(files[i], plans[i].config_hash, *result[i]);
+            }
+        }
+        return result;
+    }
+
+    CheckResult are_lines_formatted(const fs::path& f, std::span<const LineRange> lines) override {
+        return clang_format->are_lines_formatted(f, lines);
+    }
+
+    std::optional<FormatResult> format_lines_in_place(const fs::path& f,
+                                                      std::span<const LineRange> lines) override {
+        return clang_format->format_lines_in_place(f, lines);
+    }
+
+    std::optional<std::string> format_buffer(const fs::path& assumed_path,
+                                             const std::string& content,
+                                             std::span<const LineRange> lines) override {
+        return clang_format->format_buffer(assumed_path, content, lines);
+    }
+
+   private:
+    Plan plan_of(const fs::path& f) {
+        Plan plan;
+        auto last_write_time = fs_last_write_time_noexcept(f);
+        auto content = fs_read_file_noexcept(f);
+        if (!last_write_time || !content) {
+            return plan;
+        }
+        auto line_hashes = HashLines(*content);
+        if (line_hashes.size() < k_min_lines) {
+            line_index->erase(f);
+            return plan;
+        }
+        // The formatted lines are only valid with the same config.
+        plan.config_hash = config_cache->get(f.parent_path()).hash;
+        if (auto formatted_line_hashes = line_index->get(f, plan.config_hash)) {
+            plan.lines = ChangedLineRanges(*formatted_line_hashes, line_hashes);
+            plan.unchanged = plan.lines && plan.lines->empty();
+            plan.unchanged_result = FormatResult{.content_hash = hash64(*content),
+                                                 .last_write_time = *last_write_time,
+                                                 .partial = true};
+        }
+        plan.line_hashes = std::move(line_hashes);
+        return plan;
+    }
+
+    // The file is read again, indexed only if it's still what the format left.
+    void index_formatted_file(const fs::path& f, uint64_t config_hash, const FormatResult& result) {
+        auto content = fs_read_file_noexcept(f);
+        if (!content || hash64(*content) != result.content_hash) {
+            line_index->erase(f);
+            return;
+        }
+        if (auto line_hashes = HashLines(*content); line_hashes.size() >= k_min_lines) {
+            line_index->put(f, config_hash, std::move(line_hashes));
+        }
+    }
+};
+}  // namespace
+
+std::unique_ptr<ClangFormat> make_incremental_clang_format(
+    std::unique_ptr<ClangFormat> clang_format,
+    std::shared_ptr<ClangFormatConfigCache> config_cache) {
+    return std::make_unique<IncrementalClangFormat>(std::move(clang_format),
+                                                    std::make_shared<LineIndex>(k_max_total_lines),
+                                                    std::move(config_cache));
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "clang_format.h"
+#include "clang_format_config.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// 32-bit hashes of the lines of `content`.
+std::vector<uint32_t> HashLines(std::string_view content);
+
+// The lines of the new version that were inserted or changed, or are next to removed lines,
+// merged into ranges. Empty if nothing changed, nullopt if the difference is too large or too
+// fragmented to be worth passing to clang-format as ranges.
+std::optional<std::vector<LineRange>> ChangedLineRanges(std::span<const uint32_t> old_lines,
+                                                        std::span<const uint32_t> new_lines);
+
+// Thread-safe, size-bounded LRU index of the line hashes of large files, as of the last time they
+// were known to be formatted with the config of `config_hash`.
+class LineIndex {
+   public:
+    explicit LineIndex(size_t max_total_lines);
+
+    void put(const std::filesystem::path& path,
+             uint64_t config_hash,
+             std::vector<uint32_t> line_hashes);
+    // nullopt if not found or formatted with a different config.
+    std::optional<std::vector<uint32_t>> get(const std::filesystem::path& path,
+                                             uint64_t config_hash);
+    void erase(const std::filesystem::path& path);
+
+   private:
+    struct Entry {
+        std::filesystem::path path;
+        uint64_t config_hash;
+        std::vector<uint32_t> line_hashes;
+    };
+    using List = std::list<Entry>;
+
+    void erase_locked(List::iterator it);
+
+    const size_t max_total_lines;
+    size_t total_lines = 0;
+    std::mutex mutex;
+    List lru;  // Most recent at front.
+    std::unordered_map<std::filesystem::path, List::iterator> index;
+};
+
+// Wraps a ClangFormat instance: the checks and formats of large files whose formatted version is
+// in the line index are limited to the lines changed since, so their cost scales with the size of
+// the edit. Falls back to the whole file when the changes are too fragmented. Like clang-format's
+// --lines, an edit isn't expected to change the formatting of the lines around it.
+std::unique_ptr<ClangFormat> make_incremental_clang_format(
+    std::unique_ptr<ClangFormat> clang_format,
+    std::shared_ptr<ClangFormatConfigCache> config_cache);
@@ -0,0 +1,414 @@
+#include "linux_monitor.h"
+
+#if defined(__linux__)
+
+#    include "util.h"
+
+#    include <fmt/format.h>
+
+#    include <fcntl.h>
+#    include <poll.h>
+#    include <sys/eventfd.h>
+#    include <sys/fanotify.h>
+#    include <sys/inotify.h>
+#    include <sys/statfs.h>
+#    include <unistd.h>
+
+#    include <algorithm>
+#    include <array>
+#    include <cerrno>
+#    include <cstring>
+#    include <ctime>
+#    include <fstream>
+
+namespace fs = std::filesystem;
+
+namespace {
+constexpr uint32_t k_inotify_mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE
+                                  | IN_CREATE | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+// If the system limit can't be read.
+constexpr size_t k_default_max_watches = 8192;
+constexpr size_t k_read_buffer_size = 64 * 1024;
+
+size_t SystemMaxWatches() {
+    std::ifstream f("/proc/sys/fs/inotify/max_user_watches");
+    size_t n = 0;
+    return f >> n ? n : k_default_max_watches;
+}
+
+fsw::event FileEvent(std::string path, fsw_event_flag flag) {
+    return fsw::event(std::move(path), std::time(nullptr), {flag, IsFile});
+}
+
+bool IsInside(const std::string& path, const std::string& dir) {
+    return path.starts_with(dir)
+        && (path.size() == dir.size() || path[dir.size()] == '/' || dir.ends_with('/'));
+}
+
+uint64_t FsidToUint64(const void* fsid) {
+    uint64_t r;
+    memcpy(&r, fsid, sizeof(r));
+    return r;
+}
+}  // namespace
+
+LinuxMonitor::LinuxMonitor(std::vector<std::string> paths,
+                           fsw::FSW_EVENT_CALLBACK* callback,
+                           void* context,
+                           bool use_fanotify,
+                           size_t max_watches,
+                           std::shared_ptr<PathFilter> filter)
+    : fsw::monitor(std::move(paths), callback, context)
+    , use_fanotify(use_fanotify)
+    , max_watches(max_watches == 0 ? SystemMaxWatches() : max_watches)
+    , filter(std::move(filter))
+    , wake_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {}
+
+LinuxMonitor::~LinuxMonitor() {
+    if (wake_fd >= 0) {
+        close(wake_fd);
+    }
+}
+
+void LinuxMonitor::on_stop() {
+    const uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        fmt::print(stderr, "Can't wake the file monitor: {}\n", strerror(errno));
+    }
+}
+
+void LinuxMonitor::run() {
+    if (use_fanotify && !init_fanotify()) {
+        fmt::print(stderr, "Falling back to inotify.\n");
+        use_fanotify = false;
+    }
+    if (!use_fanotify && !init_inotify()) {
+        return;
+    }
+    const int fd = use_fanotify ? fanotify_fd : inotify_fd;
+    std::vector<char> buffer(k_read_buffer_size);
+    for (;;) {
+        {
+            std::lock_guard run_guard(run_mutex);
+            if (should_stop) {
+                break;
+            }
+        }
+        std::array<pollfd, 2> fds = {{{fd, POLLIN, 0}, {wake_fd, POLLIN, 0}}};
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fmt::print(stderr, "File monitor poll failed: {}\n", strerror(errno));
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+        const auto n = read(fd, buffer.data(), buffer.size());
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            fmt::print(stderr, "Can't read file events: {}\n", strerror(errno));
+            break;
+        }
+        std::vector<fsw::event> events;
+        if (use_fanotify) {
+            read_fanotify_events(buffer.data(), size_t(n), events);
+        } else {
+            read_inotify_events(buffer.data(), size_t(n), events);
+        }
+        if (!events.empty()) {
+            notify_events(events);
+        }
+    }
+    for (int* p : {&inotify_fd, &fanotify_fd}) {
+        if (*p >= 0) {
+            close(*p);
+            *p = -1;
+        }
+    }
+    for (auto& [_, root_fd] : fsid_and_root_fds) {
+        close(root_fd);
+    }
+    fsid_and_root_fds.clear();
+    fanotify_roots.clear();
+    dir_of_wd.clear();
+}
+
+bool LinuxMonitor::init_inotify() {
+    inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (inotify_fd < 0) {
+        fmt::print(stderr, "Can't initialize inotify: {}\n", strerror(errno));
+        return false;
+    }
+    for (auto& p : paths) {
+        watch_tree(PathFromUtf8(p), nullptr);
+    }
+    if (num_unwatched_dirs > 0) {
+        fmt::print(stderr,
+                   "Watching {} directories with inotify, {} over the budget are not watched.\n",
+                   dir_of_wd.size(),
+                   num_unwatched_dirs);
+    } else {
+        fmt::print(stderr, "Watching {} directories with inotify.\n", dir_of_wd.size());
+    }
+    return true;
+}
+
+bool LinuxMonitor::init_fanotify() {
+#    ifdef FAN_REPORT_DFID_NAME
+    // Reports the directory and the name of the changed entries, which don't need open files.
+    fanotify_fd = fanotify_init(
+        FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME, O_RDONLY | O_CLOEXEC);
+    if (fanotify_fd < 0) {
+        fmt::print(stderr,
+                   "Can't initialize fanotify: {}{}\n",
+                   strerror(errno),
+                   errno == EPERM ? " (needs CAP_SYS_ADMIN)" : "");
+        return false;
+    }
+    for (auto& p : paths) {
+        if (fanotify_mark(fanotify_fd,
+                          FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                          FAN_CLOSE_WRITE | FAN_MOVED_TO | FAN_MOVED_FROM | FAN_DELETE,
+                          AT_FDCWD,
+                          p.c_str())
+            < 0) {
+            fmt::print(stderr, "Can't add fanotify mark for {}: {}\n", p, strerror(errno));
+            return false;
+        }
+        const int root_fd = open(p.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        struct statfs st;
+        if (root_fd < 0 || fstatfs(root_fd, &st) < 0) {
+            fmt::print(stderr, "Can't open {}: {}\n", p, strerror(errno));
+            if (root_fd >= 0) {
+                close(root_fd);
+            }
+            return false;
+        }
+        fsid_and_root_fds.emplace_back(FsidToUint64(&st.f_fsid), root_fd);
+        // The paths of the events are resolved, without symlinks.
+        std::error_code ec;
+        auto canonical_root = fs::canonical(PathFromUtf8(p), ec);
+        fanotify_roots.push_back(ec ? p : ToUtf8(canonical_root));
+    }
+    fmt::print(stderr, "Watching the filesystems of the watched directories with fanotify.\n");
+    return true;
+#    else
+    fmt::print(stderr, "fanotify directory entry events are not supported by this build.\n");
+    return false;
+#    endif
+}
+
+bool LinuxMonitor::is_excluded_dir(const fs::path& path) const {
+    return filter && filter->is_excluded(path, true);
+}
+
+void LinuxMonitor::watch_tree(const fs::path& root, std::vector<fsw::event>* events) {
+    if (!add_watch(root)) {
+        return;
+    }
+    std::error_code ec;
+    for (fs::recursive_directory_iterator
+             it(root, fs::directory_options::skip_permission_denied, ec),
+         end;
+         !ec && it != end;
+         it.increment(ec)) {
+        std::error_code type_ec;
+        const auto status = it->symlink_status(type_ec);
+        if (fs::is_directory(status)) {
+            if (is_excluded_dir(it->path()) || !add_watch(it->path())) {
+                it.disable_recursion_pending();
+            }
+        } else if (events && fs::is_regular_file(status)) {
+            events->push_back(FileEvent(ToUtf8(it->path()), Created));
+        }
+    }
+}
+
+void LinuxMonitor::unwatch_tree(const std::string& root) {
+    for (auto it = dir_of_wd.begin(); it != dir_of_wd.end();) {
+        if (IsInside(it->second, root)) {
+            inotify_rm_watch(inotify_fd, it->first);
+            it = dir_of_wd.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool LinuxMonitor::add_watch(const fs::path& dir) {
+    if (dir_of_wd.size() >= max_watches) {
+        ++num_unwatched_dirs;
+        if (!reported_unwatched_dirs) {
+            fmt::print(stderr,
+                       "The inotify watch budget of {} directories is used up, changes in {} and "
+                       "other directories are not noticed. Raise it with --max-watches (and "
+                       "fs.inotify.max_user_watches) or exclude directories with --exclude.\n",
+                       max_watches,
+                       ToUtf8(dir));
+            reported_unwatched_dirs = true;
+        }
+        return false;
+    }
+    const int wd = inotify_add_watch(inotify_fd, dir.c_str(), k_inotify_mask);
+    if (wd < 0) {
+        if (errno == ENOSPC) {
+            ++num_unwatched_dirs;
+            if (!reported_unwatched_dirs) {
+                fmt::print(stderr,
+                           "The system's inotify watch limit is reached after {} directories, "
+                           "changes in {} and other directories are not noticed. Raise "
+                           "fs.inotify.max_user_watches or exclude directories with --exclude.\n",
+                           dir_of_wd.size(),
+                           ToUtf8(dir));
+                reported_unwatched_dirs = true;
+            }
+        } else if (errno != ENOENT && errno != ENOTDIR) {
+            fmt::print(stderr, "Can't watch {}: {}\n", ToUtf8(dir), strerror(errno));
+        }
+        return false;
+    }
+    dir_of_wd[wd] = dir.string();
+    return true;
+}
+
+void LinuxMonitor::read_inotify_events(const char* buffer,
+                                       size_t size,
+                                       std::vector<fsw::event>& events) {
+    for (size_t offset = 0; offset + sizeof(inotify_event) <= size;) {
+        inotify_event e;
+        memcpy(&e, buffer + offset, sizeof(e));
+        const char* name = buffer + offset + sizeof(e);
+        offset += sizeof(e) + e.len;
+        if (e.mask & IN_Q_OVERFLOW) {
+            add_overflow_events(events);
+            continue;
+        }
+        auto it = dir_of_wd.find(e.wd);
+        if (it == dir_of_wd.end()) {
+            continue;
+        }
+        if (e.mask & IN_IGNORED) {
+            // The directory is gone.
+            dir_of_wd.erase(it);
+            if (dir_of_wd.size() < max_watches) {
+                reported_unwatched_dirs = false;
+            }
+            continue;
+        }
+        if (e.len == 0) {
+            continue;
+        }
+        auto path = it->second + "/" + name;
+        if (e.mask & IN_ISDIR) {
+            if (e.mask & (IN_CREATE | IN_MOVED_TO)) {
+                if (!is_excluded_dir(path)) {
+                    // Files may have been written before the watch was added.
+                    watch_tree(path, &events);
+                }
+            } else if (e.mask & IN_MOVED_FROM) {
+                unwatch_tree(path);
+            }
+            continue;
+        }
+        if (e.mask & IN_CLOSE_WRITE) {
+            events.push_back(FileEvent(std::move(path), Updated));
+        } else if (e.mask & IN_MOVED_TO) {
+            events.push_back(FileEvent(std::move(path), MovedTo));
+        } else if (e.mask & IN_MOVED_FROM) {
+            events.push_back(FileEvent(std::move(path), MovedFrom));
+        } else if (e.mask & IN_DELETE) {
+            events.push_back(FileEvent(std::move(path), Removed));
+        }
+    }
+}
+
+void LinuxMonitor::read_fanotify_events(const char* buffer,
+                                        size_t size,
+                                        std::vector<fsw::event>& events) {
+#    ifdef FAN_REPORT_DFID_NAME
+    fanotify_event_metadata m;
+    for (size_t offset = 0; offset + sizeof(m) <= size; offset += m.event_len) {
+        memcpy(&m, buffer + offset, sizeof(m));
+        if (m.event_len < sizeof(m) || offset + m.event_len > size) {
+            break;
+        }
+        if (m.fd >= 0) {
+            close(m.fd);
+        }
+        if (m.mask & FAN_Q_OVERFLOW) {
+            add_overflow_events(events);
+            continue;
+        }
+        fanotify_event_info_fid info;
+        if (m.event_len < sizeof(m) + sizeof(info) + sizeof(file_handle)) {
+            continue;
+        }
+        const char* info_ptr = buffer + offset + sizeof(m);
+        memcpy(&info, info_ptr, sizeof(info));
+        if (info.hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME || (m.mask & FAN_ONDIR)) {
+            continue;
+        }
+        // The directory's file handle, followed by the entry's name.
+        const char* handle_ptr = info_ptr + sizeof(info);
+        file_handle handle_header;
+        memcpy(&handle_header, handle_ptr, sizeof(handle_header));
+        const auto handle_size = sizeof(file_handle) + handle_header.handle_bytes;
+        std::vector<uint64_t> handle_storage((handle_size + 7) / 8);
+        memcpy(handle_storage.data(), handle_ptr, handle_size);
+        const char* name = handle_ptr + handle_size;
+
+        const auto fsid = FsidToUint64(&info.fsid);
+        int dir_fd = -1;
+        for (auto& [root_fsid, root_fd] : fsid_and_root_fds) {
+            if (root_fsid == fsid) {
+                dir_fd = open_by_handle_at(root_fd,
+                                           reinterpret_cast<file_handle*>(handle_storage.data()),
+                                           O_PATH | O_CLOEXEC);
+                break;
+            }
+        }
+        if (dir_fd < 0) {
+            continue;
+        }
+        std::array<char, 4096> dir_path;
+        const auto n = readlink(
+            fmt::format("/proc/self/fd/{}", dir_fd).c_str(), dir_path.data(), dir_path.size());
+        close(dir_fd);
+        if (n <= 0 || size_t(n) >= dir_path.size()) {
+            continue;
+        }
+        auto path = std::string(dir_path.data(), size_t(n)) + "/" + name;
+        // The marks cover the whole filesystems.
+        if (std::none_of(BE(fanotify_roots), [&path](const std::string& root) {
+                return IsInside(path, root);
+            })) {
+            continue;
+        }
+        if (m.mask & FAN_CLOSE_WRITE) {
+            events.push_back(FileEvent(std::move(path), Updated));
+        } else if (m.mask & FAN_MOVED_TO) {
+            events.push_back(FileEvent(std::move(path), MovedTo));
+        } else if (m.mask & FAN_MOVED_FROM) {
+            events.push_back(FileEvent(std::move(path), MovedFrom));
+        } else if (m.mask & FAN_DELETE) {
+            events.push_back(FileEvent(std::move(path), Removed));
+        }
+    }
+#    else
+    (void)buffer;
+    (void)size;
+    (void)events;
+#    endif
+}
+
+void LinuxMonitor::add_overflow_events(std::vector<fsw::event>& events) const {
+    for (auto& p : paths) {
+        events.push_back(fsw::event(p, std::time(nullptr), {Overflow}));
+    }
+}
+
+#endif
@@ -0,0 +1,69 @@
+#pragma once
+
+#if defined(__linux__)
+
+#    include "path_filter.h"
+
+#    include <libfswatch/c++/monitor.hpp>
+
+#    include <cstdint>
+#    include <filesystem>
+#    include <memory>
+#    include <string>
+#    include <unordered_map>
+#    include <utility>
+#    include <vector>
+
+// Watches the directory trees with inotify, or with fanotify marks on their filesystems. Files are
+// reported when closed after writing, moved in, moved out or deleted, not while being written.
+// Same callback contract as the libfswatch monitors: each event has `IsFile` and one of `Updated`,
+// `MovedTo`, `MovedFrom`, `Removed`, files in directories created or moved into the tree are
+// reported as `Created`. A queue overflow is reported as an `Overflow` event for each root.
+//
+// inotify needs a watch per directory. Directories excluded by the path filter aren't watched,
+// new directories are watched as they appear, and the watches are limited to a budget; the
+// directories over it are reported once on stderr. fanotify needs no watches but CAP_SYS_ADMIN
+// and Linux 5.9, otherwise inotify is used.
+class LinuxMonitor : public fsw::monitor {
+   public:
+    // `max_watches` is the inotify watch budget, 0 means the system limit. `filter` may be nullptr.
+    LinuxMonitor(std::vector<std::string> paths,
+                 fsw::FSW_EVENT_CALLBACK* callback,
+                 void* context,
+                 bool use_fanotify,
+                 size_t max_watches,
+                 std::shared_ptr<PathFilter> filter);
+    ~LinuxMonitor() override;
+
+   protected:
+    void run() override;
+    void on_stop() override;
+
+   private:
+    bool init_inotify();
+    bool init_fanotify();
+    bool is_excluded_dir(const std::filesystem::path& path) const;
+    // Watches `root` and its subdirectories. With `events`, reports the files found as created.
+    void watch_tree(const std::filesystem::path& root, std::vector<fsw::event>* events);
+    void unwatch_tree(const std::string& root);
+    bool add_watch(const std::filesystem::path& dir);
+    void read_inotify_events(const char* buffer, size_t size, std::vector<fsw::event>& events);
+    void read_fanotify_events(const char* buffer, size_t size, std::vector<fsw::event>& events);
+    void add_overflow_events(std::vector<fsw::event>& events) const;
+
+    bool use_fanotify;
+    size_t max_watches;
+    std::shared_ptr<PathFilter> filter;
+    int wake_fd = -1;  // eventfd, signaled by `on_stop`.
+    int inotify_fd = -1;
+    int fanotify_fd = -1;
+    // inotify watch descriptors to directories.
+    std::unordered_map<int, std::string> dir_of_wd;
+    size_t num_unwatched_dirs = 0;
+    bool reported_unwatched_dirs = false;
+    // fanotify: open directories of the roots with their filesystem IDs, to resolve file handles.
+    std::vector<std::pair<uint64_t, int>> fsid_and_root_fds;
+    std::vector<std::string> fanotify_roots;  // Canonical.
+};
+
+#endif
@@ -1,7 +1,14 @@
-#include "async_clang_format.h"
+#include "app.h"
 #include "clang_format.h"
+#include "ipc.h"
+#include "ipc_server.h"
+#include "line_index.h"
+#include "linux_monitor.h"
 #include "state.h"
-#include "ui_glfw_imgui.h"
+#include "ui_headless.h"
+#if CLAFORD_WITH_GUI
+#    include "ui_glfw_imgui.h"
+#endif
 #include "util.h"
 
 #include <fmt/format.h>
@@ -11,17 +18,18 @@
 #include <nowide/iostream.hpp>
 
 #include <atomic>
+#include <cassert>
+#include <charconv>
 #include <csignal>
 #include <filesystem>
 #include <functional>
 #include <list>
+#include <memory>
 #include <set>
 #include <string_view>
 #include <thread>
 #include <unordered_map>
 
-std::atomic<bool> g_sigint_received;
-
 void signal_handler(int /* signum */) {
     g_sigint_received = true;
 }
@@ -35,17 +43,49 @@ void DisplayHelp() {
     fmt::print("Watch directories and automatically clang-format changed files.\n");
     fmt::print("Usage: claford [options] paths...\n\n");
     fmt::print("   -h|--help: this help\n");
+    fmt::print("   -j|--jobs N: number of formatter threads (default: number of cores)\n");
+    fmt::print("   --backend auto|process|lib: how to run clang-format (default: auto, which\n");
+    fmt::print("       means the in-process libFormat if claford was built with it)\n");
+    fmt::print("   --cache-file FILE: hashes of the files known to be formatted\n");
+    fmt::print("       (default: {})\n", ToUtf8(VerifiedCache::default_file()));
+    fmt::print("   --no-cache: don't use the cache file\n");
+    fmt::print("   --no-incremental: check and format large files whole, not only the changed\n");
+    fmt::print("       lines\n");
+    fmt::print("   --add-all: add all files in the watched directories on start\n");
+    fmt::print("   --add-changed: add the files git reports as changed from HEAD on start\n");
+    fmt::print("   --check-staged: check the staged content of the files in the directories (or\n");
+    fmt::print("       the current one), print the unformatted ones and exit, for pre-commit\n");
+    fmt::print("       hooks\n");
+    fmt::print("   --include GLOB: only files matching one of the include globs (.gitignore\n");
+    fmt::print("       syntax, relative to the watched directory)\n");
+    fmt::print("   --exclude GLOB: ignore the files and directories matching the glob\n");
+    fmt::print("   --no-gitignore: don't skip the files ignored by .gitignore files\n");
+    fmt::print("   --metrics-file FILE: write the pipeline metrics to FILE every {} seconds, as\n",
+               k_metrics_write_period.count());
+    fmt::print("       JSON if it ends with .json, Prometheus text format otherwise\n");
+    fmt::print("   --watcher fswatch|inotify|fanotify: file system monitor (default: inotify on\n");
+    fmt::print("       Linux, fswatch elsewhere), fanotify needs CAP_SYS_ADMIN\n");
+    fmt::print("   --max-watches N: at most N inotify watches (default: the system limit)\n");
+#if !defined(_WIN32)
+    fmt::print("   --socket PATH: serve the local API (see claford_client) on this Unix socket\n");
+    fmt::print("       (default: {})\n", ToUtf8(DefaultIpcSocketPath()));
+    fmt::print("   --no-socket: don't serve the local API\n");
+#endif
+    fmt::print("   --headless: no window, print file status changes to stdout as JSON lines\n");
+    fmt::print("   --auto-format: with --headless, format the files found unformatted\n");
     fmt::print("\n");
     fmt::print("paths... is a list of directories to watch\n");
 }
 
 void fsw_event_callback(const std::vector<fsw::event>& es, void* void_ctx) {
     auto* ctx = static_cast<State*>(void_ctx);
+    g_metrics.fs_events += es.size();
     std::vector<fs::path> paths;
     for (auto& e : es) {
         auto path = PathFromUtf8(e.get_path());
         bool cf = false;
         bool is_file = false;
+        bool overflow = false;
         for (auto f : e.get_flags()) {
             switch (f) {
                 case NoOp:
@@ -70,13 +110,39 @@ void fsw_event_callback(const std::vector<fsw::event>& es, void* void_ctx) {
                 case IsDir:
                 case IsSymLink:
                 case Link:
+                    break;
                 case Overflow:
+                    overflow = true;
                     break;
             }
         }
-        if (is_file && cf) {
+        if (overflow) {
+            // Events were dropped, the changes are found by comparing the tracked times.
+            ++g_metrics.fs_overflows;
+            CHECK(ctx->to_app_queue.enqueue(msg::Rescan{std::move(path)}));
+            continue;
+        }
+        if (!is_file || !cf) {
+            continue;
+        }
+        if (path.filename() == ".gitignore") {
+            ctx->path_filter->invalidate();
+            continue;
+        }
+        if (IsClangFormatConfigFile(path)) {
+            // Not subject to the include globs, it affects the files below it.
             paths.push_back(std::move(path));
+            continue;
+        }
+        if (ctx->path_filter->is_excluded(path, false)) {
+            continue;
         }
+        if (ctx->self_writes.is_own_write(path)) {
+            // The echo of a format.
+            ++g_metrics.self_write_events;
+            continue;
+        }
+        paths.push_back(std::move(path));
     }
     std::sort(BE(paths));
     paths.erase(std::unique(BE(paths)), paths.end());
@@ -85,137 +151,6 @@ void fsw_event_callback(const std::vector<fsw::event>& es, void* void_ctx) {
     }
 }
 
-void FileChanged(const fs::path& path, State& ctx) {
-    // Filter by extension.
-    if (!ctx.options.extensions.contains(path.extension())) {
-        return;
-    }
-    // Ignore non-existing.
-    if (!fs_exists_noexcept(path)) {
-        ctx.paths_formatted_at.erase(path);
-        ctx.paths_to_format_since.erase(path);
-        return;
-    }
-    // Ignore files not changed since formatting.
-    auto last_write_time = fs_last_write_time_noexcept(path);
-    if (!last_write_time) {
-        ctx.paths_formatted_at.erase(path);
-        ctx.paths_to_format_since.erase(path);
-        return;
-    }
-    auto it = ctx.paths_formatted_at.find(path);
-    if (it != ctx.paths_formatted_at.end()) {
-        if (*last_write_time == it->second) {
-            return;
-        }
-    }
-    ctx.to_async_clang_format_queue.enqueue(
-        ACFMsg{.command = ACFMsg::Command::CheckFormat,
-               .path = std::move(path),
-               [&ctx, last_write_time](fs::path path, bool result) {
-                   if (result) {
-                       // Already formatted.
-                       ctx.paths_formatted_at[path] = *last_write_time;
-                       ctx.paths_to_format_since.erase(path);
-                   } else {
-                       // Needs formatting.
-                       ctx.paths_formatted_at.erase(path);
-                       ctx.paths_to_format_since[path] = *last_write_time;
-                   }
-               }});
-}
-
-ProcessMsgsResult ProcessMsgs(State& ctx) {
-    std::any msg;
-    for (;;) {
-        if (g_sigint_received) {
-            return ProcessMsgsResult::ShouldExit;
-        }
-        if (!ctx.to_app_queue.try_dequeue(msg)) {
-            return ProcessMsgsResult::QueueWasEmpty;
-        }
-        if (auto* c = std::any_cast<msg::FileChanged>(&msg)) {
-            FileChanged(c->path, ctx);
-        } else if (std::any_cast<msg::AddAll>(&msg)) {
-            std::vector<fs::path> all_files;
-            for (auto& path : ctx.options.paths) {
-                for (auto const& dir_entry : fs::recursive_directory_iterator(path)) {
-                    std::error_code ec;
-                    auto canonical_path = fs::canonical(dir_entry.path(), ec);
-                    if (ec) {
-                        fprintf(stderr,
-                                "Can't convert %s to canonical path, reason: %s\n",
-                                dir_entry.path().string().c_str(),
-                                ec.message().c_str());
-                        continue;
-                    }
-                    all_files.push_back(canonical_path.c_str());
-                }
-            }
-            std::sort(all_files.begin(), all_files.end());
-            all_files.erase(std::unique(all_files.begin(), all_files.end()), all_files.end());
-            for (auto& f : all_files) {
-                FileChanged(f, ctx);
-            }
-        } else if (std::any_cast<msg::FormatAll>(&msg)) {
-            std::vector<fs::path> formatted_paths;
-            for (auto& [path0, _] : ctx.paths_to_format_since) {
-                ctx.to_async_clang_format_queue.enqueue(
-                    ACFMsg{.command = ACFMsg::Command::Format,
-                           .path = path0,
-                           .completion = [&ctx](fs::path path, bool result) {
-                               if (result) {
-                                   // Use "now" if failed to query last write time (silently
-                                   // ignoring this rare error).
-                                   ctx.paths_formatted_at[path] =
-                                       fs_last_write_time_noexcept(path).value_or(
-                                           fs::file_time_type::clock::now());
-                                   nowide::cout << "Formatted " << path << "\n";
-                                   ctx.paths_to_format_since.erase(path);
-                               } else {
-                                   nowide::cout << "ERROR formatting " << path << "\n";
-                               }
-                           }});
-            }
-        } else if (auto* fo = std::any_cast<msg::FormatOne>(&msg)) {
-            ctx.to_async_clang_format_queue.enqueue(ACFMsg{
-                .command = ACFMsg::Command::Format,
-                .path = fo->path,
-                .completion = [&ctx](fs::path path, bool result) {
-                    if (result) {
-                        // Use "now" if failed to query last write time (silently ignoring this rare
-                        // error).
-                        ctx.paths_formatted_at[path] = fs_last_write_time_noexcept(path).value_or(
-                            fs::file_time_type::clock::now());
-                        nowide::cout << "Formatted " << path << "\n";
-                        ctx.paths_to_format_since.erase(path);
-                    } else {
-                        nowide::cout << "ERROR formatting " << path << "\n";
-                    }
-                }});
-        } else if (auto* to = std::any_cast<msg::TouchOne>(&msg)) {
-            std::error_code ec;
-            const auto now = fs::file_time_type::clock::now();
-            fs::last_write_time(to->path, now, ec);
-            if (!ec) {
-                // Assume touch is for formatted files.
-                auto it = ctx.paths_formatted_at.find(to->path);
-                if (it != ctx.paths_formatted_at.end()) {
-                    it->second = fs_last_write_time_noexcept(to->path).value_or(now);
-                } else {
-                    assert(false);
-                }
-            }
-        } else if (auto* acfr = std::any_cast<msg::AsyncClangFormatResult>(&msg)) {
-            acfr->completion();
-        } else {
-            fprintf(stderr, "Invalid message\n");
-            assert(false);
-        }
-        return ProcessMsgsResult::QueueWasNotEmpty;
-    }
-}
-
 int main_core(int argc, char* argv[]) {
     nowide::args _(argc, argv);
 
@@ -230,6 +165,104 @@ int main_core(int argc, char* argv[]) {
         if (ai.starts_with("-")) {
             if (ai == "-h" || ai == "--help") {
                 DisplayHelp();
+            } else if (ai == "-j" || ai == "--jobs") {
+                if (i + 1 >= argc) {
+                    nowide::cerr << "Missing argument after " << ai << "\n";
+                    return EXIT_FAILURE;
+                }
+                auto a = std::string_view(argv[++i]);
+                auto fcr = std::from_chars(a.data(), a.data() + a.size(), os.num_formatter_threads);
+                if (fcr.ec != std::errc() || os.num_formatter_threads < 1) {
+                    nowide::cerr << "Invalid number of jobs: " << a << "\n";
+                    return EXIT_FAILURE;
+                }
+            } else if (ai == "--backend") {
+                if (i + 1 >= argc) {
+                    nowide::cerr << "Missing argument after " << ai << "\n";
+                    return EXIT_FAILURE;
+                }
+                auto a = std::string_view(argv[++i]);
+                if (a == "auto") {
+                    os.clang_format_backend = ClangFormatBackend::Auto;
+                } else if (a == "process") {
+                    os.clang_format_backend = ClangFormatBackend::Process;
+                } else if (a == "lib") {
+                    os.clang_format_backend = ClangFormatBackend::Library;
+                } else {
+                    nowide::cerr << "Invalid backend: " << a << "\n";
+                    return EXIT_FAILURE;
+                }
+            } else if (ai == "--cache-file") {
+                if (i + 1 >= argc) {
+                    nowide::cerr << "Missing argument after " << ai << "\n";
+                    return EXIT_FAILURE;
+                }
+                os.verified_cache_file = PathFromUtf8(argv[++i]);
+            } else if (ai == "--no-cache") {
+                os.use_verified_cache = false;
+            } else if (ai == "--no-incremental") {
+                os.incremental_formatting = false;
+            } else if (ai == "--add-all") {
+                os.add_all_on_start = true;
+            } else if (ai == "--add-changed") {
+                os.add_changed_on_start = true;
+            } else if (ai == "--check-staged") {
+                os.check_staged = true;
+            } else if (ai == "--include" || ai == "--exclude") {
+                if (i + 1 >= argc) {
+                    nowide::cerr << "Missing argument after " << ai << "\n";
+                    return EXIT_FAILURE;
+                }
+                (ai == "--include" ? os.include_globs : os.exclude_globs).push_back(argv[++i]);
+            } else if (ai == "--no-gitignore") {
+                os.use_gitignore = false;
+            } else if (ai == "--metrics-file") {
+                if (i + 1 >= argc) {
+                    nowide::cerr << "Missing argument after " << ai << "\n";
+                    return EXIT_FAILURE;
+                }
+                os.metrics_file = PathFromUtf8(argv[++i]);
+            } else if (ai == "--watcher") {
+                if (i + 1 >= argc) {
+                    nowide::cerr << "Missing argument after " << ai << "\n";
+                    return EXIT_FAILURE;
+                }
+                auto a = std::string_view(argv[++i]);
+                if (a == "fswatch") {
+                    os.file_watcher = FileWatcher::Fswatch;
+#if defined(__linux__)
+                } else if (a == "inotify") {
+                    os.file_watcher = FileWatcher::Inotify;
+                } else if (a == "fanotify") {
+                    os.file_watcher = FileWatcher::Fanotify;
+#endif
+                } else {
+                    nowide::cerr << "Invalid watcher: " << a << "\n";
+                    return EXIT_FAILURE;
+                }
+            } else if (ai == "--max-watches") {
+                if (i + 1 >= argc) {
+                    nowide::cerr << "Missing argument after " << ai << "\n";
+                    return EXIT_FAILURE;
+                }
+                auto a = std::string_view(argv[++i]);
+                auto fcr = std::from_chars(a.data(), a.data() + a.size(), os.max_watches);
+                if (fcr.ec != std::errc() || os.max_watches < 1) {
+                    nowide::cerr << "Invalid number of watches: " << a << "\n";
+                    return EXIT_FAILURE;
+                }
+            } else if (ai == "--socket") {
+                if (i + 1 >= argc) {
+                    nowide::cerr << "Missing argument after " << ai << "\n";
+                    return EXIT_FAILURE;
+                }
+                os.ipc_socket = PathFromUtf8(argv[++i]);
+            } else if (ai == "--no-socket") {
+                os.use_ipc = false;
+            } else if (ai == "--headless") {
+                os.headless = true;
+            } else if (ai == "--auto-format") {
+                os.auto_format = true;
             } else {
                 nowide::cerr << "Invalid option: " << ai << "\n";
                 return EXIT_FAILURE;
@@ -241,25 +274,36 @@ int main_core(int argc, char* argv[]) {
                 std::cerr << "Can't convert path to absolute: " << argv[i] << "\n";
                 return EXIT_FAILURE;
             }
-            fmt::print("{} -> abs -> {}\n", ai, abs_path.string());
+            fmt::print(stderr, "{} -> abs -> {}\n", ai, abs_path.string());
             os.paths.push_back(abs_path.string());
         }
     }
 
+    if (os.paths.empty() && os.check_staged) {
+        os.paths.push_back(fs::current_path());
+    }
     if (os.paths.empty()) {
         nowide::cerr << "No path specified.\n";
         return EXIT_FAILURE;
     }
 
-    auto clang_format = ClangFormat::make();
-    if (!clang_format) {
+    auto clang_format_or_null =
+        ClangFormat::make(os.clang_format_backend, ctx.clang_format_config_cache);
+    if (!clang_format_or_null) {
         return EXIT_FAILURE;
     }
-    ctx.async_clang_format = std::thread(AsyncClangFormat,
-                                         std::move(*clang_format),
-                                         &ctx.to_async_clang_format_queue,
-                                         &ctx.to_app_queue,
-                                         &ctx.exit_flag);
+    auto clang_format = std::move(*clang_format_or_null);
+    if (os.incremental_formatting) {
+        clang_format =
+            make_incremental_clang_format(std::move(clang_format), ctx.clang_format_config_cache);
+    }
+    if (os.use_verified_cache) {
+        ctx.verified_cache = std::make_shared<VerifiedCache>(
+            os.verified_cache_file.value_or(VerifiedCache::default_file()),
+            clang_format->version());
+        clang_format = make_verifying_clang_format(
+            std::move(clang_format), ctx.verified_cache, ctx.clang_format_config_cache);
+    }
 
     int n_invalid_paths = 0;
     for (auto& p : os.paths) {
@@ -275,18 +319,51 @@ int main_core(int argc, char* argv[]) {
         return EXIT_FAILURE;
     }
 
-    auto ui = make_ui_glfw_imgui(ctx, ctx.to_app_queue);
+    if (os.check_staged) {
+        InitDirScanning(ctx);
+        return CheckStagedFiles(ctx, *clang_format);
+    }
+
+#if CLAFORD_WITH_GUI
+    auto ui = os.headless ? make_ui_headless(ctx, ctx.to_app_queue, os.auto_format)
+                          : make_ui_glfw_imgui(ctx, ctx.to_app_queue);
+#else
+    auto ui = make_ui_headless(ctx, ctx.to_app_queue, os.auto_format);
+#endif
     if (!ui) {
         return EXIT_FAILURE;
     }
+    ctx.on_file_status_changed = [ui = ui.get()](FileId file) {
+        ui->file_status_changed(file);
+    };
+    InitDirScanning(ctx);
+    if (os.add_all_on_start) {
+        ctx.to_app_queue.enqueue(msg::AddAll{});
+    }
+    if (os.add_changed_on_start) {
+        ctx.to_app_queue.enqueue(msg::AddChanged{});
+    }
 
     std::vector<std::string> paths;
     paths.reserve(paths.size());
     for (auto& p : os.paths) {
         paths.push_back(ToUtf8(p));
     }
-    auto* monitor = fsw::monitor_factory::create_monitor(
-        fsw_monitor_type::system_default_monitor_type, paths, fsw_event_callback, &ctx);
+    fsw::monitor* monitor = nullptr;
+#if defined(__linux__)
+    if (os.file_watcher != FileWatcher::Fswatch) {
+        monitor = new LinuxMonitor(paths,
+                                   fsw_event_callback,
+                                   &ctx,
+                                   os.file_watcher == FileWatcher::Fanotify,
+                                   os.max_watches,
+                                   ctx.path_filter);
+    }
+#endif
+    if (!monitor) {
+        monitor = fsw::monitor_factory::create_monitor(
+            fsw_monitor_type::system_default_monitor_type, paths, fsw_event_callback, &ctx);
+    }
 
     if (!monitor) {
         std::cerr << "ERROR: couldn't create system default filesystem monitor\n";
@@ -296,28 +373,57 @@ int main_core(int argc, char* argv[]) {
     monitor->set_latency(k_monitor_latency_sec);
     monitor->set_recursive(true);
 
+    StartFormatterThreads(ctx, *clang_format, os.num_formatter_threads);
+
+#if !defined(_WIN32)
+    std::unique_ptr<IpcServer> ipc_server;
+    if (os.use_ipc) {
+        ipc_server = std::make_unique<IpcServer>(os.ipc_socket.value_or(DefaultIpcSocketPath()),
+                                                 ctx.to_app_queue);
+        if (ipc_server->start()) {
+            ctx.ipc_send = [server = ipc_server.get()](IpcClientId client, std::string line) {
+                server->send(client, std::move(line));
+            };
+        } else {
+            // Not fatal, the files are still formatted.
+            fmt::print(stderr, "The local API is off.\n");
+            ipc_server.reset();
+        }
+    }
+#endif
+
     std::signal(SIGINT, signal_handler);
 
     auto monitor_thread = std::thread([monitor]() {
         monitor->start();  // Enters event loop, returns when stopped.
     });
 
-    fmt::print("claford is running, CTRL-C to exit...\n");
+    fmt::print(stderr, "claford is running, CTRL-C to exit...\n");
     ui->exec([&ctx]() {
         return ProcessMsgs(ctx);
     });
 
-    ctx.exit_flag = true;
     monitor->stop();
-
-    if (ctx.async_clang_format.joinable()) {
-        ctx.async_clang_format.join();
+    // The formatter threads answer format_buffer requests through the server.
+    StopThreads(ctx);
+#if !defined(_WIN32)
+    if (ipc_server) {
+        ipc_server->stop();
     }
+#endif
 
     if (monitor_thread.joinable()) {
         monitor_thread.join();
     }
 
+    if (ctx.verified_cache) {
+        ctx.verified_cache->save();
+    }
+    if (os.metrics_file) {
+        WriteMetricsFile(ctx);
+    }
+    PrintQueueWaitStats();
+
     return EXIT_SUCCESS;
 }
 
@@ -0,0 +1,189 @@
+#include "metrics.h"
+
+#include "util.h"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+namespace chr = std::chrono;
+
+Metrics g_metrics;
+
+namespace {
+// Prometheus histogram buckets: powers of two up to about an hour.
+constexpr int k_max_prometheus_bucket_log2_usec = 32;
+
+double ToSeconds(Histogram::Duration d) {
+    return chr::duration<double>(d).count();
+}
+
+double ToMilliseconds(Histogram::Duration d) {
+    return chr::duration<double, std::milli>(d).count();
+}
+}  // namespace
+
+void UpdateMax(std::atomic<uint64_t>& max_value, uint64_t value) {
+    auto m = max_value.load(std::memory_order_relaxed);
+    while (m < value && !max_value.compare_exchange_weak(m, value, std::memory_order_relaxed)) {
+    }
+}
+
+size_t Histogram::bucket_of_usec(uint64_t usec) {
+    if (usec < k_linear_buckets) {
+        return size_t(usec);
+    }
+    const auto e = size_t(std::bit_width(usec)) - 1;  // >= 4
+    const auto sub = size_t(usec >> (e - 3)) & (k_sub_buckets - 1);
+    return k_linear_buckets + (e - 4) * k_sub_buckets + sub;
+}
+
+uint64_t Histogram::bucket_upper_bound_usec(size_t bucket) {
+    if (bucket < k_linear_buckets) {
+        return bucket + 1;
+    }
+    const auto e = (bucket - k_linear_buckets) / k_sub_buckets + 4;
+    const auto sub = (bucket - k_linear_buckets) % k_sub_buckets;
+    if (e == 63 && sub == k_sub_buckets - 1) {
+        return UINT64_MAX;
+    }
+    return uint64_t(k_sub_buckets + sub + 1) << (e - 3);
+}
+
+void Histogram::add(Duration d) {
+    const auto rep = std::max<Duration::rep>(0, d.count());
+    const auto usec = uint64_t(chr::duration_cast<chr::microseconds>(Duration(rep)).count());
+    buckets[bucket_of_usec(usec)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(rep, std::memory_order_relaxed);
+    auto m = max_value.load(std::memory_order_relaxed);
+    while (m < rep && !max_value.compare_exchange_weak(m, rep, std::memory_order_relaxed)) {
+    }
+    n.fetch_add(1, std::memory_order_relaxed);
+}
+
+Histogram::Duration Histogram::mean() const {
+    const auto c = count();
+    return c == 0 ? Duration{} : sum() / int64_t(c);
+}
+
+Histogram::Duration Histogram::percentile(double p) const {
+    const auto c = count();
+    if (c == 0) {
+        return Duration{};
+    }
+    const auto rank = std::max<uint64_t>(1, uint64_t(std::ceil(double(c) * p / 100)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < k_num_buckets; ++i) {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            auto upper_bound = bucket_upper_bound_usec(i);
+            if (upper_bound > uint64_t(chr::duration_cast<chr::microseconds>(max()).count())) {
+                return max();
+            }
+            return chr::duration_cast<Duration>(chr::microseconds(upper_bound));
+        }
+    }
+    return max();
+}
+
+uint64_t Histogram::count_up_to_usec(uint64_t usec) const {
+    uint64_t result = 0;
+    for (size_t i = 0; i < k_num_buckets && bucket_upper_bound_usec(i) <= usec; ++i) {
+        result += buckets[i].load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+std::vector<Metrics::NamedHistogram> Metrics::histograms() const {
+    std::vector<NamedHistogram> result = {
+        {"event_to_enqueue", "", &event_to_enqueue},
+    };
+    for (size_t i = 0; i < k_num_job_priorities; ++i) {
+        result.push_back(
+            {"queue_wait",
+             fmt::format("lane=\"{}\"", JobPriorityName(JobPriority(i))),
+             &queue_wait[i]});
+    }
+    result.insert(result.end(),
+                  {{"process_spawn", "", &process_spawn},
+                   {"clang_format_run", "", &clang_format_run},
+                   {"completion_to_ui", "", &completion_to_ui},
+                   {"ipc_request", "", &ipc_request},
+                   {"frame_time", "", &frame_time}});
+    return result;
+}
+
+std::vector<Metrics::Value> Metrics::values(uint64_t app_queue_depth,
+                                            uint64_t job_queue_depth) const {
+    return {{"fs_events_total", fs_events, true},
+            {"fs_overflows_total", fs_overflows, true},
+            {"self_write_events_total", self_write_events, true},
+            {"jobs_run_total", jobs_run, true},
+            {"jobs_skipped_total", jobs_skipped, true},
+            {"processes_spawned_total", processes_spawned, true},
+            {"app_queue_depth", app_queue_depth, false},
+            {"app_queue_max_depth", app_queue_max_depth, false},
+            {"job_queue_depth", job_queue_depth, false},
+            {"job_queue_max_depth", job_queue_max_depth, false}};
+}
+
+std::string MetricsToPrometheus(const Metrics& m,
+                                uint64_t app_queue_depth,
+                                uint64_t job_queue_depth) {
+    std::string r;
+    const char* last_name = "";
+    for (auto& [name, labels, h] : m.histograms()) {
+        if (std::string_view(name) != last_name) {
+            r += fmt::format("# TYPE claford_{}_seconds histogram\n", name);
+            last_name = name;
+        }
+        const auto sep = labels.empty() ? "" : ",";
+        for (int i = 0; i <= k_max_prometheus_bucket_log2_usec; ++i) {
+            const auto usec = uint64_t(1) << i;
+            r += fmt::format("claford_{}_seconds_bucket{{{}{}le=\"{}\"}} {}\n",
+                             name,
+                             labels,
+                             sep,
+                             double(usec) / 1e6,
+                             h->count_up_to_usec(usec));
+        }
+        r += fmt::format(
+            "claford_{}_seconds_bucket{{{}{}le=\"+Inf\"}} {}\n", name, labels, sep, h->count());
+        const auto braced_labels = labels.empty() ? std::string() : "{" + labels + "}";
+        r += fmt::format("claford_{}_seconds_sum{} {}\n", name, braced_labels, ToSeconds(h->sum()));
+        r += fmt::format("claford_{}_seconds_count{} {}\n", name, braced_labels, h->count());
+    }
+    for (auto& v : m.values(app_queue_depth, job_queue_depth)) {
+        r += fmt::format("# TYPE claford_{} {}\n", v.name, v.is_counter ? "counter" : "gauge");
+        r += fmt::format("claford_{} {}\n", v.name, v.value);
+    }
+    return r;
+}
+
+std::string MetricsToJson(const Metrics& m, uint64_t app_queue_depth, uint64_t job_queue_depth) {
+    std::string r = "{\"histograms_ms\":[";
+    bool first = true;
+    for (auto& [name, labels, h] : m.histograms()) {
+        r += fmt::format(
+            "{}{{\"name\":{},\"labels\":{},\"count\":{},\"mean\":{:.3f},\"p50\":{:.3f},"
+            "\"p90\":{:.3f},\"p99\":{:.3f},\"max\":{:.3f}}}",
+            first ? "" : ",",
+            json_quote(name),
+            json_quote(labels),
+            h->count(),
+            ToMilliseconds(h->mean()),
+            ToMilliseconds(h->percentile(50)),
+            ToMilliseconds(h->percentile(90)),
+            ToMilliseconds(h->percentile(99)),
+            ToMilliseconds(h->max()));
+        first = false;
+    }
+    r += "]";
+    for (auto& v : m.values(app_queue_depth, job_queue_depth)) {
+        r += fmt::format(",{}:{}", json_quote(v.name), v.value);
+    }
+    r += "}\n";
+    return r;
+}
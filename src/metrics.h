@@ -0,0 +1,97 @@
+#pragma once
+
+#include "job_queue.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Lock-free histogram of durations with HDR-style buckets: exact below 16 usec, then 8 buckets per
+// power of two (at most 12.5% relative error).
+class Histogram {
+   public:
+    using Duration = std::chrono::steady_clock::duration;
+
+    void add(Duration d);
+    uint64_t count() const {
+        return n;
+    }
+    Duration sum() const {
+        return Duration(total.load());
+    }
+    Duration mean() const;
+    Duration max() const {
+        return Duration(max_value.load());
+    }
+    // Upper bound of the bucket containing the `p`-th percentile (0 < p <= 100).
+    Duration percentile(double p) const;
+    // Number of values <= `usec`, rounded to bucket boundaries.
+    uint64_t count_up_to_usec(uint64_t usec) const;
+
+   private:
+    static constexpr size_t k_linear_buckets = 16;
+    static constexpr size_t k_sub_buckets = 8;
+    static constexpr size_t k_num_buckets = k_linear_buckets + (64 - 4) * k_sub_buckets;
+
+    static size_t bucket_of_usec(uint64_t usec);
+    static uint64_t bucket_upper_bound_usec(size_t bucket);
+
+    std::atomic<uint64_t> n = 0;
+    std::atomic<Duration::rep> total = 0;
+    std::atomic<Duration::rep> max_value = 0;
+    std::array<std::atomic<uint64_t>, k_num_buckets> buckets = {};
+};
+
+// Timings and counters of the pipeline, recorded from any thread.
+struct Metrics {
+    // File monitor callback to the job entering the formatter queue.
+    Histogram event_to_enqueue;
+    // Time spent in the formatter queue, per lane.
+    std::array<Histogram, k_num_job_priorities> queue_wait;
+    // Starting a clang-format process.
+    Histogram process_spawn;
+    // A batch of jobs in the formatter (process or library), per batch.
+    Histogram clang_format_run;
+    // Job finished to the result applied on the app thread.
+    Histogram completion_to_ui;
+    // A local API request read to its response handed to the server, not counting "format" waits.
+    Histogram ipc_request;
+    Histogram frame_time;
+
+    std::atomic<uint64_t> fs_events = 0;
+    std::atomic<uint64_t> fs_overflows = 0;       // Events lost by the file monitor.
+    std::atomic<uint64_t> self_write_events = 0;  // Events of formatting, dropped.
+    std::atomic<uint64_t> jobs_run = 0;
+    std::atomic<uint64_t> jobs_skipped = 0;  // Superseded.
+    std::atomic<uint64_t> processes_spawned = 0;
+    std::atomic<uint64_t> app_queue_max_depth = 0;
+    std::atomic<uint64_t> job_queue_max_depth = 0;
+
+    struct NamedHistogram {
+        const char* name;
+        std::string labels;  // Prometheus style, without braces, may be empty.
+        const Histogram* histogram;
+    };
+    std::vector<NamedHistogram> histograms() const;
+
+    struct Value {
+        const char* name;
+        uint64_t value;
+        bool is_counter;  // Otherwise gauge.
+    };
+    // Counters and gauges, with the current queue depths.
+    std::vector<Value> values(uint64_t app_queue_depth, uint64_t job_queue_depth) const;
+};
+
+extern Metrics g_metrics;
+
+void UpdateMax(std::atomic<uint64_t>& max_value, uint64_t value);
+
+// Prometheus text exposition format, durations in seconds.
+std::string MetricsToPrometheus(const Metrics& m,
+                                uint64_t app_queue_depth,
+                                uint64_t job_queue_depth);
+std::string MetricsToJson(const Metrics& m, uint64_t app_queue_depth, uint64_t job_queue_depth);
@@ -0,0 +1,359 @@
+#include "path_filter.h"
+
+#include <algorithm>
+#include <optional>
+
+namespace fs = std::filesystem;
+
+namespace {
+// UTF-8 with '/' separators, as in .gitignore files.
+std::string GenericUtf8(const fs::path& path) {
+    auto s = ToUtf8(path);
+    if constexpr (fs::path::preferred_separator != '/') {
+        std::replace(BE(s), char(fs::path::preferred_separator), '/');
+    }
+    return s;
+}
+
+bool HasWildcards(std::string_view s) {
+    return s.find_first_of("*?[\\") != std::string_view::npos;
+}
+
+// Matches `s` against a "[...]" class at the start of `pattern`. Returns the length of the class
+// or nullopt if it's not a valid class (then '[' is a literal).
+std::optional<size_t> MatchClass(std::string_view pattern, char c, bool& matched) {
+    size_t i = 1;
+    bool negated = false;
+    if (i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^')) {
+        negated = true;
+        ++i;
+    }
+    bool found = false;
+    bool first = true;
+    for (; i < pattern.size(); first = false) {
+        if (pattern[i] == ']' && !first) {
+            matched = found != negated && c != '/';
+            return i + 1;
+        }
+        char lo = pattern[i];
+        if (lo == '\\' && i + 1 < pattern.size()) {
+            lo = pattern[++i];
+        }
+        ++i;
+        char hi = lo;
+        if (i + 1 < pattern.size() && pattern[i] == '-' && pattern[i + 1] != ']') {
+            hi = pattern[i + 1];
+            if (hi == '\\' && i + 2 < pattern.size()) {
+                hi = pattern[++i + 1];
+            }
+            i += 2;
+        }
+        found = found || (lo <= c && c <= hi);
+    }
+    return std::nullopt;
+}
+}  // namespace
+
+bool GlobMatch(std::string_view pattern, std::string_view s) {
+    while (!pattern.empty()) {
+        if (pattern.starts_with("**")) {
+            auto rest = pattern.substr(2);
+            if (rest.starts_with('/')) {
+                // "**/": zero or more leading directories.
+                rest.remove_prefix(1);
+                for (size_t i = 0;; ++i) {
+                    if (GlobMatch(rest, s.substr(i))) {
+                        return true;
+                    }
+                    i = s.find('/', i);
+                    if (i == std::string_view::npos) {
+                        return false;
+                    }
+                }
+            }
+            for (size_t i = 0; i <= s.size(); ++i) {
+                if (GlobMatch(rest, s.substr(i))) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        switch (pattern[0]) {
+            case '*': {
+                auto rest = pattern.substr(1);
+                for (size_t i = 0; i <= s.size(); ++i) {
+                    if (GlobMatch(rest, s.substr(i))) {
+                        return true;
+                    }
+                    if (i < s.size() && s[i] == '/') {
+                        return false;
+                    }
+                }
+                return false;
+            }
+            case '?':
+                if (s.empty() || s[0] == '/') {
+                    return false;
+                }
+                pattern.remove_prefix(1);
+                s.remove_prefix(1);
+                continue;
+            case '[': {
+                if (s.empty()) {
+                    return false;
+                }
+                bool matched = false;
+                if (auto n = MatchClass(pattern, s[0], matched)) {
+                    if (!matched) {
+                        return false;
+                    }
+                    pattern.remove_prefix(*n);
+                    s.remove_prefix(1);
+                    continue;
+                }
+                break;
+            }
+            case '\\':
+                if (pattern.size() > 1) {
+                    pattern.remove_prefix(1);
+                }
+                break;
+            default:
+                break;
+        }
+        if (s.empty() || s[0] != pattern[0]) {
+            return false;
+        }
+        pattern.remove_prefix(1);
+        s.remove_prefix(1);
+    }
+    return s.empty();
+}
+
+// A line of a .gitignore file, or a user glob.
+struct PathFilter::Rule {
+    // Literal: no wildcards, compared as is. Suffix: "*" followed by a literal, matched against
+    // the filename ("*.o"). Glob: anything else.
+    enum class Kind { Literal, Suffix, Glob };
+
+    Kind kind;
+    std::string pattern;  // For Suffix without the '*'.
+    bool negated = false;
+    bool dir_only = false;
+    bool anchored = false;  // Matched against the relative path, otherwise against the filename.
+
+    static std::optional<Rule> parse(std::string_view line) {
+        if (line.ends_with('\r')) {
+            line.remove_suffix(1);
+        }
+        // Trailing spaces are ignored unless escaped.
+        while (line.ends_with(' ') && !line.ends_with("\\ ")) {
+            line.remove_suffix(1);
+        }
+        if (line.empty() || line.starts_with('#')) {
+            return std::nullopt;
+        }
+        Rule r;
+        if (line.starts_with('!')) {
+            r.negated = true;
+            line.remove_prefix(1);
+        }
+        if (line.ends_with('/')) {
+            r.dir_only = true;
+            line.remove_suffix(1);
+        }
+        if (line.find('/') != std::string_view::npos) {
+            r.anchored = true;
+            if (line.starts_with('/')) {
+                line.remove_prefix(1);
+            }
+        }
+        if (line.empty()) {
+            return std::nullopt;
+        }
+        if (!HasWildcards(line)) {
+            r.kind = Kind::Literal;
+            r.pattern = line;
+        } else if (!r.anchored && line.starts_with('*') && !HasWildcards(line.substr(1))) {
+            r.kind = Kind::Suffix;
+            r.pattern = line.substr(1);
+        } else {
+            r.kind = Kind::Glob;
+            r.pattern = line;
+        }
+        return r;
+    }
+
+    // `relative_path` is relative to the directory of the rule.
+    bool matches(std::string_view relative_path, bool is_dir) const {
+        if (dir_only && !is_dir) {
+            return false;
+        }
+        auto s = relative_path;
+        if (!anchored) {
+            if (auto slash = s.rfind('/'); slash != std::string_view::npos) {
+                s.remove_prefix(slash + 1);
+            }
+        }
+        switch (kind) {
+            case Kind::Literal:
+                return s == pattern;
+            case Kind::Suffix:
+                return s.ends_with(pattern);
+            case Kind::Glob:
+                return GlobMatch(pattern, s);
+        }
+        return false;
+    }
+};
+
+// The rules of a directory's .gitignore, linked to the ones of the parent directory.
+struct PathFilter::DirRules {
+    std::string dir;                         // GenericUtf8.
+    std::shared_ptr<const DirRules> parent;  // nullptr at the top of the git work tree.
+    std::vector<Rule> rules;
+    bool excluded = false;  // The directory itself is excluded.
+
+    // Whether `path` in `dir` is ignored by this or the parents' rules. Deeper .gitignore files and
+    // later lines take precedence.
+    bool ignores(const std::string& path, bool is_dir) const {
+        for (auto* dr = this; dr; dr = dr->parent.get()) {
+            if (dr->rules.empty()) {
+                continue;
+            }
+            auto prefix_length = dr->dir.size() + (dr->dir.ends_with('/') ? 0 : 1);
+            if (path.size() <= prefix_length) {
+                continue;
+            }
+            auto relative_path = std::string_view(path).substr(prefix_length);
+            for (auto it = dr->rules.rbegin(); it != dr->rules.rend(); ++it) {
+                if (it->matches(relative_path, is_dir)) {
+                    return !it->negated;
+                }
+            }
+        }
+        return false;
+    }
+};
+
+PathFilter::PathFilter(const std::vector<fs::path>& roots0,
+                       const std::vector<std::string>& include_globs,
+                       const std::vector<std::string>& exclude_globs,
+                       bool use_gitignore)
+    : use_gitignore(use_gitignore) {
+    for (auto r : roots0) {
+        if (!r.has_filename() && r.has_parent_path()) {
+            r = r.parent_path();  // Trailing separator.
+        }
+        std::error_code ec;
+        auto c = fs::canonical(r, ec);
+        roots.push_back(std::move(r));
+        if (!ec && c != roots.back()) {
+            roots.push_back(std::move(c));
+        }
+    }
+    for (auto& g : include_globs) {
+        if (auto r = Rule::parse(g)) {
+            include_rules.push_back(std::move(*r));
+        }
+    }
+    for (auto& g : exclude_globs) {
+        if (auto r = Rule::parse(g)) {
+            exclude_rules.push_back(std::move(*r));
+        }
+    }
+}
+
+PathFilter::~PathFilter() = default;
+
+bool PathFilter::is_excluded(const fs::path& path, bool is_dir) {
+    if (!exclude_rules.empty() || (!include_rules.empty() && !is_dir)) {
+        auto relative_path = relative_to_root(path);
+        auto matches_exclude_rule = [this](std::string_view p, bool d) {
+            return std::any_of(BE(exclude_rules), [p, d](const Rule& r) {
+                return r.matches(p, d);
+            });
+        };
+        // The parent directories first.
+        for (auto i = relative_path.find('/'); i != std::string::npos;
+             i = relative_path.find('/', i + 1)) {
+            if (matches_exclude_rule(std::string_view(relative_path).substr(0, i), true)) {
+                return true;
+            }
+        }
+        if (matches_exclude_rule(relative_path, is_dir)) {
+            return true;
+        }
+        if (!include_rules.empty() && !is_dir
+            && std::none_of(BE(include_rules), [&relative_path](const Rule& r) {
+                   return r.matches(relative_path, false);
+               })) {
+            return true;
+        }
+    }
+    if (is_dir && path.filename() == ".git") {
+        return true;
+    }
+    if (!path.has_parent_path() || path.parent_path() == path) {
+        return false;
+    }
+    auto parent = rules_of_dir(path.parent_path());
+    return parent->excluded || parent->ignores(GenericUtf8(path), is_dir);
+}
+
+void PathFilter::invalidate() {
+    std::lock_guard lock(mutex);
+    dir_rules.clear();
+}
+
+std::shared_ptr<const PathFilter::DirRules> PathFilter::rules_of_dir(const fs::path& dir) {
+    {
+        std::lock_guard lock(mutex);
+        if (auto it = dir_rules.find(dir); it != dir_rules.end()) {
+            return it->second;
+        }
+    }
+    // Built without the lock, racing threads may build the same rules.
+    auto dr = std::make_shared<DirRules>();
+    dr->dir = GenericUtf8(dir);
+    const bool is_top = !dir.has_parent_path() || dir.parent_path() == dir
+                     || (use_gitignore && fs_exists_noexcept(dir / ".git"));
+    if (!is_top) {
+        dr->parent = rules_of_dir(dir.parent_path());
+        dr->excluded = !is_root(dir)
+                    && (dr->parent->excluded || dir.filename() == ".git"
+                        || dr->parent->ignores(dr->dir, true));
+    }
+    if (use_gitignore && !dr->excluded) {
+        if (auto content = fs_read_file_noexcept(dir / ".gitignore")) {
+            std::string_view sv = *content;
+            while (!sv.empty()) {
+                auto eol = std::min(sv.find('\n'), sv.size());
+                if (auto r = Rule::parse(sv.substr(0, eol))) {
+                    dr->rules.push_back(std::move(*r));
+                }
+                sv.remove_prefix(std::min(eol + 1, sv.size()));
+            }
+        }
+    }
+    std::lock_guard lock(mutex);
+    return dir_rules.try_emplace(dir, std::move(dr)).first->second;
+}
+
+bool PathFilter::is_root(const fs::path& dir) const {
+    return std::find(BE(roots), dir) != roots.end();
+}
+
+std::string PathFilter::relative_to_root(const fs::path& path) const {
+    for (auto& r : roots) {
+        auto [rit, pit] = std::mismatch(r.begin(), r.end(), path.begin(), path.end());
+        if (rit == r.end() && pit != path.end()) {
+            fs::path relative_path;
+            for (; pit != path.end(); ++pit) {
+                relative_path /= *pit;
+            }
+            return GenericUtf8(relative_path);
+        }
+    }
+    return GenericUtf8(path.filename());
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "util.h"
+
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Returns whether `s` matches the .gitignore-style glob `pattern`: '*' and '?' don't match '/',
+// "**" matches any number of directories, "[...]" is a character class and '\' escapes.
+bool GlobMatch(std::string_view pattern, std::string_view s);
+
+// Decides which paths under the watched roots are left alone: the ones ignored by the .gitignore
+// files (from the top of the git work tree down) or matched by one of the exclude globs, and the
+// files not matched by any of the include globs, if there are include globs. Excluding a directory
+// excludes everything in it. The globs are relative to the watched root. The rules of a directory
+// are loaded once and kept in a per-directory rule stack. Thread-safe.
+class PathFilter {
+   public:
+    PathFilter(const std::vector<std::filesystem::path>& roots,
+               const std::vector<std::string>& include_globs,
+               const std::vector<std::string>& exclude_globs,
+               bool use_gitignore);
+    ~PathFilter();
+
+    bool is_excluded(const std::filesystem::path& path, bool is_dir);
+    // Drops the loaded .gitignore files, to be called when one of them changes.
+    void invalidate();
+
+   private:
+    struct Rule;
+    struct DirRules;
+
+    std::shared_ptr<const DirRules> rules_of_dir(const std::filesystem::path& dir);
+    bool is_root(const std::filesystem::path& dir) const;
+    // The path relative to the watched root containing it, or its filename if there's no such root.
+    std::string relative_to_root(const std::filesystem::path& path) const;
+
+    std::vector<std::filesystem::path> roots;  // As given and canonical.
+    std::vector<Rule> include_rules, exclude_rules;
+    const bool use_gitignore;
+
+    std::mutex mutex;
+    std::unordered_map<std::filesystem::path, std::shared_ptr<const DirRules>> dir_rules;
+};
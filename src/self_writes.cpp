@@ -0,0 +1,40 @@
+#include "self_writes.h"
+
+#include "util.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+// The events of a write arrive within the monitor's latency, older entries are dropped.
+constexpr auto k_max_entry_age = std::chrono::seconds(10);
+}  // namespace
+
+void SelfWrites::record(const fs::path& path, uint64_t content_hash) {
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard lock(mutex);
+    if (now - pruned_at >= k_max_entry_age) {
+        std::erase_if(entries, [now](const auto& kv) {
+            return now - kv.second.recorded_at >= k_max_entry_age;
+        });
+        pruned_at = now;
+    }
+    entries.insert_or_assign(path, Entry{content_hash, now});
+}
+
+bool SelfWrites::is_own_write(const fs::path& path) {
+    {
+        std::lock_guard lock(mutex);
+        if (!entries.contains(path)) {
+            return false;
+        }
+    }
+    // Not under the lock, reads the file.
+    const auto content = fs_read_file_noexcept(path);
+    if (!content) {
+        return false;
+    }
+    const auto content_hash = hash64(*content);
+    std::lock_guard lock(mutex);
+    auto it = entries.find(path);
+    return it != entries.end() && it->second.content_hash == content_hash;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <unordered_map>
+
+// Thread-safe record of the files claford has written, so the file monitor can drop the events of
+// its own writes. A write is recognized as long as the file still has the content written, by the
+// hash the formatter returned rather than by a stat after the fact: a save right after the write
+// would be taken for the write.
+class SelfWrites {
+   public:
+    // Called after formatting `path`, `content_hash` is the hash64 of the content left in it.
+    void record(const std::filesystem::path& path, uint64_t content_hash);
+    // Whether `path` still has the content of the last `record`.
+    bool is_own_write(const std::filesystem::path& path);
+
+   private:
+    struct Entry {
+        uint64_t content_hash;
+        std::chrono::steady_clock::time_point recorded_at;
+    };
+
+    std::mutex mutex;
+    std::unordered_map<std::filesystem::path, Entry> entries;
+    std::chrono::steady_clock::time_point pruned_at;
+};
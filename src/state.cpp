@@ -1 +1,37 @@
 #include "state.h"
+
+#include <algorithm>
+
+bool ToAppQueue::enqueue_result(msg::AsyncClangFormatResult result,
+                                const std::atomic<bool>& exit_flag) {
+    {
+        std::unique_lock lock(results_mutex);
+        results_cv.wait(lock, [this, &exit_flag]() {
+            return num_pending_results < k_max_pending_results || exit_flag;
+        });
+        ++num_pending_results;
+    }
+    return enqueue(std::move(result));
+}
+
+size_t ToAppQueue::try_dequeue_bulk(AppMsg* out, size_t max_n) {
+    const auto n = queue.try_dequeue_bulk(out, max_n);
+    const auto num_results =
+        size_t(std::count_if(out, out + n, [](const AppMsg& m) {
+            return std::holds_alternative<msg::AsyncClangFormatResult>(m);
+        }));
+    if (num_results > 0) {
+        {
+            std::lock_guard lock(results_mutex);
+            num_pending_results -= std::min(num_results, num_pending_results);
+        }
+        results_cv.notify_all();
+    }
+    return n;
+}
+
+void ToAppQueue::wake_result_waiters() {
+    // Under the lock, a waiter can't miss the exit flag between checking it and waiting.
+    std::lock_guard lock(results_mutex);
+    results_cv.notify_all();
+}
@@ -1,34 +1,168 @@
 #pragma once
 
 #include "clang_format.h"
+#include "clang_format_config.h"
+#include "dir_scanner.h"
+#include "file_table.h"
+#include "ipc.h"
+#include "job_queue.h"
+#include "metrics.h"
+#include "path_filter.h"
+#include "self_writes.h"
+#include "util.h"
+#include "verified_cache.h"
 
 #include <moodycamel/concurrentqueue.h>
-#include <readerwriterqueue/readerwriterqueue.h>
 
-#include <any>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <set>
 #include <string>
 #include <unordered_map>
+#include <variant>
 #include <vector>
 
-struct ACFMsg {
-    enum class Command { CheckFormat, Format };
-
-    Command command;
+namespace msg {
+struct FormatAll {};
+struct AddAll {};
+// Adds the files git reports as changed from HEAD, see git_status.h.
+struct AddChanged {};
+// A batch of files found by the `DirScanner`.
+struct FilesFound {
+    std::vector<FoundFile> files;
+};
+struct FileChanged {
     std::filesystem::path path;
-    std::function<void(std::filesystem::path, bool)> completion;
+    std::chrono::steady_clock::time_point received_at = std::chrono::steady_clock::now();
+};
+// The file monitor lost events in `dir`, or anywhere if it's empty.
+struct Rescan {
+    std::filesystem::path dir;
+};
+// All files found by rescanning `State::rescanning_dirs`.
+struct Rescanned {
+    std::vector<FoundFile> files;
+};
+struct FormatOne {
+    FileId file;
+};
+struct TouchOne {
+    FileId file;
+};
+// A formatter job finished, echoing the job's fields.
+struct AsyncClangFormatResult {
+    FileId file;
+    ACFMsg::Command command;
+    uint64_t generation;
+    // Of a check, or of the file after it was formatted.
+    std::filesystem::file_time_type last_write_time;
+    bool result;
+    std::chrono::steady_clock::time_point completed_at = std::chrono::steady_clock::now();
 };
+// From a local API client, see ipc.h.
+struct IpcRequestReceived {
+    IpcClientId client;
+    IpcRequest request;
+    std::chrono::steady_clock::time_point received_at = std::chrono::steady_clock::now();
+};
+struct IpcClientGone {
+    IpcClientId client;
+};
+}  // namespace msg
 
-using ToAppQueue = moodycamel::ConcurrentQueue<std::any>;
-using ToAsyncClangFormatQueue = moodycamel::BlockingReaderWriterQueue<ACFMsg>;
+// Messages are stored unboxed in the queue and dispatched with std::visit.
+using AppMsg = std::variant<msg::FormatAll,
+                            msg::AddAll,
+                            msg::AddChanged,
+                            msg::FilesFound,
+                            msg::FileChanged,
+                            msg::Rescan,
+                            msg::Rescanned,
+                            msg::FormatOne,
+                            msg::TouchOne,
+                            msg::AsyncClangFormatResult,
+                            msg::IpcRequestReceived,
+                            msg::IpcClientGone>;
 
-template<>
-struct std::hash<std::filesystem::path> {
-    size_t operator()(const std::filesystem::path& x) const noexcept {
-        const std::filesystem::path::string_type& s = x.native();
-        return std::hash<std::filesystem::path::string_type>()(s);
+// Messages to the app thread. Calls the wake function after each enqueue so the UI can sleep
+// until there's something to process.
+class ToAppQueue {
+   public:
+    bool enqueue(AppMsg msg) {
+        bool result = queue.enqueue(std::move(msg));
+        UpdateMax(g_metrics.app_queue_max_depth, queue.size_approx());
+        if (wake_fn) {
+            wake_fn();
+        }
+        return result;
     }
+    // For the formatter threads: waits while `k_max_pending_results` results are in the queue so
+    // they don't pile up faster than the app thread takes them, until `exit_flag` is set.
+    bool enqueue_result(msg::AsyncClangFormatResult result, const std::atomic<bool>& exit_flag);
+    // Moves up to `max_n` messages to `out`, returns the number of messages taken.
+    size_t try_dequeue_bulk(AppMsg* out, size_t max_n);
+    // Wakes the formatter threads waiting in `enqueue_result`, after their exit flag was set.
+    void wake_result_waiters();
+    size_t size_approx() const {
+        return queue.size_approx();
+    }
+    // Must be called before other threads start using the queue.
+    void set_wake_fn(std::function<void()> fn) {
+        wake_fn = std::move(fn);
+    }
+
+   private:
+    static constexpr size_t k_max_pending_results = 1024;
+
+    moodycamel::ConcurrentQueue<AppMsg> queue;
+    std::function<void()> wake_fn;
+    std::mutex results_mutex;
+    std::condition_variable results_cv;
+    size_t num_pending_results = 0;
+};
+// Multi-consumer: drained by all formatter threads.
+using ToAsyncClangFormatQueue = JobQueue;
+
+// The formatter job queued or running for a path. There's at most one per path, not counting
+// superseded checks which the formatter threads skip.
+struct JobInFlight {
+    // Incremented by every request for the path.
+    std::shared_ptr<std::atomic<uint64_t>> latest_generation =
+        std::make_shared<std::atomic<uint64_t>>(0);
+    int num_queued_or_running = 0;
+    // Of the latest job sent.
+    ACFMsg::Command command = ACFMsg::Command::CheckFormat;
+    JobPriority priority = JobPriority::Bulk;
+    // The latest request arrived while the job was in flight, to be repeated when it finishes, with
+    // the highest priority of the requests it replaced.
+    bool has_pending = false;
+    ACFMsg::Command pending_command = ACFMsg::Command::CheckFormat;
+    JobPriority pending_priority = JobPriority::Bulk;
+    std::filesystem::file_time_type pending_last_write_time = {};  // Of a check.
+};
+
+// A local API "format" request waiting for its files.
+struct IpcFormatWait {
+    IpcClientId client;
+    uint64_t request_id;
+    std::vector<std::string> paths;            // As requested.
+    std::vector<std::optional<FileId>> files;  // nullopt if not a file that can be formatted.
+    std::vector<std::optional<bool>> results;  // nullopt until formatted.
+    size_t num_pending;
+};
+
+enum class FileWatcher {
+    Fswatch,  // The system default libfswatch monitor.
+    Inotify,  // Linux only.
+    Fanotify  // Linux only, filesystem-wide marks, needs CAP_SYS_ADMIN. Falls back to Inotify.
 };
 
 struct State {
@@ -36,30 +170,58 @@ struct State {
         std::vector<std::filesystem::path> paths;
         std::set<std::filesystem::path> extensions = {
             ".cpp", ".cxx", ".c", ".m", ".mm", ".h", ".hpp", ".hxx"};
+        std::vector<std::string> include_globs, exclude_globs;
+        bool use_gitignore = true;
+        // Number of formatter threads, 0 means std::thread::hardware_concurrency().
+        int num_formatter_threads = 0;
+        ClangFormatBackend clang_format_backend = ClangFormatBackend::Auto;
+        bool use_verified_cache = true;
+        std::optional<std::filesystem::path> verified_cache_file;  // Default if nullopt.
+        bool headless = false;
+        bool auto_format = false;  // Headless only.
+        bool add_all_on_start = false;
+        bool add_changed_on_start = false;
+        // Check the staged content of the files and exit, instead of watching.
+        bool check_staged = false;
+        // Check and format only the changed lines of large files.
+        bool incremental_formatting = true;
+#if defined(__linux__)
+        FileWatcher file_watcher = FileWatcher::Inotify;
+#else
+        FileWatcher file_watcher = FileWatcher::Fswatch;
+#endif
+        size_t max_watches = 0;  // inotify watch budget, 0 means the system limit.
+        // Written periodically, JSON if the extension is .json, Prometheus text format otherwise.
+        std::optional<std::filesystem::path> metrics_file;
+        bool use_ipc = true;
+        std::optional<std::filesystem::path> ipc_socket;  // Default if nullopt.
     } options;
-    std::unordered_map<std::filesystem::path, std::filesystem::file_time_type> paths_formatted_at;
-    std::unordered_map<std::filesystem::path, std::filesystem::file_time_type>
-        paths_to_format_since;
+    // Every path seen, with the status of the files.
+    FileTable files;
+    std::unordered_map<FileId, JobInFlight> jobs_in_flight;
+    // Called when the status of a file in `files` changed.
+    std::function<void(FileId)> on_file_status_changed;
+    std::shared_ptr<VerifiedCache> verified_cache;
+    std::shared_ptr<ClangFormatConfigCache> clang_format_config_cache =
+        std::make_shared<ClangFormatConfigCache>();
     ToAppQueue to_app_queue;
     ToAsyncClangFormatQueue to_async_clang_format_queue;
-    std::thread async_clang_format;
+    std::vector<std::thread> async_clang_format_workers;
+    SelfWrites self_writes;  // By the formatter threads.
+    std::shared_ptr<PathFilter> path_filter;
+    std::unique_ptr<DirScanner> dir_scanner;  // For AddAll.
+    std::unique_ptr<DirScanner> rescanner;    // For Rescan.
+    std::future<void> add_changed;            // Running git for AddChanged.
+    // Canonical. `rescanning_dirs` is non-empty from the start of a rescan until its Rescanned
+    // message is handled.
+    std::vector<std::filesystem::path> rescanning_dirs, pending_rescan_dirs;
+    // The monitor reports the files written after this, so untracked files older than this are
+    // not added by a rescan.
+    std::filesystem::file_time_type watching_since;
+    // Local API, see ipc.h. Writes a line to a client, unset if there's no server.
+    std::function<void(IpcClientId, std::string)> ipc_send;
+    std::vector<IpcClientId> ipc_subscribers;
+    std::vector<IpcFormatWait> ipc_format_waits;
     std::atomic<bool> exit_flag;
+    std::chrono::steady_clock::time_point metrics_written_at = std::chrono::steady_clock::now();
 };
-
-namespace msg {
-struct Idle {};
-struct FormatAll {};
-struct AddAll {};
-struct FileChanged {
-    std::filesystem::path path;
-};
-struct FormatOne {
-    std::filesystem::path path;
-};
-struct TouchOne {
-    std::filesystem::path path;
-};
-struct AsyncClangFormatResult {
-    std::function<void()> completion;
-};
-}  // namespace msg
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "file_table.h"
+
 #include <functional>
 
 enum class ProcessMsgsResult { QueueWasEmpty, QueueWasNotEmpty, ShouldExit };
@@ -7,5 +9,7 @@ enum class ProcessMsgsResult { QueueWasEmpty, QueueWasNotEmpty, ShouldExit };
 class UI {
    public:
     virtual void exec(std::function<ProcessMsgsResult()> process_msgs_fn) = 0;
+    // Called on the app thread when the status of a file in `State::files` changed.
+    virtual void file_status_changed(FileId file) = 0;
     virtual ~UI() = default;
 };
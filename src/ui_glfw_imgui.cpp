@@ -11,18 +11,28 @@
 #include <imgui_impl_glfw.h>
 #include <imgui_impl_opengl3.h>
 
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
 namespace fs = std::filesystem;
 namespace chr = std::chrono;
 
 namespace {
 const std::string kEllipsis = "...";
+// ImGui needs a few frames to settle after an input (e.g. hover state, button size changes).
+constexpr int k_frames_per_activity = 3;
+constexpr auto k_focused_refresh_period = chr::seconds(1);
+constexpr auto k_unfocused_refresh_period = chr::seconds(5);
+constexpr auto k_process_msgs_budget = chr::milliseconds(8);
 void glfw_error_callback(int error, const char* description) {
     fprintf(stderr, "GLFW Error %d: %s\n", error, description);
     exit(EXIT_FAILURE);
 }
 
-enum class EllipsisFormat { Intact, UseEllipsis, ReplaceWithEllipsis, Nothing };
-
 std::string AgoText(fs::file_time_type::duration age) {
     if (age < chr::seconds(1)) {
         return fmt::format("{} ms", chr::duration_cast<chr::milliseconds>(age).count());
@@ -37,87 +47,138 @@ std::string AgoText(fs::file_time_type::duration age) {
     }
 }
 
-std::string FormatDirWithEllipsis(const std::string& s, EllipsisFormat ef) {
-    switch (ef) {
-        case EllipsisFormat::Intact:
-            return s;
-        case EllipsisFormat::UseEllipsis:
-            return kEllipsis + s;
-        case EllipsisFormat::ReplaceWithEllipsis:
-            return kEllipsis;
-        case EllipsisFormat::Nothing:
-            return {};
+// Decodes the UTF-8 code point at `p`, returns its length in bytes. Invalid sequences are decoded
+// byte by byte as U+FFFD.
+size_t DecodeUtf8(const char* p, const char* end, unsigned int& c) {
+    const auto b0 = static_cast<unsigned char>(*p);
+    size_t len = b0 < 0x80           ? 1
+               : (b0 >> 5) == 0x6  ? 2
+               : (b0 >> 4) == 0xe  ? 3
+               : (b0 >> 3) == 0x1e ? 4
+                                   : 0;
+    if (len == 0 || len > size_t(end - p)) {
+        c = 0xfffd;
+        return 1;
+    }
+    c = len == 1 ? b0 : (b0 & (0x7f >> len));
+    for (size_t i = 1; i < len; ++i) {
+        const auto b = static_cast<unsigned char>(p[i]);
+        if ((b & 0xc0) != 0x80) {
+            c = 0xfffd;
+            return 1;
+        }
+        c = (c << 6) | (b & 0x3f);
     }
+    return len;
 }
 
-std::string FormatFilenameWithEllipsis(const std::string& stem,
-                                       const std::string ext,
-                                       EllipsisFormat es) {
-    switch (es) {
-        case EllipsisFormat::Intact:
-            return stem + ext;
-        case EllipsisFormat::UseEllipsis:
-            return stem + kEllipsis + ext;
-        case EllipsisFormat::ReplaceWithEllipsis:
-            return kEllipsis;
-        case EllipsisFormat::Nothing:
-            return {};
+// Width of every prefix of a UTF-8 string in the current font, summed from the glyph advances the
+// same way ImGui::CalcTextSize does, in a single pass.
+class GlyphRun {
+   public:
+    explicit GlyphRun(std::string_view s) {
+        const ImFont* font = ImGui::GetFont();
+        const float scale = ImGui::GetFontSize() / font->FontSize;
+        offsets.push_back(0);
+        prefix_widths.push_back(0);
+        const char* const begin = s.data();
+        const char* const end = begin + s.size();
+        for (const char* p = begin; p < end;) {
+            unsigned int c;
+            p += DecodeUtf8(p, end, c);
+            if (sizeof(ImWchar) == 2 && c > 0xffff) {
+                c = 0xfffd;
+            }
+            offsets.push_back(size_t(p - begin));
+            prefix_widths.push_back(prefix_widths.back()
+                                    + font->GetCharAdvance(static_cast<ImWchar>(c)) * scale);
+        }
     }
+    // Number of code points.
+    size_t size() const {
+        return offsets.size() - 1;
+    }
+    size_t offset(size_t i) const {
+        return offsets[i];
+    }
+    // Unrounded width of the code points [begin, end).
+    float width(size_t begin, size_t end) const {
+        return prefix_widths[end] - prefix_widths[begin];
+    }
+
+   private:
+    std::vector<size_t> offsets;  // Byte offset of each code point, and the end.
+    std::vector<float> prefix_widths;
+};
+
+// Same rounding as ImGui::CalcTextSize.
+float RoundTextWidth(float w) {
+    return std::floor(w + 0.99999f);
 }
 
-std::pair<std::string, float> FitDirIntoWidth(std::string s, float max_width) {
-    auto ef = EllipsisFormat::Intact;
-    for (;;) {
-        auto es = FormatDirWithEllipsis(s, ef);
-        auto w = ImGui::CalcTextSize(es.c_str()).x;
-        if (w <= max_width) {
-            return std::make_pair(std::move(es), w);
-        }
-        switch (ef) {
-            case EllipsisFormat::Intact:
-            case EllipsisFormat::UseEllipsis:
-                if (s.size() <= 1) {
-                    ef = EllipsisFormat::ReplaceWithEllipsis;
-                } else {
-                    ef = EllipsisFormat::UseEllipsis;
-                    s = s.substr(1);
-                }
-                break;
-            case EllipsisFormat::ReplaceWithEllipsis:
-            case EllipsisFormat::Nothing:
-                return std::make_pair(std::string(), 0.0f);
+// Smallest `k` in [lo, hi) for which pred(k) is true, `hi` if none. `pred` must be monotonic.
+template<class Pred>
+size_t PartitionPoint(size_t lo, size_t hi, Pred pred) {
+    while (lo < hi) {
+        auto mid = lo + (hi - lo) / 2;
+        if (pred(mid)) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
         }
     }
+    return lo;
+}
+
+// Returns `s` or "..." + the longest suffix of `s` that fits, or "..." or nothing.
+std::pair<std::string, float> FitDirIntoWidth(const std::string& s, float max_width) {
+    const GlyphRun run(s);
+    const auto n = run.size();
+    if (auto w = RoundTextWidth(run.width(0, n)); w <= max_width) {
+        return std::make_pair(s, w);
+    }
+    const auto ellipsis_width = GlyphRun(kEllipsis).width(0, kEllipsis.size());
+    auto fits = [&](size_t k) {
+        return RoundTextWidth(ellipsis_width + run.width(k, n)) <= max_width;
+    };
+    // Drop the fewest leading code points, keep at least one.
+    if (auto k = PartitionPoint(1, n, fits); k < n) {
+        return std::make_pair(kEllipsis + s.substr(run.offset(k)),
+                              RoundTextWidth(ellipsis_width + run.width(k, n)));
+    }
+    if (auto w = RoundTextWidth(ellipsis_width); w <= max_width) {
+        return std::make_pair(kEllipsis, w);
+    }
+    return std::make_pair(std::string(), 0.0f);
 }
 
-std::pair<std::string, float> FitFilenameIntoWidth(std::string stem,
-                                                   std::string ext,
+// Returns stem + ext or the longest prefix of the stem that fits + "..." + ext without the dot, or
+// "..." or nothing.
+std::pair<std::string, float> FitFilenameIntoWidth(const std::string& stem,
+                                                   const std::string& ext,
                                                    float max_width) {
-    auto ef = EllipsisFormat::Intact;
-    for (;;) {
-        auto es = FormatFilenameWithEllipsis(stem, ext, ef);
-        auto w = ImGui::CalcTextSize(es.c_str()).x;
-        if (w <= max_width) {
-            return std::make_pair(std::move(es), w);
-        }
-        switch (ef) {
-            case EllipsisFormat::Intact:
-            case EllipsisFormat::UseEllipsis:
-                if (!ext.empty() && ext[0] == '.') {
-                    ext = ext.substr(1);
-                    ef = EllipsisFormat::UseEllipsis;
-                } else if (stem.size() > 1) {
-                    ef = EllipsisFormat::UseEllipsis;
-                    stem.pop_back();
-                } else {
-                    ef = EllipsisFormat::ReplaceWithEllipsis;
-                }
-                break;
-            case EllipsisFormat::ReplaceWithEllipsis:
-            case EllipsisFormat::Nothing:
-                return std::make_pair(std::string(), 0.0f);
-        }
+    const auto filename = stem + ext;
+    const GlyphRun run(filename);
+    if (auto w = RoundTextWidth(run.width(0, run.size())); w <= max_width) {
+        return std::make_pair(filename, w);
     }
+    const auto short_ext = !ext.empty() && ext[0] == '.' ? ext.substr(1) : ext;
+    const GlyphRun stem_run(stem);
+    const GlyphRun tail_run(kEllipsis + short_ext);
+    const auto tail_width = tail_run.width(0, tail_run.size());
+    auto does_not_fit = [&](size_t k) {
+        return RoundTextWidth(stem_run.width(0, k) + tail_width) > max_width;
+    };
+    // Keep the most leading code points of the stem, at least one.
+    if (auto k = PartitionPoint(1, stem_run.size() + 1, does_not_fit); k > 1) {
+        --k;
+        return std::make_pair(stem.substr(0, stem_run.offset(k)) + kEllipsis + short_ext,
+                              RoundTextWidth(stem_run.width(0, k) + tail_width));
+    }
+    if (auto w = RoundTextWidth(GlyphRun(kEllipsis).width(0, kEllipsis.size())); w <= max_width) {
+        return std::make_pair(kEllipsis, w);
+    }
+    return std::make_pair(std::string(), 0.0f);
 }
 
 fs::path RemoveBaseDirs(const std::vector<fs::path>& base_dirs, const fs::path& path) {
@@ -137,6 +198,130 @@ fs::path RemoveBaseDirs(const std::vector<fs::path>& base_dirs, const fs::path&
     }
     return path;
 }
+
+// The entries of the file list, updated incrementally on status changes. Entries are kept in
+// stable slots, `order` indexes them sorted by (time, slot).
+class FileListModel {
+   public:
+    struct Entry {
+        FileId file = 0;
+        fs::file_time_type time = {};
+        bool formatted = false;
+        // Computed when the row is first shown.
+        bool has_names = false;
+        // Relative to the closest watched directory, with trailing separator.
+        std::string dir = {};
+        std::string stem = {}, ext = {};
+        // The columns fitted into `fitted_max_width` with `fitted_font`, `fitted_font_size`. Only
+        // recomputed when those change.
+        float fitted_max_width = -1;
+        const ImFont* fitted_font = nullptr;
+        float fitted_font_size = 0;
+        std::string fitted_dir = {}, fitted_filename = {};
+        float fitted_dir_width = 0;
+
+        void fit(const State& ctx, float max_width) {
+            if (!has_names) {
+                auto relative_path = RemoveBaseDirs(ctx.options.paths, ctx.files.path(file));
+                dir = ToUtf8(relative_path.parent_path());
+                if (!dir.empty()) {
+                    dir += fs::path::preferred_separator;
+                }
+                stem = ToUtf8(relative_path.stem());
+                ext = ToUtf8(relative_path.extension());
+                has_names = true;
+            }
+            const ImFont* font = ImGui::GetFont();
+            const float font_size = ImGui::GetFontSize();
+            if (max_width == fitted_max_width && font == fitted_font
+                && font_size == fitted_font_size) {
+                return;
+            }
+            std::tie(fitted_dir, fitted_dir_width) = FitDirIntoWidth(dir, max_width);
+            fitted_filename = FitFilenameIntoWidth(stem, ext, max_width).first;
+            fitted_max_width = max_width;
+            fitted_font = font;
+            fitted_font_size = font_size;
+        }
+    };
+
+    // Number of rows.
+    size_t size() const {
+        return order.size();
+    }
+    // Row 0 is the most recent.
+    Entry& row(size_t i) {
+        return entries[order[order.size() - 1 - i]];
+    }
+    size_t slot_of_row(size_t i) const {
+        return order[order.size() - 1 - i];
+    }
+
+    void update(const State& ctx, FileId file) {
+        const auto status = ctx.files.status(file);
+        auto slot = file < slot_of_file.size() ? slot_of_file[file] : k_no_slot;
+        if (status == FileStatus::Untracked) {
+            if (slot != k_no_slot) {
+                remove_from_order(slot);
+                entries[slot] = Entry{};
+                free_slots.push_back(slot);
+                slot_of_file[file] = k_no_slot;
+            }
+            return;
+        }
+        if (slot == k_no_slot) {
+            slot = allocate_slot();
+            entries[slot] = Entry{.file = file};
+            if (file >= slot_of_file.size()) {
+                slot_of_file.resize(size_t(file) + 1, k_no_slot);
+            }
+            slot_of_file[file] = slot;
+        } else {
+            remove_from_order(slot);
+        }
+        entries[slot].time = ctx.files.time(file);
+        entries[slot].formatted = status == FileStatus::Formatted;
+        insert_into_order(slot);
+    }
+
+   private:
+    static constexpr uint32_t k_no_slot = UINT32_MAX;
+
+    uint32_t allocate_slot() {
+        if (free_slots.empty()) {
+            entries.emplace_back();
+            return uint32_t(entries.size() - 1);
+        }
+        auto slot = free_slots.back();
+        free_slots.pop_back();
+        return slot;
+    }
+
+    bool less(uint32_t a, uint32_t b) const {
+        return std::make_pair(entries[a].time, a) < std::make_pair(entries[b].time, b);
+    }
+
+    // Changes mostly come with the current time, so this is usually an append.
+    void insert_into_order(uint32_t slot) {
+        auto it = std::upper_bound(BE(order), slot, [this](uint32_t a, uint32_t b) {
+            return less(a, b);
+        });
+        order.insert(it, slot);
+    }
+
+    void remove_from_order(uint32_t slot) {
+        auto it = std::lower_bound(BE(order), slot, [this](uint32_t a, uint32_t b) {
+            return less(a, b);
+        });
+        assert(it != order.end() && *it == slot);
+        order.erase(it);
+    }
+
+    std::vector<Entry> entries;
+    std::vector<uint32_t> free_slots;
+    std::vector<uint32_t> slot_of_file;  // Indexed by `FileId`.
+    std::vector<uint32_t> order;
+};
 }  // namespace
 
 struct UI_GLFW_ImGui : public UI {
@@ -147,6 +332,7 @@ struct UI_GLFW_ImGui : public UI {
     std::optional<ImVec2> format_all_button_size;
     int window_has_focus = 1;
     bool dark_mode = false;
+    FileListModel file_list;
     UI_GLFW_ImGui(GLFWwindow* window, const State& ctx, ToAppQueue& to_app_queue)
         : window(window)
         , ctx(ctx)
@@ -161,14 +347,105 @@ struct UI_GLFW_ImGui : public UI {
         glfwTerminate();
     }
 
+    void file_status_changed(FileId file) override {
+        file_list.update(ctx, file);
+    }
+
     void ApplyDarkMode() {
         dark_mode ? ImGui::StyleColorsDark() : ImGui::StyleColorsLight();
     }
 
+    void render_row(FileListModel::Entry& e,
+                    size_t id,
+                    fs::file_time_type now,
+                    float max_path_width,
+                    float max_ago_text_width,
+                    float gap,
+                    float min_cursor_pos_x,
+                    float max_cursor_pos_x) {
+        e.fit(ctx, max_path_width / 2);
+        const auto& dir = e.fitted_dir;
+        const auto& filename = e.fitted_filename;
+        const auto dir_width = e.fitted_dir_width;
+
+        auto age = now - e.time;
+
+        // auto& style = ImGui::GetStyle();
+        //  ImGui::SetCursorPosY(ImGui::GetCursorPosY() + style.FramePadding.y);
+        const auto mp = ImGui::GetMousePos();
+        const auto cpy = ImGui::GetCursorScreenPos().y;
+        bool hover = min_cursor_pos_x <= mp.x && mp.x < max_cursor_pos_x && cpy <= mp.y
+                  && mp.y < cpy + ImGui::GetTextLineHeightWithSpacing();
+
+        ImGui::SetCursorPosX(max_cursor_pos_x - max_ago_text_width - gap - max_path_width / 2
+                             - dir_width);
+        ImGui::Selectable(fmt::format("{}##{}", dir, id).c_str());
+        ImGui::SameLine(max_cursor_pos_x - max_ago_text_width - gap - max_path_width / 2);
+
+        auto color = e.formatted ? (dark_mode ? ImVec4(0, 1, 0, 1) : ImVec4(0, 0.7, 0, 1))
+                                 : (dark_mode ? ImVec4(1, 0, 0, 1) : ImVec4(0.7, 0, 0, 1));
+        ImGui::TextColored(color, "%s", filename.c_str());
+        ImGui::SameLine(max_cursor_pos_x - max_ago_text_width);
+        // bool formatOne = false;
+        //  ImGui::SetCursorPosY(ImGui::GetCursorPosY() - style.FramePadding.y);
+        ImGui::TextUnformatted(AgoText(age).c_str());
+        if (hover) {
+            ImGui::SetTooltip(e.formatted ? "Touch!" : "Format!");
+            if (ImGui::IsMouseClicked(ImGuiMouseButton_Left)) {
+                if (e.formatted) {
+                    to_app_queue.enqueue(msg::TouchOne{e.file});
+                } else {
+                    to_app_queue.enqueue(msg::FormatOne{e.file});
+                }
+            }
+        }
+    }
+
+    void render_stats() {
+        ImGui::Text("App queue: %zu (max %llu), formatter queue: %zu (max %llu)",
+                    ctx.to_app_queue.size_approx(),
+                    static_cast<unsigned long long>(g_metrics.app_queue_max_depth),
+                    ctx.to_async_clang_format_queue.size_approx(),
+                    static_cast<unsigned long long>(g_metrics.job_queue_max_depth));
+        ImGui::Text(
+            "File events: %llu (overflows: %llu), jobs run: %llu, skipped: %llu, processes: %llu",
+            static_cast<unsigned long long>(g_metrics.fs_events),
+            static_cast<unsigned long long>(g_metrics.fs_overflows),
+            static_cast<unsigned long long>(g_metrics.jobs_run),
+            static_cast<unsigned long long>(g_metrics.jobs_skipped),
+            static_cast<unsigned long long>(g_metrics.processes_spawned));
+        if (!ImGui::BeginTable(
+                "stats", 6, ImGuiTableFlags_Borders | ImGuiTableFlags_SizingFixedFit)) {
+            return;
+        }
+        for (auto* h : {"Stage (ms)", "Count", "p50", "p90", "p99", "Max"}) {
+            ImGui::TableSetupColumn(h);
+        }
+        ImGui::TableHeadersRow();
+        auto ms = [](Histogram::Duration d) {
+            return chr::duration<double, std::milli>(d).count();
+        };
+        for (auto& [name, labels, h] : g_metrics.histograms()) {
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::TextUnformatted(
+                (labels.empty() ? std::string(name) : fmt::format("{} {}", name, labels)).c_str());
+            ImGui::TableNextColumn();
+            ImGui::Text("%llu", static_cast<unsigned long long>(h->count()));
+            for (auto d : {h->percentile(50), h->percentile(90), h->percentile(99), h->max()}) {
+                ImGui::TableNextColumn();
+                ImGui::Text("%.1f", ms(d));
+            }
+        }
+        ImGui::EndTable();
+    }
+
     void exec(std::function<ProcessMsgsResult()> process_msgs_fn) override {
         ImVec4 clear_color = ImVec4(0.45f, 0.55f, 0.60f, 1.00f);
         ApplyDarkMode();
         bool shouldExit = false;
+        int frames_to_render = k_frames_per_activity;
+        auto last_render_time = chr::steady_clock::now();
         while (!glfwWindowShouldClose(window) && !shouldExit) {
             // Poll and handle events (inputs, window resize, etc.)
             // You can read the io.WantCaptureMouse, io.WantCaptureKeyboard flags to tell if dear
@@ -179,7 +456,41 @@ struct UI_GLFW_ImGui : public UI {
             // main application, or clear/overwrite your copy of the keyboard data. Generally you
             // may always pass all inputs to dear imgui, and hide them from your application based
             // on those two flags.
-            glfwPollEvents();
+            if (frames_to_render > 0) {
+                glfwPollEvents();
+            } else {
+                // Sleep until there's input, a message (the queue's wake function posts an empty
+                // event) or the "ago" column needs a refresh. Whichever happened, render.
+                auto refresh_period =
+                    window_has_focus ? k_focused_refresh_period : k_unfocused_refresh_period;
+                auto wait = chr::duration<double>(refresh_period
+                                                  - (chr::steady_clock::now() - last_render_time));
+                if (wait.count() > 0) {
+                    glfwWaitEventsTimeout(wait.count());
+                }
+                frames_to_render = k_frames_per_activity;
+            }
+
+            // Process the pending messages within a time budget, the rest is processed after
+            // rendering this frame.
+            const auto msgs_deadline = chr::steady_clock::now() + k_process_msgs_budget;
+            for (bool done = false; !done;) {
+                switch (process_msgs_fn()) {
+                    case ProcessMsgsResult::QueueWasEmpty:
+                        done = true;
+                        break;
+                    case ProcessMsgsResult::QueueWasNotEmpty:
+                        if (chr::steady_clock::now() >= msgs_deadline) {
+                            frames_to_render = std::max(frames_to_render, 1);
+                            done = true;
+                        }
+                        break;
+                    case ProcessMsgsResult::ShouldExit:
+                        shouldExit = true;
+                        done = true;
+                        break;
+                }
+            }
 
             {
                 int focused = glfwGetWindowAttrib(window, GLFW_FOCUSED);
@@ -189,6 +500,7 @@ struct UI_GLFW_ImGui : public UI {
                 window_has_focus = focused;
             }
 
+            const auto frame_started_at = chr::steady_clock::now();
             // Start the Dear ImGui frame
             ImGui_ImplOpenGL3_NewFrame();
             ImGui_ImplGlfw_NewFrame();
@@ -210,7 +522,7 @@ struct UI_GLFW_ImGui : public UI {
                 const char* kFormatAllButtonLabel = "Format All";
 
                 if (format_all_button_size
-                    && (format_on_focus || ctx.paths_to_format_since.empty())) {
+                    && (format_on_focus || ctx.files.count(FileStatus::NeedsFormatting) == 0)) {
                     ImGui::InvisibleButton(kFormatAllButtonLabel, *format_all_button_size);
                 } else {
                     if (ImGui::Button(kFormatAllButtonLabel)) {
@@ -229,96 +541,44 @@ struct UI_GLFW_ImGui : public UI {
                     to_app_queue.enqueue(msg::AddAll{});
                 }
                 ImGui::SameLine();
+                if (ImGui::Button("Add Changed")) {
+                    to_app_queue.enqueue(msg::AddChanged{});
+                }
+                ImGui::SameLine();
                 ImGui::Checkbox("Dark", &new_dark_mode);
 
-                ImGui::Separator();
-
-                struct Entry {
-                    fs::path path;
-                    std::string dir, stem, ext;
-                    fs::file_time_type time;
-                    bool formatted;
-
-                    static Entry Make(const std::vector<fs::path>& base_dirs,
-                                      const fs::path& path_in,
-                                      fs::file_time_type time,
-                                      bool formatted) {
-                        auto path = RemoveBaseDirs(base_dirs, path_in);
-                        return Entry{path_in,
-                                     ToUtf8(path.parent_path()),
-                                     ToUtf8(path.stem()),
-                                     ToUtf8(path.extension()),
-                                     time,
-                                     formatted};
-                    }
-                };
-                std::vector<Entry> entries;
-                for (auto& [path, t] : ctx.paths_to_format_since) {
-                    entries.push_back(Entry::Make(ctx.options.paths, path, t, false));
-                }
-                for (auto& [path, t] : ctx.paths_formatted_at) {
-                    entries.push_back(Entry::Make(ctx.options.paths, path, t, true));
+                if (ImGui::CollapsingHeader("Stats")) {
+                    render_stats();
                 }
-                std::sort(BE(entries), [](const Entry& a, const Entry& b) {
-                    return b.time < a.time;
-                });
+
+                ImGui::Separator();
 
                 const auto now = fs::file_time_type::clock::now();
-                float max_ago_text_width =
-                    std::max(ImGui::CalcTextSize("Format!").x, ImGui::CalcTextSize("Touch!").x);
-                for (auto& e : entries) {
-                    auto age = now - e.time;
-                    auto agoText = AgoText(age);
-                    max_ago_text_width =
-                        std::max(max_ago_text_width, ImGui::CalcTextSize(agoText.c_str()).x);
+                // Widest texts the last column can have, so it doesn't depend on the visible rows.
+                // Files are often days old, up to 27 years fit.
+                float max_ago_text_width = 0;
+                for (auto* t :
+                     {"Format!", "Touch!", "999 ms", "59 sec", "59 min", "23 hrs", "9999 days"}) {
+                    max_ago_text_width = std::max(max_ago_text_width, ImGui::CalcTextSize(t).x);
                 }
                 const auto gap = ImGui::GetStyle().ItemInnerSpacing.x;
                 const auto min_cursor_pos_x = ImGui::GetCursorPosX();
                 const auto max_cursor_pos_x = ImGui::GetContentRegionMax().x;
                 const auto content_width = max_cursor_pos_x - min_cursor_pos_x;
                 const auto max_path_width = content_width - max_ago_text_width - gap;
-                static int counter = 0;
-                for (auto& e : entries) {
-                    auto edir = e.dir;
-                    if (!edir.empty()) {
-                        edir += fs::path::preferred_separator;
-                    }
-                    auto [dir, dir_width] = FitDirIntoWidth(edir, max_path_width / 2);
-                    auto [filename, filename_width] =
-                        FitFilenameIntoWidth(e.stem, e.ext, max_path_width / 2);
-
-                    auto age = now - e.time;
-
-                    // auto& style = ImGui::GetStyle();
-                    //  ImGui::SetCursorPosY(ImGui::GetCursorPosY() + style.FramePadding.y);
-                    const auto mp = ImGui::GetMousePos();
-                    const auto cpy = ImGui::GetCursorPos().y;
-                    bool hover = min_cursor_pos_x <= mp.x && mp.x < max_cursor_pos_x && cpy <= mp.y
-                              && mp.y < cpy + ImGui::GetTextLineHeightWithSpacing();
-
-                    ImGui::SetCursorPosX(max_cursor_pos_x - max_ago_text_width - gap
-                                         - max_path_width / 2 - dir_width);
-                    ImGui::Selectable(fmt::format("{}##{}", dir, counter++).c_str());
-                    ImGui::SameLine(max_cursor_pos_x - max_ago_text_width - gap
-                                    - max_path_width / 2);
-
-                    auto color = e.formatted
-                                   ? (dark_mode ? ImVec4(0, 1, 0, 1) : ImVec4(0, 0.7, 0, 1))
-                                   : (dark_mode ? ImVec4(1, 0, 0, 1) : ImVec4(0.7, 0, 0, 1));
-                    ImGui::TextColored(color, "%s", filename.c_str());
-                    ImGui::SameLine(max_cursor_pos_x - max_ago_text_width);
-                    // bool formatOne = false;
-                    //  ImGui::SetCursorPosY(ImGui::GetCursorPosY() - style.FramePadding.y);
-                    ImGui::TextUnformatted(AgoText(age).c_str());
-                    if (hover) {
-                        ImGui::SetTooltip(e.formatted ? "Touch!" : "Format!");
-                        if (ImGui::IsMouseClicked(ImGuiMouseButton_Left)) {
-                            if (e.formatted) {
-                                to_app_queue.enqueue(msg::TouchOne{e.path});
-                            } else {
-                                to_app_queue.enqueue(msg::FormatOne{e.path});
-                            }
-                        }
+                // Only the visible rows are laid out.
+                ImGuiListClipper clipper;
+                clipper.Begin(int(file_list.size()), ImGui::GetTextLineHeightWithSpacing());
+                while (clipper.Step()) {
+                    for (int row = clipper.DisplayStart; row < clipper.DisplayEnd; ++row) {
+                        render_row(file_list.row(row),
+                                   file_list.slot_of_row(row),
+                                   now,
+                                   max_path_width,
+                                   max_ago_text_width,
+                                   gap,
+                                   min_cursor_pos_x,
+                                   max_cursor_pos_x);
                     }
                 }
 
@@ -337,19 +597,10 @@ struct UI_GLFW_ImGui : public UI {
             glClear(GL_COLOR_BUFFER_BIT);
             ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 
-            auto sleep_time = chr::milliseconds(window_has_focus ? 1000 / 30 : 1000 / 10);
-            switch (process_msgs_fn()) {
-                case ProcessMsgsResult::QueueWasEmpty:
-                    break;
-                case ProcessMsgsResult::QueueWasNotEmpty:
-                    sleep_time = chr::milliseconds(0);
-                    break;
-                case ProcessMsgsResult::ShouldExit:
-                    shouldExit = true;
-                    break;
-            }
             glfwSwapBuffers(window);
-            std::this_thread::sleep_for(sleep_time);
+            last_render_time = chr::steady_clock::now();
+            g_metrics.frame_time.add(last_render_time - frame_started_at);
+            --frames_to_render;
 
             if (new_dark_mode != dark_mode) {
                 dark_mode = new_dark_mode;
@@ -442,5 +693,8 @@ std::unique_ptr<UI> make_ui_glfw_imgui(const State& ctx, ToAppQueue& to_app_queu
     // ImFont* font = io.Fonts->AddFontFromFileTTF("c:\\Windows\\Fonts\\ArialUni.ttf", 18.0f, NULL,
     // io.Fonts->GetGlyphRangesJapanese()); IM_ASSERT(font != NULL);
 
+    to_app_queue.set_wake_fn([]() {
+        glfwPostEmptyEvent();  // Thread-safe, wakes up glfwWaitEvents*.
+    });
     return std::make_unique<UI_GLFW_ImGui>(window, ctx, to_app_queue);
 }
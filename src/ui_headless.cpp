@@ -0,0 +1,84 @@
+#include "ui_headless.h"
+
+#include "state.h"
+#include "util.h"
+
+#include <fmt/format.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+
+namespace chr = std::chrono;
+
+namespace {
+// Upper bound of a sleep, to notice SIGINT, which can't wake us.
+constexpr auto k_max_wait = chr::milliseconds(250);
+}  // namespace
+
+struct UI_Headless : public UI {
+    const State& ctx;
+    ToAppQueue& to_app_queue;
+    const bool auto_format;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool woken = false;
+
+    UI_Headless(const State& ctx, ToAppQueue& to_app_queue, bool auto_format)
+        : ctx(ctx)
+        , to_app_queue(to_app_queue)
+        , auto_format(auto_format) {}
+
+    void wake() {
+        {
+            std::lock_guard lock(mutex);
+            woken = true;
+        }
+        cv.notify_one();
+    }
+
+    void exec(std::function<ProcessMsgsResult()> process_msgs_fn) override {
+        for (;;) {
+            switch (process_msgs_fn()) {
+                case ProcessMsgsResult::QueueWasNotEmpty:
+                    continue;
+                case ProcessMsgsResult::ShouldExit:
+                    return;
+                case ProcessMsgsResult::QueueWasEmpty:
+                    break;
+            }
+            fflush(stdout);
+            std::unique_lock lock(mutex);
+            cv.wait_for(lock, k_max_wait, [this]() {
+                return woken;
+            });
+            woken = false;
+        }
+    }
+
+    void file_status_changed(FileId file) override {
+        const auto path = ctx.files.path(file);
+        const auto status = ctx.files.status(file);
+        if (status == FileStatus::Untracked) {
+            fmt::print("{{\"path\":{},\"status\":\"removed\"}}\n", json_quote(ToUtf8(path)));
+            return;
+        }
+        const bool formatted = status == FileStatus::Formatted;
+        fmt::print("{{\"path\":{},\"status\":\"{}\",\"time_ms\":{}}}\n",
+                   json_quote(ToUtf8(path)),
+                   formatted ? "formatted" : "unformatted",
+                   ToUnixMilliseconds(ctx.files.time(file)));
+        if (auto_format && !formatted) {
+            to_app_queue.enqueue(msg::FormatOne{file});
+        }
+    }
+};
+
+std::unique_ptr<UI> make_ui_headless(const State& ctx, ToAppQueue& to_app_queue, bool auto_format) {
+    auto ui = std::make_unique<UI_Headless>(ctx, to_app_queue, auto_format);
+    to_app_queue.set_wake_fn([ui = ui.get()]() {
+        ui->wake();
+    });
+    return ui;
+}
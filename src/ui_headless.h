@@ -0,0 +1,10 @@
+#pragma once
+
+#include "state.h"
+#include "ui.h"
+
+#include <memory>
+
+// Event-driven UI without a window: sleeps until a message arrives and prints the file status
+// changes to stdout as JSON lines. Optionally formats every file found unformatted.
+std::unique_ptr<UI> make_ui_headless(const State& ctx, ToAppQueue& to_app_queue, bool auto_format);
@@ -1,8 +1,15 @@
 #include "util.h"
 
+#include <fmt/format.h>
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iterator>
 #include <string_view>
 
 namespace fs = std::filesystem;
+namespace chr = std::chrono;
 
 namespace {
 std::u8string_view reinterpret_u8(std::string_view s) {
@@ -42,6 +49,57 @@ std::optional<std::filesystem::file_time_type> fs_last_write_time_noexcept(
     return r;
 }
 
+std::optional<std::string> fs_read_file_noexcept(const std::filesystem::path& path) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f) {
+        return std::nullopt;
+    }
+    std::string content((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    if (f.bad()) {
+        return std::nullopt;
+    }
+    return content;
+}
+
+bool fs_write_file_noexcept(const std::filesystem::path& path, std::string_view content) {
+    std::ofstream f(path, std::ios::binary | std::ios::trunc);
+    if (!f) {
+        return false;
+    }
+    f.write(content.data(), std::streamsize(content.size()));
+    f.close();
+    return !f.fail();
+}
+
+std::optional<fs::file_time_type> fs_replace_file_noexcept(const fs::path& path,
+                                                           std::string_view content) {
+    std::error_code ec;
+    // Replace the target of a symlink, not the link.
+    auto target = fs::is_symlink(path, ec) ? fs::canonical(path, ec) : path;
+    if (ec) {
+        return std::nullopt;
+    }
+    auto tmp_file = target;
+    tmp_file += ".claford.tmp";
+    if (!fs_write_file_noexcept(tmp_file, content)) {
+        fs::remove(tmp_file, ec);
+        return std::nullopt;
+    }
+    if (auto permissions = fs::status(target, ec).permissions(); !ec) {
+        fs::permissions(tmp_file, permissions, ec);
+    }
+    // Kept by the rename, unlike the target's which may be changed by then.
+    auto last_write_time = fs_last_write_time_noexcept(tmp_file);
+    if (last_write_time) {
+        fs::rename(tmp_file, target, ec);
+    }
+    if (!last_write_time || ec) {
+        fs::remove(tmp_file, ec);
+        return std::nullopt;
+    }
+    return last_write_time;
+}
+
 std::string_view trim(std::string_view s) {
     while (!s.empty() && isspace(s[0])) {
         s.remove_prefix(1);
@@ -51,3 +109,69 @@ std::string_view trim(std::string_view s) {
     }
     return s;
 }
+
+int64_t ToUnixMilliseconds(fs::file_time_type t) {
+    auto st = chr::system_clock::now() + chr::duration_cast<chr::system_clock::duration>(
+                                             t - fs::file_time_type::clock::now());
+    return chr::duration_cast<chr::milliseconds>(st.time_since_epoch()).count();
+}
+
+std::string json_quote(std::string_view s) {
+    std::string r;
+    r.reserve(s.size() + 2);
+    r += '"';
+    for (char c : s) {
+        switch (c) {
+            case '"':
+                r += "\\\"";
+                break;
+            case '\\':
+                r += "\\\\";
+                break;
+            case '\n':
+                r += "\\n";
+                break;
+            case '\r':
+                r += "\\r";
+                break;
+            case '\t':
+                r += "\\t";
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    r += fmt::format("\\u{:04x}", int(c));
+                } else {
+                    r += c;
+                }
+        }
+    }
+    r += '"';
+    return r;
+}
+
+uint64_t hash64(std::string_view s, uint64_t seed) {
+    constexpr uint64_t m = 0xc6a4a7935bd1e995ULL;
+    constexpr int r = 47;
+    uint64_t h = seed ^ (s.size() * m);
+    const char* p = s.data();
+    const char* const end = p + (s.size() & ~size_t(7));
+    for (; p != end; p += 8) {
+        uint64_t k;
+        memcpy(&k, p, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    if (const size_t rest = s.size() & 7; rest != 0) {
+        uint64_t k = 0;
+        memcpy(&k, p, rest);
+        h ^= k;
+        h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <filesystem>
 #include <optional>
 #include <string>
@@ -7,10 +8,31 @@
 
 #define BE(X) (X).begin(), (X).end()
 
+template<>
+struct std::hash<std::filesystem::path> {
+    size_t operator()(const std::filesystem::path& x) const noexcept {
+        const std::filesystem::path::string_type& s = x.native();
+        return std::hash<std::filesystem::path::string_type>()(s);
+    }
+};
+
 std::filesystem::path PathFromUtf8(std::string_view s);
 std::string ToUtf8(const std::filesystem::path& path);
 bool fs_exists_noexcept(const std::filesystem::path& path);
 bool fs_is_directory_noexcept(const std::filesystem::path& path);
 std::optional<std::filesystem::file_time_type> fs_last_write_time_noexcept(
     const std::filesystem::path& path);
+std::optional<std::string> fs_read_file_noexcept(const std::filesystem::path& path);
+bool fs_write_file_noexcept(const std::filesystem::path& path, std::string_view content);
+// Writes a temporary file next to `path` and renames it over `path`, like `clang-format -i`: a
+// reader never sees a partially written file. Keeps the permissions. Returns the last write time of
+// the new file.
+std::optional<std::filesystem::file_time_type> fs_replace_file_noexcept(
+    const std::filesystem::path& path, std::string_view content);
 std::string_view trim(std::string_view s);
+// Milliseconds since the Unix epoch.
+int64_t ToUnixMilliseconds(std::filesystem::file_time_type t);
+// Returns `s` as a quoted JSON string literal.
+std::string json_quote(std::string_view s);
+// Fast non-cryptographic hash (MurmurHash64A).
+uint64_t hash64(std::string_view s, uint64_t seed = 0);
@@ -0,0 +1,316 @@
+#include "verified_cache.h"
+
+#include "util.h"
+
+#include <fmt/format.h>
+#include <nowide/cstdlib.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+namespace fs = std::filesystem;
+namespace bip = boost::interprocess;
+
+namespace {
+// Upper limit on the number of entries kept on disk (16 bytes each).
+constexpr size_t k_max_entries = size_t(1) << 20;
+
+struct Header {
+    char magic[8];
+    uint64_t version_hash;
+    uint64_t count;
+};
+constexpr char k_magic[8] = {'C', 'L', 'A', 'F', 'V', 'C', '2', '\0'};
+
+static_assert(sizeof(Header) % alignof(VerifiedCache::Key) == 0);
+}  // namespace
+
+VerifiedCache::VerifiedCache(fs::path file, std::string_view clang_format_version)
+    : file(std::move(file))
+    , version_hash(hash64(clang_format_version)) {
+    std::error_code ec;
+    const auto file_size = fs::file_size(this->file, ec);
+    if (ec || file_size < sizeof(Header)) {
+        return;
+    }
+    try {
+        mapping = bip::file_mapping(this->file.string().c_str(), bip::read_only);
+        region = bip::mapped_region(mapping, bip::read_only);
+    } catch (const bip::interprocess_exception& e) {
+        fmt::print(stderr, "Can't map {}: {}\n", ToUtf8(this->file), e.what());
+        region = bip::mapped_region();
+        return;
+    }
+    const auto* base = static_cast<const char*>(region.get_address());
+    Header header;
+    memcpy(&header, base, sizeof(Header));
+    if (memcmp(header.magic, k_magic, sizeof(k_magic)) != 0
+        || header.count > (region.get_size() - sizeof(Header)) / sizeof(Key)) {
+        fmt::print(stderr, "Ignoring invalid cache file {}\n", ToUtf8(this->file));
+        region = bip::mapped_region();
+        return;
+    }
+    if (header.version_hash != version_hash) {
+        // Written by a different clang-format, the results are not valid anymore.
+        region = bip::mapped_region();
+        return;
+    }
+    loaded_keys = std::span<const Key>(
+        static_cast<const Key*>(static_cast<const void*>(base + sizeof(Header))), header.count);
+}
+
+VerifiedCache::~VerifiedCache() = default;
+
+bool VerifiedCache::contains(const Key& key) {
+    std::lock_guard lock(mutex);
+    if (std::binary_search(BE(loaded_keys), key)) {
+        used_loaded_keys.insert(key);
+        return true;
+    }
+    return new_keys.contains(key);
+}
+
+void VerifiedCache::insert(const Key& key) {
+    std::lock_guard lock(mutex);
+    if (!std::binary_search(BE(loaded_keys), key)) {
+        new_keys.insert(key);
+    }
+}
+
+bool VerifiedCache::save() {
+    std::lock_guard lock(mutex);
+    if (new_keys.empty()) {
+        return true;
+    }
+    std::vector<Key> keys;
+    if (loaded_keys.size() + new_keys.size() <= k_max_entries) {
+        keys.assign(BE(loaded_keys));
+    } else {
+        keys.assign(BE(used_loaded_keys));
+    }
+    keys.insert(keys.end(), BE(new_keys));
+    std::sort(BE(keys));
+    keys.erase(std::unique(BE(keys)), keys.end());
+    if (keys.size() > k_max_entries) {
+        keys.resize(k_max_entries);
+    }
+
+    std::error_code ec;
+    fs::create_directories(file.parent_path(), ec);
+    auto tmp_file = file;
+    tmp_file += ".tmp";
+    {
+        std::ofstream f(tmp_file, std::ios::binary | std::ios::trunc);
+        Header header{.magic = {}, .version_hash = version_hash, .count = keys.size()};
+        memcpy(header.magic, k_magic, sizeof(k_magic));
+        f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        f.write(reinterpret_cast<const char*>(keys.data()),
+                std::streamsize(keys.size() * sizeof(Key)));
+        f.close();
+        if (f.fail()) {
+            fmt::print(stderr, "Can't write {}\n", ToUtf8(tmp_file));
+            return false;
+        }
+    }
+    // Unmap before replacing, required on Windows.
+    loaded_keys = {};
+    region = bip::mapped_region();
+    mapping = bip::file_mapping();
+    fs::rename(tmp_file, file, ec);
+    if (ec) {
+        fmt::print(stderr,
+                   "Can't rename {} to {}: {}\n",
+                   ToUtf8(tmp_file),
+                   ToUtf8(file),
+                   ec.message());
+        return false;
+    }
+    new_keys.clear();
+    used_loaded_keys.clear();
+    return true;
+}
+
+fs::path VerifiedCache::default_file() {
+    fs::path dir;
+    if (auto* xdg = nowide::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+        dir = PathFromUtf8(xdg);
+    } else if (auto* lad = nowide::getenv("LOCALAPPDATA"); lad && *lad) {
+        dir = PathFromUtf8(lad);
+    } else if (auto* home = nowide::getenv("HOME"); home && *home) {
+        dir = PathFromUtf8(home) / ".cache";
+    } else {
+        dir = fs::temp_directory_path();
+    }
+    return dir / "claford" / "verified.bin";
+}
+
+uint64_t VerifiedCache::content_hash(const fs::path& path, uint64_t content_hash64) {
+    return hash64(ToUtf8(path.extension()), content_hash64);
+}
+
+namespace {
+struct VerifyingClangFormat : public ClangFormat {
+    std::unique_ptr<ClangFormat> clang_format;
+    std::shared_ptr<VerifiedCache> verified_cache;
+    std::shared_ptr<ClangFormatConfigCache> config_cache;
+
+    VerifyingClangFormat(std::unique_ptr<ClangFormat> clang_format,
+                         std::shared_ptr<VerifiedCache> verified_cache,
+                         std::shared_ptr<ClangFormatConfigCache> config_cache)
+        : clang_format(std::move(clang_format))
+        , verified_cache(std::move(verified_cache))
+        , config_cache(std::move(config_cache)) {}
+
+    std::unique_ptr<ClangFormat> clone() const override {
+        return std::make_unique<VerifyingClangFormat>(
+            clang_format->clone(), verified_cache, config_cache);
+    }
+
+    const std::string& version() const override {
+        return clang_format->version();
+    }
+
+    CheckResult is_file_formatted(const fs::path& f) override {
+        auto key = key_of(f);
+        if (key && verified_cache->contains(*key)) {
+            return CheckResult::Formatted;
+        }
+        const auto result = clang_format->is_file_formatted(f);
+        // Only trust a whole-file result, and only if the file didn't change while it was checked.
+        if (result == CheckResult::Formatted && key && key == key_of(f)) {
+            verified_cache->insert(*key);
+        }
+        return result;
+    }
+
+    // Files known to be formatted are left alone, neither clang-format nor the write is needed.
+    std::optional<FormatResult> format_file_in_place(const fs::path& f) override {
+        auto snapshot = snapshot_of(f);
+        if (snapshot && verified_cache->contains(snapshot->key)) {
+            return snapshot->as_formatted;
+        }
+        auto result = clang_format->format_file_in_place(f);
+        // What was written, the file may have been saved again since.
+        if (result && !result->partial) {
+            verified_cache->insert(key_of(f, *result));
+        }
+        return result;
+    }
+
+    std::vector<CheckResult> are_files_formatted(std::span<const fs::path> files) override {
+        std::vector<CheckResult> result(files.size(), CheckResult::Formatted);
+        std::vector<std::optional<VerifiedCache::Key>> keys(files.size());
+        std::vector<fs::path> unknown_files;
+        std::vector<size_t> unknown_indices;
+        for (size_t i = 0; i < files.size(); ++i) {
+            keys[i] = key_of(files[i]);
+            if (!keys[i] || !verified_cache->contains(*keys[i])) {
+                unknown_files.push_back(files[i]);
+                unknown_indices.push_back(i);
+            }
+        }
+        if (unknown_files.empty()) {
+            return result;
+        }
+        auto unknown_result = clang_format->are_files_formatted(unknown_files);
+        for (size_t j = 0; j < unknown_indices.size(); ++j) {
+            const auto i = unknown_indices[j];
+            result[i] = unknown_result[j];
+            if (result[i] == CheckResult::Formatted && keys[i] && keys[i] == key_of(files[i])) {
+                verified_cache->insert(*keys[i]);
+            }
+        }
+        return result;
+    }
+
+    std::vector<std::optional<FormatResult>> format_files_in_place(
+        std::span<const fs::path> files) override {
+        std::vector<std::optional<FormatResult>> result(files.size());
+        std::vector<fs::path> unknown_files;
+        std::vector<size_t> unknown_indices;
+        for (size_t i = 0; i < files.size(); ++i) {
+            auto snapshot = snapshot_of(files[i]);
+            if (snapshot && verified_cache->contains(snapshot->key)) {
+                result[i] = snapshot->as_formatted;
+            } else {
+                unknown_files.push_back(files[i]);
+                unknown_indices.push_back(i);
+            }
+        }
+        if (unknown_files.empty()) {
+            return result;
+        }
+        auto unknown_result = clang_format->format_files_in_place(unknown_files);
+        for (size_t j = 0; j < unknown_indices.size(); ++j) {
+            const auto i = unknown_indices[j];
+            result[i] = unknown_result[j];
+            if (result[i] && !result[i]->partial) {
+                verified_cache->insert(key_of(files[i], *result[i]));
+            }
+        }
+        return result;
+    }
+
+    // Buffers known to be formatted are returned as they are, like the files.
+    std::optional<std::string> format_buffer(const fs::path& assumed_path,
+                                             const std::string& content,
+                                             std::span<const LineRange> lines) override {
+        const auto config_hash = config_cache->get(assumed_path.parent_path()).hash;
+        auto key_of_content = [&assumed_path, config_hash](const std::string& c) {
+            return VerifiedCache::Key{
+                .content_hash = VerifiedCache::content_hash(assumed_path, hash64(c)),
+                .config_hash = config_hash};
+        };
+        if (verified_cache->contains(key_of_content(content))) {
+            return content;
+        }
+        auto formatted = clang_format->format_buffer(assumed_path, content, lines);
+        // With `lines` the rest may still be unformatted.
+        if (formatted && lines.empty()) {
+            verified_cache->insert(key_of_content(*formatted));
+        }
+        return formatted;
+    }
+
+   private:
+    // The file's current content as a cache key, and as the result of a format finding it
+    // formatted.
+    struct Snapshot {
+        VerifiedCache::Key key;
+        FormatResult as_formatted;
+    };
+
+    std::optional<Snapshot> snapshot_of(const fs::path& f) {
+        auto last_write_time = fs_last_write_time_noexcept(f);
+        auto content = fs_read_file_noexcept(f);
+        if (!last_write_time || !content) {
+            return std::nullopt;
+        }
+        const auto as_formatted =
+            FormatResult{.content_hash = hash64(*content), .last_write_time = *last_write_time};
+        return Snapshot{.key = key_of(f, as_formatted), .as_formatted = as_formatted};
+    }
+
+    std::optional<VerifiedCache::Key> key_of(const fs::path& f) {
+        auto snapshot = snapshot_of(f);
+        return snapshot ? std::optional(snapshot->key) : std::nullopt;
+    }
+
+    // Of the content a format left in the file.
+    VerifiedCache::Key key_of(const fs::path& f, const FormatResult& result) {
+        return VerifiedCache::Key{
+            .content_hash = VerifiedCache::content_hash(f, result.content_hash),
+            .config_hash = config_cache->get(f.parent_path()).hash};
+    }
+};
+}  // namespace
+
+std::unique_ptr<ClangFormat> make_verifying_clang_format(
+    std::unique_ptr<ClangFormat> clang_format,
+    std::shared_ptr<VerifiedCache> verified_cache,
+    std::shared_ptr<ClangFormatConfigCache> config_cache) {
+    return std::make_unique<VerifyingClangFormat>(
+        std::move(clang_format), std::move(verified_cache), std::move(config_cache));
+}
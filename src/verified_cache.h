@@ -0,0 +1,67 @@
+#pragma once
+
+#include "clang_format.h"
+#include "clang_format_config.h"
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string_view>
+#include <unordered_set>
+
+// Persistent set of (content hash, .clang-format hash) pairs known to be formatted by a specific
+// clang-format version. Survives restarts so unchanged files don't need to be checked again.
+//
+// File layout: Header, followed by `count` sorted Keys. The file is memory-mapped, lookups are
+// binary searches in the mapping, new keys are kept in memory until `save()`.
+class VerifiedCache {
+   public:
+    struct Key {
+        uint64_t content_hash;
+        uint64_t config_hash;
+        auto operator<=>(const Key&) const = default;
+    };
+
+    // Loads `file` if it exists and was written for the same clang-format version.
+    VerifiedCache(std::filesystem::path file, std::string_view clang_format_version);
+    ~VerifiedCache();
+
+    bool contains(const Key& key);
+    void insert(const Key& key);
+    // Writes the loaded and the new keys back to the file.
+    bool save();
+
+    // $XDG_CACHE_HOME/claford/verified.bin or platform equivalent.
+    static std::filesystem::path default_file();
+    // Of the file at `path` whose content's hash64 is `content_hash64`. The extension is mixed
+    // in since it can affect the detected language.
+    static uint64_t content_hash(const std::filesystem::path& path, uint64_t content_hash64);
+
+   private:
+    struct KeyHash {
+        size_t operator()(const Key& k) const noexcept {
+            return size_t(k.content_hash ^ (k.config_hash * 0x9e3779b97f4a7c15ULL));
+        }
+    };
+
+    const std::filesystem::path file;
+    const uint64_t version_hash;
+    std::mutex mutex;
+    boost::interprocess::file_mapping mapping;
+    boost::interprocess::mapped_region region;
+    std::span<const Key> loaded_keys;
+    std::unordered_set<Key, KeyHash> new_keys;
+    std::unordered_set<Key, KeyHash> used_loaded_keys;  // To decide what to keep when full.
+};
+
+// Wraps a ClangFormat instance, skipping the check of files found in `verified_cache` and adding
+// the files found or made formatted.
+std::unique_ptr<ClangFormat> make_verifying_clang_format(
+    std::unique_ptr<ClangFormat> clang_format,
+    std::shared_ptr<VerifiedCache> verified_cache,
+    std::shared_ptr<ClangFormatConfigCache> config_cache);
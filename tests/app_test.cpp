@@ -0,0 +1,82 @@
+// Tests of the app thread's job bookkeeping, driven through ProcessMsgs without formatter threads.
+// Exits with failure and prints the failed checks if any.
+
+#include "app.h"
+#include "util.h"
+
+#include <fmt/format.h>
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+#define CHECK(x)                                                                     \
+    do {                                                                             \
+        if (!(x)) {                                                                  \
+            fmt::print(stderr, "{}:{}: CHECK failed: {}\n", __FILE__, __LINE__, #x); \
+            ++g_num_failures;                                                        \
+        }                                                                            \
+    } while (false)
+
+namespace {
+int g_num_failures = 0;
+
+void Drain(State& ctx) {
+    while (ProcessMsgs(ctx) != ProcessMsgsResult::QueueWasEmpty) {
+    }
+}
+
+// A removed file stays removed when the check in flight for it completes afterwards, and the
+// check requested meanwhile is not repeated.
+void TestRemovedFileIsNotCheckedAgain(const fs::path& dir) {
+    State ctx;
+    ctx.options.paths = {dir};
+    const auto path = dir / "a.cpp";
+    CHECK(fs_write_file_noexcept(path, "int a;\n"));
+    ctx.to_app_queue.enqueue(msg::FileChanged{.path = path});
+    Drain(ctx);
+    // A different last write time, the file isn't known to be formatted at it either way.
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CHECK(fs_write_file_noexcept(path, "int b;\n"));
+    ctx.to_app_queue.enqueue(msg::FileChanged{.path = path});
+    Drain(ctx);
+    fs::remove(path);
+    ctx.to_app_queue.enqueue(msg::FileChanged{.path = path});
+    Drain(ctx);
+
+    std::array<ACFMsg, 8> jobs;
+    const auto n = ctx.to_async_clang_format_queue.wait_dequeue_bulk_timed(jobs.data(), 8, 0);
+    CHECK(n == 1);
+    if (n != 1) {
+        return;
+    }
+    ctx.to_app_queue.enqueue(msg::AsyncClangFormatResult{.file = jobs[0].file,
+                                                         .command = jobs[0].command,
+                                                         .generation = jobs[0].generation,
+                                                         .last_write_time = jobs[0].last_write_time,
+                                                         .result = false});
+    Drain(ctx);
+    CHECK(ctx.files.status(jobs[0].file) == FileStatus::Untracked);
+    CHECK(ctx.to_async_clang_format_queue.size_approx() == 0);
+    CHECK(ctx.jobs_in_flight.empty());
+}
+}  // namespace
+
+int main() {
+    const auto dir = fs::temp_directory_path() / "claford_app_test";
+    std::error_code ec;
+    fs::remove_all(dir, ec);
+    fs::create_directories(dir);
+    TestRemovedFileIsNotCheckedAgain(dir);
+    fs::remove_all(dir, ec);
+    if (g_num_failures != 0) {
+        fmt::print(stderr, "{} checks failed\n", g_num_failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
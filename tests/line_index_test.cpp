@@ -0,0 +1,168 @@
+// Tests of HashLines and ChangedLineRanges. Exits with failure and prints the failed checks if any.
+
+#include "line_index.h"
+
+#include <fmt/format.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+#include <string>
+#include <vector>
+
+#define CHECK(x)                                                                     \
+    do {                                                                             \
+        if (!(x)) {                                                                  \
+            fmt::print(stderr, "{}:{}: CHECK failed: {}\n", __FILE__, __LINE__, #x); \
+            ++g_num_failures;                                                        \
+        }                                                                            \
+    } while (false)
+
+namespace {
+int g_num_failures = 0;
+
+// `n` distinct line hashes.
+std::vector<uint32_t> Lines(size_t n) {
+    std::vector<uint32_t> result;
+    for (size_t i = 0; i < n; ++i) {
+        result.push_back(uint32_t(i + 1));
+    }
+    return result;
+}
+
+using Ranges = std::optional<std::vector<LineRange>>;
+
+Ranges R(std::vector<LineRange> ranges) {
+    return ranges;
+}
+
+void TestHashLines() {
+    CHECK(HashLines("").empty());
+    CHECK(HashLines("a").size() == 1);
+    CHECK(HashLines("a\n").size() == 1);
+    CHECK(HashLines("a\nb\n").size() == 2);
+    CHECK(HashLines("a\n\nb").size() == 3);
+    const auto h = HashLines("x\ny\nx\n");
+    CHECK(h[0] == h[2]);
+    CHECK(h[0] != h[1]);
+}
+
+void TestUnchanged() {
+    const auto lines = Lines(100);
+    CHECK(ChangedLineRanges(lines, lines) == R({}));
+}
+
+void TestEmpty() {
+    CHECK(ChangedLineRanges(Lines(100), {}) == std::nullopt);
+    // Everything inserted.
+    CHECK(ChangedLineRanges({}, Lines(100)) == std::nullopt);
+}
+
+void TestInsert() {
+    const auto old_lines = Lines(100);
+    auto new_lines = old_lines;
+    new_lines.insert(new_lines.begin() + 10, 1000);
+    CHECK(ChangedLineRanges(old_lines, new_lines) == R({{11, 11}}));
+    // At the beginning and at the end.
+    new_lines = old_lines;
+    new_lines.insert(new_lines.begin(), 1000);
+    CHECK(ChangedLineRanges(old_lines, new_lines) == R({{1, 1}}));
+    new_lines = old_lines;
+    new_lines.push_back(1000);
+    CHECK(ChangedLineRanges(old_lines, new_lines) == R({{101, 101}}));
+}
+
+void TestRemove() {
+    // The lines around a removed one.
+    const auto old_lines = Lines(100);
+    auto new_lines = old_lines;
+    new_lines.erase(new_lines.begin() + 10);
+    CHECK(ChangedLineRanges(old_lines, new_lines) == R({{10, 11}}));
+    new_lines = old_lines;
+    new_lines.erase(new_lines.begin());
+    CHECK(ChangedLineRanges(old_lines, new_lines) == R({{1, 1}}));
+    new_lines = old_lines;
+    new_lines.pop_back();
+    CHECK(ChangedLineRanges(old_lines, new_lines) == R({{99, 99}}));
+}
+
+void TestReplace() {
+    // Removed and inserted, with the line before the removed ones.
+    const auto old_lines = Lines(100);
+    auto new_lines = old_lines;
+    new_lines[50] = 1000;
+    new_lines[51] = 1001;
+    CHECK(ChangedLineRanges(old_lines, new_lines) == R({{50, 52}}));
+}
+
+void TestMerge() {
+    const auto old_lines = Lines(100);
+    auto new_lines = old_lines;
+    // Close changes are merged, far ones are not.
+    new_lines[10] = 1000;
+    new_lines[13] = 1001;
+    new_lines[60] = 1002;
+    CHECK(ChangedLineRanges(old_lines, new_lines) == R({{10, 14}, {60, 61}}));
+}
+
+void TestRepeatedLines() {
+    // Blank lines and braces repeat, the diff must still find the edit.
+    const std::vector<uint32_t> old_lines = {1, 2, 2, 2, 3, 2, 2, 2, 4, 5, 6, 7, 8, 9, 10};
+    std::vector<uint32_t> new_lines = old_lines;
+    new_lines.insert(new_lines.begin() + 6, 2);
+    const auto ranges = ChangedLineRanges(old_lines, new_lines);
+    CHECK(ranges && ranges->size() == 1 && (*ranges)[0].first >= 6 && (*ranges)[0].last <= 9);
+}
+
+void TestTooLarge() {
+    // More than half of the lines changed.
+    const auto old_lines = Lines(100);
+    auto new_lines = old_lines;
+    for (size_t i = 0; i < 60; ++i) {
+        new_lines[i] = uint32_t(1000 + i);
+    }
+    CHECK(ChangedLineRanges(old_lines, new_lines) == std::nullopt);
+    // Beyond the maximum edit distance.
+    const auto big_old_lines = Lines(5000);
+    auto big_new_lines = big_old_lines;
+    for (size_t i = 0; i < 600; ++i) {
+        big_new_lines[1000 + 2 * i] = uint32_t(10000 + i);
+    }
+    CHECK(ChangedLineRanges(big_old_lines, big_new_lines) == std::nullopt);
+}
+
+void TestTooFragmented() {
+    const auto old_lines = Lines(1000);
+    auto new_lines = old_lines;
+    for (size_t i = 0; i < 20; ++i) {
+        new_lines[i * 40] = uint32_t(10000 + i);
+    }
+    CHECK(ChangedLineRanges(old_lines, new_lines) == std::nullopt);
+    // A few less is fine.
+    new_lines = old_lines;
+    for (size_t i = 0; i < 10; ++i) {
+        new_lines[i * 40] = uint32_t(10000 + i);
+    }
+    const auto ranges = ChangedLineRanges(old_lines, new_lines);
+    CHECK(ranges && ranges->size() == 10);
+}
+}  // namespace
+
+int main() {
+    TestHashLines();
+    TestUnchanged();
+    TestEmpty();
+    TestInsert();
+    TestRemove();
+    TestReplace();
+    TestMerge();
+    TestRepeatedLines();
+    TestTooLarge();
+    TestTooFragmented();
+    if (g_num_failures != 0) {
+        fmt::print(stderr, "{} checks failed\n", g_num_failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}